@@ -0,0 +1,169 @@
+// Counts heap allocations per streamed frame once a client is up and running,
+// which should be none since frames and packages come from the buffer pool.
+// Other clients stream variants of the same frames alongside, so that the
+// server scales, converts and encodes them too. Encoding and flipping are also
+// counted on a pool with workers, which the shared pool has none of on a
+// single core.
+#include "argparser.hpp"
+#include "jpeg-encoder.hpp"
+#include "scaler.hpp"
+#include "tcp-stream.hpp"
+#include "test-pattern-stream.hpp"
+#include "video-server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Every operator new in the program, on all threads.
+static atomic<uint64_t> heapAllocations = 0;
+
+void *operator new(size_t size) {
+    ++heapAllocations;
+    if (void *p = malloc(size == 0 ? 1 : size))
+        return p;
+    throw bad_alloc();
+}
+
+// GCC warns about the free() below, not seeing that operator new is malloc().
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// A client streaming a variant of the frames, in a thread of its own.
+struct Variant {
+    int width;
+    int height;
+    int format;
+    int quality;
+    atomic<uint64_t> frames = 0;
+};
+
+void streamVariant(int port, Variant &variant, const atomic<bool> &stop) {
+    TcpStream stream("127.0.0.1", port, variant.width, variant.height,
+                     variant.format, false, variant.quality);
+    while (!stop) {
+        stream.update();
+        ++variant.frames;
+    }
+}
+
+// Heap allocations per frame of encoding MJPEG and flipping, split up on a
+// pool of its own.
+double poolAllocations(int width, int height, int frames, size_t threads) {
+    ThreadPool pool(threads);
+    TestPatternStream pattern(width, height, V4L2_PIX_FMT_YUYV, 1000);
+    pattern.update();
+    const auto *src = static_cast<const uint8_t *>(pattern.getBuffer());
+    Buffer jpeg = makeBuffer();
+    Buffer flipped = makeBuffer(pattern.getBufferSize());
+    auto frame = [&] {
+        JpegEncoder::shared(75).encode(src, width, height, jpeg, pool);
+        pool.parallelRows(height, [&](int begin, int end) {
+            flipYuyv(src, flipped.data(), width, height, begin, end);
+        });
+    };
+
+    for (int i = 0; i < 20; ++i)
+        frame();
+    const uint64_t heapBefore = heapAllocations;
+    for (int i = 0; i < frames; ++i)
+        frame();
+    return static_cast<double>(heapAllocations - heapBefore) / frames;
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut allocation benchmark");
+    parser.description("Heap allocations per frame in steady state.");
+    parser.addArg("width").optional("-x").defaultValue(1280);
+    parser.addArg("height").optional("-y").defaultValue(720);
+    parser.addArg("frames").optional("-n").defaultValue(100);
+    parser.addArg("format").optional("-c").defaultValue("yuyv").description(
+        "Pixel format to stream in.");
+    parser.addArg("single").optional("-s").defaultValue(false).description(
+        "Don't stream scaled, I420 and server encoded MJPEG frames to other "
+        "clients alongside.");
+    parser.parse(argc, argv);
+
+    const int width = parser.get<int>("width");
+    const int height = parser.get<int>("height");
+    const int frames = parser.get<int>("frames");
+    const int format = formatFromString(parser.get<string>("format"));
+
+    CaptureConfig cfg;
+    cfg.openStream = [](int w, int h, int f) {
+        return make_unique<TestPatternStream>(w, h, f, 200);
+    };
+    VideoServer server(0, cfg);
+    thread serverThread([&server] { server.run(); });
+
+    // Halving takes the box filter and two thirds the bilinear one.
+    vector<unique_ptr<Variant>> variants;
+    auto addVariant = [&variants](int w, int h, int f, int quality) {
+        variants.push_back(make_unique<Variant>(w & ~1, h & ~1, f, quality));
+    };
+    if (!parser.get<bool>("single")) {
+        addVariant(width / 2, height / 2, V4L2_PIX_FMT_YUYV, 0);
+        addVariant(width * 2 / 3, height * 2 / 3, V4L2_PIX_FMT_YUYV, 0);
+        addVariant(width, height, V4L2_PIX_FMT_YUV420, 0);
+        addVariant(width / 2, height / 2, V4L2_PIX_FMT_MJPEG, 75);
+    }
+    atomic<bool> stopVariants = false;
+    vector<thread> variantThreads;
+    for (auto &v : variants)
+        variantThreads.emplace_back(streamVariant, server.port(), ref(*v),
+                                    cref(stopVariants));
+
+    {
+        TcpStream stream("127.0.0.1", server.port(), width, height, format);
+        // Let every buffer reach its final size first, in every variant.
+        for (int i = 0; i < 20; ++i)
+            stream.update();
+        for (auto &v : variants) {
+            while (v->frames < 20)
+                this_thread::sleep_for(chrono::milliseconds(10));
+        }
+
+        const uint64_t heapBefore = heapAllocations;
+        const auto poolBefore = BufferPool::shared().stats();
+        for (int i = 0; i < frames; ++i)
+            stream.update();
+        const uint64_t heap = heapAllocations - heapBefore;
+        const auto pool = BufferPool::shared().stats();
+
+        cout << "Frames: " << frames << "\n"
+             << "Heap allocations per frame: "
+             << static_cast<double>(heap) / frames << "\n"
+             << "Pool allocations per frame: "
+             << static_cast<double>(pool.allocations - poolBefore.allocations) /
+                    frames
+             << "\n"
+             << "Pool allocations from the system: "
+             << pool.systemAllocations - poolBefore.systemAllocations << "\n";
+        for (auto &v : variants)
+            cout << "Variant " << v->width << "x" << v->height << " "
+                 << formatToString(v->format) << ": " << v->frames
+                 << " frames\n";
+    }
+
+    stopVariants = true;
+    for (auto &thread : variantThreads)
+        thread.join();
+
+    server.stop();
+    serverThread.join();
+
+    const size_t threads = 4;
+    const double perFrame = poolAllocations(width, height, frames, threads);
+    cout << "Heap allocations per frame encoding and flipping on " << threads
+         << " threads: " << perFrame << "\n";
+}
@@ -0,0 +1,107 @@
+// Measures the throughput of the colour space conversion kernels and of the
+// YUYV scalers for every SIMD level that the CPU supports. Throughput is given
+// in MB/s of source frame data.
+#include "argparser.hpp"
+#include "convert.hpp"
+#include "scaler.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+
+template <typename Kernel>
+double measure(Kernel &&kernel, const vector<uint8_t> &src,
+               vector<uint8_t> &dst, int width, int height, int iterations) {
+    // Warm up caches and branch predictors.
+    kernel(src.data(), dst.data(), width, height);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        kernel(src.data(), dst.data(), width, height);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    return static_cast<double>(src.size()) * iterations / elapsed.count() /
+           1e6;
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut conversion benchmark");
+    parser.description(
+        "Throughput of the colour space conversion and scaling kernels.");
+    parser.addArg("iterations").optional("-n").defaultValue(50).description(
+        "Conversions per kernel and resolution.");
+    parser.parse(argc, argv);
+    const int iterations = parser.get<int>("iterations");
+
+    const pair<int, int> resolutions[] = {{1280, 720}, {1920, 1080}};
+    const pair<int, int> conversions[] = {
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12},
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_YUV420},
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_GREY},
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_RGB24},
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY},
+        {V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV},
+        {V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUYV},
+        {V4L2_PIX_FMT_GREY, V4L2_PIX_FMT_YUYV},
+        {V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_YUYV},
+        {V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420},
+        {V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_NV12}};
+
+    cout << left << setw(16) << "kernel" << setw(12) << "resolution";
+    for (int l = 0; l <= static_cast<int>(simdLevel()); ++l) {
+        cout << right << setw(10)
+             << simdLevelToString(static_cast<SimdLevel>(l));
+    }
+    cout << "  (MB/s)\n";
+
+    for (auto [srcFormat, dstFormat] : conversions) {
+        for (auto [width, height] : resolutions) {
+            vector<uint8_t> src(frameSize(srcFormat, width, height));
+            vector<uint8_t> dst(frameSize(dstFormat, width, height));
+            for (auto &b : src)
+                b = static_cast<uint8_t>(rand());
+
+            cout << left << setw(16)
+                 << formatToString(srcFormat) + "->" + formatToString(dstFormat)
+                 << setw(12)
+                 << to_string(width) + "x" + to_string(height);
+            for (int l = 0; l <= static_cast<int>(simdLevel()); ++l) {
+                auto kernel = convertKernel(srcFormat, dstFormat,
+                                            static_cast<SimdLevel>(l));
+                cout << right << setw(10) << fixed << setprecision(0)
+                     << measure(kernel, src, dst, width, height, iterations);
+            }
+            cout << endl;
+        }
+    }
+
+    // Box filtering for 1/2 and 1/3, bilinear for 2/3.
+    const pair<int, int> scales[] = {{1, 2}, {1, 3}, {2, 3}};
+    for (auto [num, den] : scales) {
+        for (auto [width, height] : resolutions) {
+            vector<uint8_t> src(frameSize(V4L2_PIX_FMT_YUYV, width, height));
+            for (auto &b : src)
+                b = static_cast<uint8_t>(rand());
+            const int dstWidth = (width * num / den) & ~1;
+            const int dstHeight = height * num / den;
+            vector<uint8_t> dst(
+                frameSize(V4L2_PIX_FMT_YUYV, dstWidth, dstHeight));
+
+            cout << left << setw(16)
+                 << "scale " + to_string(num) + "/" + to_string(den)
+                 << setw(12) << to_string(width) + "x" + to_string(height);
+            for (int l = 0; l <= static_cast<int>(simdLevel()); ++l) {
+                auto kernel = [&, level = static_cast<SimdLevel>(l)](
+                                  const uint8_t *s, uint8_t *d, int w, int h) {
+                    scaleYuyv(s, w, h, d, dstWidth, dstHeight, level);
+                };
+                cout << right << setw(10) << fixed << setprecision(0)
+                     << measure(kernel, src, dst, width, height, iterations);
+            }
+            cout << endl;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+// Measures the time from connecting to a server until the first frame has
+// arrived, both when the server has to open its capture device (cold) and when
+// a previous client has just left it warm.
+#include "argparser.hpp"
+#include "tcp-stream.hpp"
+#include "test-pattern-stream.hpp"
+#include "video-server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+double timeToFirstFrame(int port, int width, int height) {
+    auto start = chrono::steady_clock::now();
+    TcpStream stream("127.0.0.1", port, width, height, V4L2_PIX_FMT_YUYV);
+    stream.update();
+    chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+void report(const string &name, vector<double> times) {
+    sort(times.begin(), times.end());
+    cout << name << ": median " << times[times.size() / 2] << " ms, min "
+         << times.front() << " ms, max " << times.back() << " ms\n";
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut time to first frame benchmark");
+    parser.description("Time to first frame with a cold and a warm server.");
+    parser.addArg("width").optional("-x").defaultValue(1280);
+    parser.addArg("height").optional("-y").defaultValue(720);
+    parser.addArg("runs").optional("-n").defaultValue(5);
+    parser.addArg("idle").optional("-i").defaultValue(300).description(
+        "Idle timeout of the server in milliseconds.");
+    parser.addArg("camera").optional("-c").defaultValue(false).description(
+        "Use the camera instead of a test pattern.");
+    parser.parse(argc, argv);
+
+    const int width = parser.get<int>("width");
+    const int height = parser.get<int>("height");
+    const int idle = parser.get<int>("idle");
+
+    CaptureConfig cfg;
+    cfg.idleTimeoutMs = idle;
+    if (!parser.get<bool>("camera")) {
+        cfg.openStream = [](int w, int h, int format) {
+            return make_unique<TestPatternStream>(w, h, format);
+        };
+    }
+
+    VideoServer server(0, cfg);
+    thread serverThread([&server] { server.run(); });
+
+    vector<double> cold, warm;
+    for (int i = 0; i < parser.get<int>("runs"); ++i) {
+        // Let the server close the device.
+        this_thread::sleep_for(chrono::milliseconds(idle + 200));
+        cold.push_back(timeToFirstFrame(server.port(), width, height));
+        warm.push_back(timeToFirstFrame(server.port(), width, height));
+    }
+
+    server.stop();
+    serverThread.join();
+
+    report("Cold start", cold);
+    report("Warm start", warm);
+}
@@ -0,0 +1,71 @@
+// Measures how flipping a YUYV frame scales with the number of threads of the
+// thread pool, from one thread up to one per core.
+#include "argparser.hpp"
+#include "scaler.hpp"
+#include "thread-pool.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+double measure(ThreadPool &pool, const vector<uint8_t> &src,
+               vector<uint8_t> &dst, int width, int height, int iterations) {
+    auto flip = [&] {
+        pool.parallelRows(height, [&](int begin, int end) {
+            flipYuyv(src.data(), dst.data(), width, height, begin, end);
+        });
+    };
+    // Warm up caches and wake up the workers.
+    flip();
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        flip();
+    chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - start;
+
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut flip benchmark");
+    parser.description("Time to flip a frame with 1 to N threads.");
+    parser.addArg("iterations").optional("-n").defaultValue(100).description(
+        "Flips per resolution and number of threads.");
+    parser.addArg("threads")
+        .optional("-t")
+        .defaultValue(static_cast<int>(thread::hardware_concurrency()))
+        .description("Largest number of threads to measure with.");
+    parser.parse(argc, argv);
+    const int iterations = parser.get<int>("iterations");
+    const int maxThreads = max(1, parser.get<int>("threads"));
+
+    const pair<int, int> resolutions[] = {
+        {1280, 720}, {1920, 1080}, {3840, 2160}};
+
+    cout << left << setw(12) << "resolution" << right << setw(10) << "threads"
+         << setw(12) << "ms/frame" << setw(10) << "speedup\n";
+    for (auto [width, height] : resolutions) {
+        vector<uint8_t> src(static_cast<size_t>(width) * height * 2);
+        vector<uint8_t> dst(src.size());
+        for (auto &b : src)
+            b = static_cast<uint8_t>(rand());
+
+        double single = 0.0;
+        for (int threads = 1; threads <= maxThreads; ++threads) {
+            ThreadPool pool(threads);
+            double ms = measure(pool, src, dst, width, height, iterations);
+            if (threads == 1)
+                single = ms;
+            cout << left << setw(12)
+                 << to_string(width) + "x" + to_string(height) << right
+                 << setw(10) << threads << setw(12) << fixed
+                 << setprecision(3) << ms << setw(9) << setprecision(2)
+                 << single / ms << "\n";
+        }
+    }
+}
@@ -0,0 +1,70 @@
+// Measures the JPEG encoder for every SIMD level on one thread, and how it
+// scales with the number of threads for the best level. Frames are the test
+// pattern, whose flat bars compress like a typical scene.
+#include "argparser.hpp"
+#include "jpeg-encoder.hpp"
+#include "test-pattern-stream.hpp"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+// Returns milliseconds per frame.
+double measure(const JpegEncoder &encoder, ThreadPool &pool,
+               const uint8_t *src, Buffer &dst, int width, int height,
+               int iterations) {
+    // Warm up caches and wake up the workers.
+    encoder.encode(src, width, height, dst, pool);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        encoder.encode(src, width, height, dst, pool);
+    chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - start;
+
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut JPEG benchmark");
+    parser.description("Time to encode a YUYV frame as JPEG.");
+    parser.addArg("iterations").optional("-n").defaultValue(30).description(
+        "Frames per resolution and configuration.");
+    parser.addArg("quality").optional("-q").defaultValue(75).description(
+        "JPEG quality.");
+    parser.parse(argc, argv);
+    const int iterations = parser.get<int>("iterations");
+    const int quality = parser.get<int>("quality");
+
+    const pair<int, int> resolutions[] = {{1280, 720}, {1920, 1080}};
+    const size_t cores = max(1u, thread::hardware_concurrency());
+
+    for (auto [width, height] : resolutions) {
+        TestPatternStream pattern(width, height, V4L2_PIX_FMT_YUYV, 1000);
+        pattern.update();
+        const auto *src = static_cast<const uint8_t *>(pattern.getBuffer());
+        Buffer dst = makeBuffer();
+
+        cout << width << "x" << height << " at quality " << quality << ":\n";
+        ThreadPool single(1);
+        for (int l = 0; l <= static_cast<int>(simdLevel()); ++l) {
+            const auto level = static_cast<SimdLevel>(l);
+            const double ms = measure(JpegEncoder(quality, level), single,
+                                      src, dst, width, height, iterations);
+            cout << "  " << left << setw(8) << simdLevelToString(level)
+                 << right << fixed << setprecision(2) << setw(8) << ms
+                 << " ms, 1 thread, " << dst.size() / 1024 << " kB\n";
+        }
+        for (size_t threads = 2; threads <= cores; threads *= 2) {
+            ThreadPool pool(threads);
+            const double ms = measure(JpegEncoder(quality), pool, src, dst,
+                                      width, height, iterations);
+            cout << "  " << left << setw(8) << simdLevelToString(simdLevel())
+                 << right << fixed << setprecision(2) << setw(8) << ms
+                 << " ms, " << threads << " threads\n";
+        }
+    }
+}
@@ -0,0 +1,490 @@
+// Finds how many clients a server can serve before they fall behind, by
+// ramping up the number of lightweight connections from one event loop. Every
+// client does the handshake and then reads frames without showing them, as a
+// fast client taking every frame, a slow one that only takes a few frames per
+// second, or a stalled one that stops reading after its first frame. After
+// every step the frame rates, the lag and the disconnects are reported.
+//
+// Frames carry no capture time, so the lag of a client is measured from when
+// the first client got the same frame, i.e. how much later the server got
+// around to sending it to this one.
+#include "argparser.hpp"
+#include "tcp-interface.hpp"
+#include "test-pattern-stream.hpp"
+#include "video-server.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+enum class Behaviour { FAST = 0, SLOW, STALLED, NUM_BEHAVIOURS };
+
+string behaviourToString(Behaviour behaviour) {
+    switch (behaviour) {
+    case Behaviour::FAST:
+        return "fast";
+    case Behaviour::SLOW:
+        return "slow";
+    case Behaviour::STALLED:
+        return "stalled";
+    default:
+        throw std::invalid_argument("Got invalid Behaviour");
+    }
+}
+
+struct LoadConfig {
+    string ip = "127.0.0.1";
+    int port = 0;
+    int width = 320;
+    int height = 180;
+    int format = V4L2_PIX_FMT_YUYV;
+    int quality = 0;
+    // Frames per second read by the slow clients.
+    int slowFps = 2;
+};
+
+// What all clients share, which is only used on the loop's thread.
+struct LoadShared {
+    EventLoop loop;
+    // When the first client got each of the latest frames, by sequence
+    // number.
+    std::array<std::pair<uint32_t, chrono::steady_clock::time_point>, 1024>
+        firstArrival = {};
+    // The frames are thrown away, so all clients read them into this one.
+    Buffer scratch = makeBuffer();
+    // Stalled clients, until the run ends.
+    vector<coroutine_handle<>> stalled;
+    bool stopping = false;
+};
+
+// Stats of a client since they were last taken.
+struct ClientStats {
+    uint64_t frames = 0;
+    uint64_t dropped = 0;
+    vector<double> lagMs;
+};
+
+class LoadClient : TcpInterface {
+    const LoadConfig &config_;
+    LoadShared &shared_;
+    Behaviour behaviour_;
+    unique_ptr<AsyncSocket> socket_;
+    uint32_t sequence_ = 0;
+    ClientStats stats_;
+    uint64_t totalFrames_ = 0;
+    chrono::steady_clock::time_point started_;
+    chrono::steady_clock::time_point endTime_;
+    double setupMs_ = -1.0;
+    bool connected_ = false;
+    bool ended_ = false;
+    string error_;
+
+    // Suspends until the run ends.
+    struct Stall {
+        LoadShared &shared;
+
+        bool await_ready() { return shared.stopping; }
+        void await_suspend(coroutine_handle<> handle) {
+            shared.stalled.push_back(handle);
+        }
+        void await_resume() {}
+    };
+
+    // Reads the data of a package into the scratch buffer.
+    Task<> discard(AsyncSocket &socket, uint64_t size) {
+        if (size > shared_.scratch.size())
+            shared_.scratch.resize(size);
+        const size_t bytes = co_await socket.read(shared_.scratch.data(), size);
+        if (bytes < size)
+            throw std::runtime_error("Connection closed in a package");
+    }
+
+    // Connects without blocking the loop, which the other clients share.
+    Task<> connect() {
+        const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw std::runtime_error(string("Could not create socket: ") +
+                                     strerror(errno));
+        socket_ = make_unique<AsyncSocket>(shared_.loop, fd);
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(config_.ip.c_str());
+        addr.sin_port = htons(static_cast<uint16_t>(config_.port));
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) &&
+            errno != EINPROGRESS)
+            throw std::runtime_error(string("Could not connect: ") +
+                                     strerror(errno));
+        co_await socket_->writable();
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) || error)
+            throw std::runtime_error(string("Could not connect: ") +
+                                     strerror(error ? error : errno));
+    }
+
+    Task<> handshake() {
+        version_ = PROTOCOL_VERSION;
+        co_await sendStreamConfig(
+            *socket_,
+            {.width = static_cast<uint64_t>(config_.width),
+             .height = static_cast<uint64_t>(config_.height),
+             .format = static_cast<uint64_t>(config_.format),
+             .flags = 0,
+             .capabilities = 0,
+             .quality = static_cast<uint64_t>(config_.quality)},
+            PKG_TYPE::HELLO);
+        while (true) {
+            auto type = co_await handlePackage(*socket_);
+            if (type == PKG_TYPE::STREAM_CONFIG)
+                break;
+        }
+    }
+
+    // Reads packages until a frame has been read.
+    Task<> receiveFrame() {
+        while (true) {
+            auto type = co_await handlePackage(*socket_);
+            if (type == PKG_TYPE::FRAME)
+                break;
+        }
+    }
+
+    Task<> streamConfigHandler(AsyncSocket &socket, uint64_t size) override {
+        co_await readStreamConfig(socket, size);
+    }
+
+    Task<> frameHandler(AsyncSocket &socket, uint64_t size) override {
+        co_await discard(socket, size);
+
+        const auto now = chrono::steady_clock::now();
+        const uint32_t sequence = header_.sequence;
+        auto &[firstSequence, firstTime] =
+            shared_.firstArrival[sequence % shared_.firstArrival.size()];
+        // A frame too old to be remembered, e.g. for a slow client, has no
+        // lag sample, and the newer frame in its slot keeps its arrival.
+        if (firstSequence < sequence)
+            firstSequence = sequence, firstTime = now;
+        if (firstSequence == sequence)
+            stats_.lagMs.push_back(
+                chrono::duration<double, milli>(now - firstTime).count());
+
+        // Slow clients skip frames on purpose.
+        if (behaviour_ == Behaviour::FAST && sequence_ != 0 &&
+            sequence > sequence_ + 1)
+            stats_.dropped += sequence - sequence_ - 1;
+        sequence_ = sequence;
+        ++stats_.frames;
+        ++totalFrames_;
+    }
+
+    // Messages, e.g. about motion, are of no interest here.
+    Task<> textHandler(AsyncSocket &socket, uint64_t size) override {
+        co_await discard(socket, size);
+    }
+
+  public:
+    LoadClient(const LoadConfig &config, LoadShared &shared,
+               Behaviour behaviour)
+        : config_(config), shared_(shared), behaviour_(behaviour) {}
+
+    Behaviour behaviour() const { return behaviour_; }
+    bool connected() const { return connected_; }
+    bool ended() const { return ended_; }
+    const string &error() const { return error_; }
+    double setupMs() const { return setupMs_; }
+
+    // Frames per second over the client's whole life.
+    double fps() const {
+        const auto end = ended_ ? endTime_ : chrono::steady_clock::now();
+        const double seconds =
+            chrono::duration<double>(end - started_).count();
+        return seconds > 0.0 ? static_cast<double>(totalFrames_) / seconds
+                             : 0.0;
+    }
+
+    ClientStats takeStats() { return std::exchange(stats_, {}); }
+
+    Task<> run() {
+        started_ = chrono::steady_clock::now();
+        try {
+            co_await connect();
+            co_await handshake();
+            connected_ = true;
+            setupMs_ = chrono::duration<double, milli>(
+                           chrono::steady_clock::now() - started_)
+                           .count();
+
+            unique_ptr<AsyncTimer> timer;
+            if (behaviour_ == Behaviour::SLOW)
+                timer = make_unique<AsyncTimer>(socket_->loop());
+            const auto interval =
+                chrono::microseconds(1000000 / max(1, config_.slowFps));
+            auto next = chrono::steady_clock::now();
+            while (true) {
+                co_await receiveFrame();
+                if (behaviour_ == Behaviour::STALLED) {
+                    co_await Stall{shared_};
+                    break;
+                }
+                if (timer) {
+                    next += interval;
+                    co_await timer->sleepUntil(next);
+                }
+            }
+        } catch (std::exception const &e) {
+            if (!shared_.stopping)
+                error_ = e.what();
+        }
+        endTime_ = chrono::steady_clock::now();
+        ended_ = true;
+    }
+};
+
+double percentile(vector<double> &values, double p) {
+    if (values.empty())
+        return 0.0;
+    sort(values.begin(), values.end());
+    return values[min(values.size() - 1, static_cast<size_t>(
+                                             p * static_cast<double>(
+                                                     values.size())))];
+}
+
+// Parses the share of the clients with each behaviour, "fast:slow:stalled".
+array<int, static_cast<size_t>(Behaviour::NUM_BEHAVIOURS)>
+parseMix(const string &str) {
+    array<int, static_cast<size_t>(Behaviour::NUM_BEHAVIOURS)> mix = {};
+    char colon1 = 0, colon2 = 0;
+    istringstream is(str);
+    if (!(is >> mix[0] >> colon1 >> mix[1] >> colon2 >> mix[2]) ||
+        colon1 != ':' || colon2 != ':' || !is.eof() ||
+        any_of(mix.begin(), mix.end(), [](int n) { return n < 0; }) ||
+        mix[0] + mix[1] + mix[2] == 0)
+        throw std::invalid_argument("Invalid client mix: " + str);
+    return mix;
+}
+
+class LoadGenerator {
+    LoadConfig config_;
+    array<int, static_cast<size_t>(Behaviour::NUM_BEHAVIOURS)> mix_;
+    LoadShared shared_;
+    // After shared_, since they use its loop.
+    vector<unique_ptr<LoadClient>> clients_;
+    // Clients that have ended and were reported.
+    size_t reportedEnded_ = 0;
+
+    // Spreads the behaviours evenly over the clients, as given by the mix.
+    Behaviour behaviourOf(size_t client) const {
+        const int total = mix_[0] + mix_[1] + mix_[2];
+        int slot = static_cast<int>(client % static_cast<size_t>(total));
+        for (size_t i = 0; i < mix_.size(); ++i) {
+            if (slot < mix_[i])
+                return static_cast<Behaviour>(i);
+            slot -= mix_[i];
+        }
+        return Behaviour::FAST;
+    }
+
+    void report(ostream &os, int step, double seconds) {
+        array<size_t, static_cast<size_t>(Behaviour::NUM_BEHAVIOURS)> active =
+            {};
+        uint64_t frames = 0, fastFrames = 0, fastDropped = 0;
+        vector<double> fastFps, lagMs, setupMs;
+        size_t disconnected = 0, failed = 0;
+        for (size_t i = 0; i < clients_.size(); ++i) {
+            LoadClient &client = *clients_[i];
+            ClientStats stats = client.takeStats();
+            frames += stats.frames;
+            if (client.ended()) {
+                if (i >= reportedEnded_ && !client.error().empty())
+                    ++(client.connected() ? disconnected : failed);
+                continue;
+            }
+            if (!client.connected())
+                continue;
+            ++active[static_cast<size_t>(client.behaviour())];
+            if (client.setupMs() >= 0.0 && i >= reportedEnded_)
+                setupMs.push_back(client.setupMs());
+            if (client.behaviour() != Behaviour::FAST)
+                continue;
+            fastFps.push_back(static_cast<double>(stats.frames) / seconds);
+            fastFrames += stats.frames;
+            fastDropped += stats.dropped;
+            lagMs.insert(lagMs.end(), stats.lagMs.begin(), stats.lagMs.end());
+        }
+        reportedEnded_ = clients_.size();
+
+        os << fixed << setprecision(1) << "Step " << step << ": "
+           << clients_.size() << " clients, " << active[0] << " fast, "
+           << active[1] << " slow and " << active[2] << " stalled streaming\n"
+           << "  Frames: " << static_cast<double>(frames) / seconds
+           << " fps in total, fast clients " << percentile(fastFps, 0.5)
+           << " fps median, " << percentile(fastFps, 0.0) << " min, "
+           << 100.0 * static_cast<double>(fastDropped) /
+                  static_cast<double>(max<uint64_t>(1, fastFrames +
+                                                           fastDropped))
+           << "% dropped\n"
+           << setprecision(2) << "  Lag of fast clients: "
+           << percentile(lagMs, 0.5) << " ms median, "
+           << percentile(lagMs, 0.99) << " ms p99, "
+           << percentile(lagMs, 1.0) << " ms max\n"
+           << "  Setup of new clients: " << percentile(setupMs, 0.5)
+           << " ms median, " << percentile(setupMs, 1.0) << " ms max\n"
+           << "  Disconnected: " << disconnected
+           << ", failed to connect: " << failed << endl;
+    }
+
+    Task<> ramp(ostream &os, size_t start, size_t max,
+                chrono::milliseconds stepTime) {
+        AsyncTimer timer(shared_.loop);
+        int step = 1;
+        for (size_t count = start; clients_.size() < max; count *= 2) {
+            while (clients_.size() < std::min(count, max)) {
+                clients_.push_back(make_unique<LoadClient>(
+                    config_, shared_, behaviourOf(clients_.size())));
+                shared_.loop.spawn(clients_.back()->run());
+            }
+            // Not counting what came in before the step.
+            for (auto &client : clients_)
+                client->takeStats();
+            const auto begin = chrono::steady_clock::now();
+            co_await timer.sleepUntil(begin + stepTime);
+            report(os, step++,
+                   chrono::duration<double>(chrono::steady_clock::now() -
+                                            begin)
+                       .count());
+        }
+    }
+
+  public:
+    LoadGenerator(const LoadConfig &config, const string &mix)
+        : config_(config), mix_(parseMix(mix)) {}
+
+    // Adds clients, doubling their number every step, until there are max,
+    // and reports every step on os.
+    void run(ostream &os, size_t start, size_t max,
+             chrono::milliseconds stepTime) {
+        shared_.loop.run(ramp(os, std::max<size_t>(1, start), max, stepTime));
+
+        // Ends all clients.
+        shared_.stopping = true;
+        for (auto handle : shared_.stalled)
+            shared_.loop.schedule(handle);
+        shared_.stalled.clear();
+        shared_.loop.stop();
+        shared_.loop.run();
+    }
+
+    void printClients(ostream &os) const {
+        for (size_t i = 0; i < clients_.size(); ++i) {
+            const LoadClient &client = *clients_[i];
+            os << fixed << setprecision(1) << "Client " << i << " ("
+               << behaviourToString(client.behaviour()) << "): " << client.fps()
+               << " fps, setup " << client.setupMs() << " ms";
+            if (!client.error().empty())
+                os << ", " << (client.connected() ? "disconnected" : "failed")
+                   << ": " << client.error();
+            os << "\n";
+        }
+    }
+};
+
+// Thousands of clients need more sockets than allowed by default.
+void raiseFileLimit() {
+    rlimit limit = {};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut load generator");
+    parser.description("Frame rates and lag as the number of clients of a "
+                       "server ramps up.");
+    parser.addArg("server").optional("-u").defaultValue("").description(
+        "Server to load, as ip:port, instead of one serving a test pattern in "
+        "this process.");
+    parser.addArg("width").optional("-x").defaultValue(320);
+    parser.addArg("height").optional("-y").defaultValue(180);
+    parser.addArg("format").optional("-c").defaultValue("yuyv").description(
+        "Pixel format to stream in.");
+    parser.addArg("quality").optional("-q").defaultValue(0).description(
+        "JPEG quality for the server to encode MJPEG with, 0 for none.");
+    parser.addArg("start").optional("-s").defaultValue(10).description(
+        "Clients of the first step, doubled every step.");
+    parser.addArg("clients").optional("-n").defaultValue(640).description(
+        "Clients of the last step.");
+    parser.addArg("step").optional("-d").defaultValue(3000).description(
+        "Milliseconds per step.");
+    parser.addArg("mix").optional("-m").defaultValue("8:1:1").description(
+        "Shares of fast, slow and stalled clients, \"fast:slow:stalled\".");
+    parser.addArg("slow").optional("-f").defaultValue(2).description(
+        "Frames per second read by the slow clients.");
+    parser.addArg("verbose").optional("-v").defaultValue(false).description(
+        "Print every client at the end.");
+    parser.parse(argc, argv);
+
+    // Only the report goes to stdout, not what every connection says.
+    ostream os(cout.rdbuf());
+    cout.rdbuf(nullptr);
+    raiseFileLimit();
+
+    LoadConfig config;
+    config.width = parser.get<int>("width");
+    config.height = parser.get<int>("height");
+    config.format = formatFromString(parser.get<string>("format"));
+    config.quality = parser.get<int>("quality");
+    if (config.quality < 0 || config.quality > 100)
+        throw std::invalid_argument("The quality is from 1 to 100");
+    if (config.quality > 0)
+        config.format = V4L2_PIX_FMT_MJPEG;
+    config.slowFps = parser.get<int>("slow");
+
+    unique_ptr<VideoServer> server;
+    thread serverThread;
+    const string address = parser.get<string>("server");
+    if (address.empty()) {
+        CaptureConfig cfg;
+        cfg.openStream = [](int w, int h, int f) {
+            return make_unique<TestPatternStream>(w, h, f);
+        };
+        server = make_unique<VideoServer>(0, cfg);
+        serverThread = thread([&server] { server->run(); });
+        config.port = server->port();
+    } else {
+        auto endpoints = parseEndpoints(address);
+        if (endpoints.size() != 1)
+            throw std::invalid_argument("Give one server");
+        config.ip = endpoints.front().first;
+        config.port = endpoints.front().second;
+    }
+
+    {
+        LoadGenerator generator(config, parser.get<string>("mix"));
+        generator.run(
+            os, static_cast<size_t>(max(1, parser.get<int>("start"))),
+            static_cast<size_t>(max(1, parser.get<int>("clients"))),
+            chrono::milliseconds(parser.get<int>("step")));
+        if (parser.get<bool>("verbose"))
+            generator.printClients(os);
+    }
+
+    if (server) {
+        server->stop();
+        serverThread.join();
+    }
+}
@@ -0,0 +1,307 @@
+// Microbenchmarks of the building blocks of the pipeline: flipping frames,
+// encoding and decoding package headers and stream configurations, sending
+// frame packages through a socket and decoding MJPEG as the client does. Every
+// benchmark is warmed up and then timed in repetitions of a batch of calls,
+// and the statistics of the time per call are written as JSON, so that runs
+// can be compared over time.
+#include "argparser.hpp"
+#include "jpeg-encoder.hpp"
+#include "scaler.hpp"
+#include "tcp-interface.hpp"
+#include "test-pattern-stream.hpp"
+#include "thread-pool.hpp"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sys/socket.h>
+#include <thread>
+
+using namespace std;
+
+struct Result {
+    string name;
+    string input;
+    // Bytes processed per call, 0 if throughput makes no sense.
+    size_t bytes;
+    size_t batch;
+    // Nanoseconds per call of every repetition, sorted.
+    vector<double> ns;
+};
+
+// Keeps the compiler from optimizing away a result that is never used.
+template <typename T> void keep(T const &value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+// Each repetition calls fn at least this long, so that the clock's resolution
+// does not matter for the cheap benchmarks.
+constexpr chrono::microseconds MIN_BATCH_TIME(2000);
+
+template <typename Fn>
+Result measure(const string &name, const string &input, size_t bytes,
+               int warmup, int repetitions, Fn &&fn) {
+    auto time = [&fn](size_t calls) {
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i)
+            fn();
+        return chrono::steady_clock::now() - start;
+    };
+
+    // Warm up caches, branch predictors and the thread pool, and find how
+    // many calls make a batch.
+    size_t batch = 1;
+    for (int i = 0; i < warmup; ++i) {
+        while (time(batch) < MIN_BATCH_TIME)
+            batch *= 2;
+    }
+
+    Result result{name, input, bytes, batch, {}};
+    for (int i = 0; i < repetitions; ++i) {
+        chrono::duration<double, nano> elapsed = time(batch);
+        result.ns.push_back(elapsed.count() / static_cast<double>(batch));
+    }
+    sort(result.ns.begin(), result.ns.end());
+    cerr << left << setw(16) << name << setw(12) << input << right << fixed
+         << setprecision(1) << setw(14) << result.ns[result.ns.size() / 2]
+         << " ns\n";
+    return result;
+}
+
+void writeJson(ostream &os, const vector<Result> &results) {
+    auto percentile = [](const vector<double> &ns, double p) {
+        return ns[min(ns.size() - 1,
+                      static_cast<size_t>(p * static_cast<double>(ns.size())))];
+    };
+
+    os << fixed << setprecision(1) << "{\n"
+       << "  \"benchmark\": \"micro\",\n"
+       << "  \"cores\": " << max(1u, thread::hardware_concurrency()) << ",\n"
+       << "  \"simd\": \"" << simdLevelToString(simdLevel()) << "\",\n"
+       << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        double mean = 0.0;
+        for (double ns : r.ns)
+            mean += ns;
+        mean /= static_cast<double>(r.ns.size());
+        double variance = 0.0;
+        for (double ns : r.ns)
+            variance += (ns - mean) * (ns - mean);
+        variance /= static_cast<double>(max<size_t>(1, r.ns.size() - 1));
+        const double median = percentile(r.ns, 0.5);
+
+        os << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << r.name
+           << "\", \"input\": \"" << r.input << "\", \"bytes\": " << r.bytes
+           << ", \"batch\": " << r.batch
+           << ", \"repetitions\": " << r.ns.size()
+           << ", \"ns\": {\"min\": " << r.ns.front()
+           << ", \"median\": " << median << ", \"mean\": " << mean
+           << ", \"stddev\": " << sqrt(variance)
+           << ", \"p95\": " << percentile(r.ns, 0.95)
+           << ", \"max\": " << r.ns.back() << "}";
+        if (r.bytes > 0)
+            os << ", \"mb_per_s\": "
+               << static_cast<double>(r.bytes) / median * 1e3;
+        os << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+// Opens up the package codec of TcpInterface, for a peer of the current
+// protocol version.
+class Codec : public TcpInterface {
+  protected:
+    Task<> streamConfigHandler(AsyncSocket &, uint64_t) override {
+        co_return;
+    }
+    Task<> frameHandler(AsyncSocket &, uint64_t) override { co_return; }
+
+  public:
+    using TcpInterface::HEADER_SIZE;
+    using TcpInterface::Package;
+    using TcpInterface::PKG_TYPE;
+    using TcpInterface::StreamConfig;
+
+    Codec() { version_ = PROTOCOL_VERSION; }
+
+    size_t encode(uint64_t size, uint32_t sequence,
+                  std::array<uint8_t, HEADER_SIZE> &header) const {
+        return encodeHeader(PKG_TYPE::FRAME, size, PKG_FLAG_MOTION, sequence,
+                            header);
+    }
+
+    uint64_t decode(const std::array<uint8_t, HEADER_SIZE> &header) {
+        headerRest(header);
+        decodeHeader(header);
+        return header_.size;
+    }
+
+    void encodeConfig(const StreamConfig &cfg, Buffer &data) const {
+        putNum(cfg.width, data.data());
+        putNum(cfg.height, data.data() + 8);
+        putNum(cfg.format, data.data() + 16);
+        putNum(cfg.flags, data.data() + 24);
+        putNum(cfg.capabilities, data.data() + 32);
+        putNum(cfg.quality, data.data() + 40);
+    }
+
+    StreamConfig decodeConfig(const Buffer &data) const {
+        return {getNum(0, data, data.size()), getNum(1, data, data.size()),
+                getNum(2, data, data.size()), getNum(3, data, data.size()),
+                getNum(4, data, data.size()), getNum(5, data, data.size())};
+    }
+
+    Task<> send(AsyncSocket &socket, const Buffer &frame, uint32_t sequence) {
+        return sendFrame(socket, frame.data(), frame.size(), 0, sequence);
+    }
+
+    Task<> receive(AsyncSocket &socket, Package &pkg) {
+        auto [type, size] = co_await readPackageHeader(socket);
+        if (type != PKG_TYPE::FRAME)
+            throw std::runtime_error("Expected a frame package");
+        co_await readPackageData(socket, pkg, size);
+    }
+};
+
+void benchHeaders(vector<Result> &results, int warmup, int repetitions) {
+    Codec codec;
+    std::array<uint8_t, Codec::HEADER_SIZE> header;
+    uint32_t sequence = 0;
+    results.push_back(measure("header-encode", "-", 0, warmup, repetitions,
+                              [&] {
+                                  codec.encode(614400, ++sequence, header);
+                                  keep(header);
+                              }));
+    codec.encode(614400, 1, header);
+    results.push_back(measure("header-decode", "-", 0, warmup, repetitions,
+                              [&] { keep(codec.decode(header)); }));
+
+    const Codec::StreamConfig cfg = {1920, 1080, V4L2_PIX_FMT_YUYV, 0, 3, 75};
+    Buffer data = makeBuffer(6 * sizeof(uint64_t));
+    results.push_back(measure("config-encode", "-", 0, warmup, repetitions,
+                              [&] {
+                                  codec.encodeConfig(cfg, data);
+                                  keep(data);
+                              }));
+    results.push_back(measure("config-decode", "-", 0, warmup, repetitions,
+                              [&] { keep(codec.decodeConfig(data)); }));
+
+    // The helpers of the first protocol version.
+    vector<uint8_t> vec;
+    results.push_back(measure("num-to-vec", "-", 0, warmup, repetitions, [&] {
+        vec.clear();
+        for (uint64_t i = 0; i < 4; ++i)
+            addNumToVec(i, vec);
+        keep(vec);
+    }));
+    results.push_back(measure("num-from-vec", "-", 0, warmup, repetitions,
+                              [&] {
+                                  for (size_t i = 0; i < 4; ++i)
+                                      keep(getNumFromVec(i, vec));
+                              }));
+}
+
+// Sends a frame package and reads it back through a local socket, on one
+// event loop like the server's connections.
+void benchPackage(vector<Result> &results, const string &input,
+                  const Buffer &frame, int warmup, int repetitions) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+        throw std::runtime_error("Could not create a socket pair");
+    EventLoop loop;
+    AsyncSocket sender(loop, fds[0]);
+    AsyncSocket receiver(loop, fds[1]);
+    Codec sendCodec, receiveCodec;
+    Codec::Package pkg = {.type = Codec::PKG_TYPE::FRAME};
+    uint32_t sequence = 0;
+
+    results.push_back(measure(
+        "package", input, frame.size(), warmup, repetitions, [&] {
+            loop.spawn(sendCodec.send(sender, frame, ++sequence));
+            loop.run(receiveCodec.receive(receiver, pkg));
+        }));
+}
+
+void benchDecode(vector<Result> &results, const string &input,
+                 const Buffer &jpeg, int warmup, int repetitions) {
+    auto decode = [&jpeg] {
+        SDL_RWops *rw =
+            SDL_RWFromConstMem(jpeg.data(), static_cast<int>(jpeg.size()));
+        SDL_Surface *surface = rw ? IMG_Load_RW(rw, 1) : nullptr;
+        if (surface)
+            SDL_FreeSurface(surface);
+        return surface != nullptr;
+    };
+    if (!decode()) {
+        cerr << "WARNING: Could not decode MJPEG: " << SDL_GetError() << "\n";
+        return;
+    }
+    results.push_back(
+        measure("mjpeg-decode", input, jpeg.size(), warmup, repetitions,
+                [&decode] { keep(decode()); }));
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut microbenchmarks");
+    parser.description("Time per call of the building blocks, as JSON.");
+    parser.addArg("repetitions").optional("-n").defaultValue(15).description(
+        "Timed repetitions of every benchmark.");
+    parser.addArg("warmup").optional("-w").defaultValue(3).description(
+        "Untimed repetitions before the timed ones.");
+    parser.addArg("output").optional("-o").defaultValue("").description(
+        "File to write the JSON to, instead of stdout.");
+    parser.parse(argc, argv);
+    const int repetitions = max(1, parser.get<int>("repetitions"));
+    const int warmup = max(1, parser.get<int>("warmup"));
+    // Only the JSON goes to stdout, and the logs of debug builds to stderr.
+    ostream json(cout.rdbuf());
+    cout.rdbuf(cerr.rdbuf());
+
+    IMG_Init(IMG_INIT_JPG);
+    vector<Result> results;
+    benchHeaders(results, warmup, repetitions);
+
+    const pair<int, int> resolutions[] = {
+        {320, 180}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+    for (auto [width, height] : resolutions) {
+        const string input = to_string(width) + "x" + to_string(height);
+        TestPatternStream pattern(width, height, V4L2_PIX_FMT_YUYV, 1000);
+        pattern.update();
+        const auto *src = static_cast<const uint8_t *>(pattern.getBuffer());
+        Buffer frame = makeBuffer();
+        frame.assign(src, src + pattern.getBufferSize());
+
+        // As SDLWindow::flipBuffer does it.
+        Buffer flipped = makeBuffer(frame.size());
+        results.push_back(measure(
+            "flip", input, frame.size(), warmup, repetitions, [&] {
+                ThreadPool::shared().parallelRows(
+                    height, [&](int begin, int end) {
+                        flipYuyv(frame.data(), flipped.data(), width, height,
+                                 begin, end);
+                    });
+            }));
+
+        benchPackage(results, input, frame, warmup, repetitions);
+
+        Buffer jpeg = makeBuffer();
+        JpegEncoder(75).encode(frame.data(), width, height, jpeg);
+        benchDecode(results, input, jpeg, warmup, repetitions);
+    }
+
+    const string output = parser.get<string>("output");
+    if (output.empty()) {
+        writeJson(json, results);
+    } else {
+        ofstream file(output);
+        writeJson(file, results);
+        if (!file)
+            throw std::runtime_error("Could not write " + output);
+    }
+}
@@ -0,0 +1,169 @@
+// Streams a test pattern through a chain of relays on loopback, a source that
+// feeds one relay, which feeds two more, and clients spread over the last two.
+// Reports the frame rate and the frames dropped upstream of every client.
+//
+// Then the source stalls without closing its connections, and the relays are
+// stopped from the leaves up while their capture threads wait for frames that
+// never come. Stopping a relay should only take as long as its own shutdown.
+#include "argparser.hpp"
+#include "tcp-stream.hpp"
+#include "test-pattern-stream.hpp"
+#include "video-server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A test pattern that stops delivering frames while stalled, until it is
+// interrupted.
+class StallingStream : public TestPatternStream {
+    atomic<bool> &stalled_;
+    mutex mutex_;
+    condition_variable cond_;
+    bool interrupted_ = false;
+
+  public:
+    StallingStream(int width, int height, int format, atomic<bool> &stalled)
+        : TestPatternStream(width, height, format), stalled_(stalled) {}
+
+    void update() override {
+        if (stalled_) {
+            unique_lock<mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return interrupted_; });
+            throw runtime_error("Test pattern interrupted");
+        }
+        TestPatternStream::update();
+    }
+
+    void interrupt() override {
+        {
+            lock_guard<mutex> lock(mutex_);
+            interrupted_ = true;
+        }
+        cond_.notify_all();
+    }
+};
+
+class Node {
+    unique_ptr<VideoServer> server_;
+    thread thread_;
+
+  public:
+    explicit Node(const CaptureConfig &cfg)
+        : server_(make_unique<VideoServer>(0, cfg)),
+          thread_([this] { server_->run(); }) {}
+
+    int port() const { return server_->port(); }
+
+    // Milliseconds until the server has stopped and closed its stream.
+    double stop() {
+        auto start = chrono::steady_clock::now();
+        server_->stop();
+        thread_.join();
+        server_.reset();
+        chrono::duration<double, milli> elapsed =
+            chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+};
+
+CaptureConfig relayConfig(int upstreamPort, int statsInterval) {
+    CaptureConfig cfg;
+    cfg.statsIntervalS = statsInterval;
+    cfg.openStream = [upstreamPort](int width, int height, int format) {
+        return make_unique<TcpStream>("127.0.0.1", upstreamPort, width, height,
+                                      format);
+    };
+    return cfg;
+}
+
+struct ClientResult {
+    uint64_t frames = 0;
+    uint64_t dropped = 0;
+    string error;
+};
+
+void runClient(int port, int width, int height, chrono::seconds duration,
+               ClientResult &result) {
+    try {
+        TcpStream stream("127.0.0.1", port, width, height, V4L2_PIX_FMT_YUYV);
+        auto end = chrono::steady_clock::now() + duration;
+        while (chrono::steady_clock::now() < end) {
+            stream.update();
+            ++result.frames;
+        }
+        result.dropped = stream.droppedFrames();
+    } catch (std::exception const &e) {
+        result.error = e.what();
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    ArgParser parser("Tittut relay benchmark");
+    parser.description("Frame rates through a chain of relays, and how long "
+                       "relays of a stalled source take to stop.");
+    parser.addArg("width").optional("-x").defaultValue(1280);
+    parser.addArg("height").optional("-y").defaultValue(720);
+    parser.addArg("clients").optional("-n").defaultValue(6);
+    parser.addArg("seconds").optional("-s").defaultValue(5).description(
+        "How long the clients stream.");
+    parser.addArg("stats").optional("-a").defaultValue(0).description(
+        "Seconds between printing the statistics of every relay, 0 for "
+        "never.");
+    parser.parse(argc, argv);
+
+    const int width = parser.get<int>("width");
+    const int height = parser.get<int>("height");
+    const int clients = parser.get<int>("clients");
+    const chrono::seconds duration(parser.get<int>("seconds"));
+    const int stats = parser.get<int>("stats");
+
+    atomic<bool> stalled = false;
+    CaptureConfig sourceCfg;
+    sourceCfg.openStream = [&stalled](int w, int h, int format) {
+        return make_unique<StallingStream>(w, h, format, stalled);
+    };
+    Node source(sourceCfg);
+    Node relay(relayConfig(source.port(), stats));
+    vector<unique_ptr<Node>> leaves;
+    for (int i = 0; i < 2; ++i)
+        leaves.push_back(make_unique<Node>(relayConfig(relay.port(), stats)));
+
+    vector<ClientResult> results(clients);
+    vector<thread> threads;
+    for (int i = 0; i < clients; ++i) {
+        threads.emplace_back(runClient, leaves[i % 2]->port(), width, height,
+                             duration, ref(results[i]));
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    // Let the relays wait for frames from the stalled source.
+    stalled = true;
+    this_thread::sleep_for(chrono::milliseconds(500));
+    vector<double> stopTimes;
+    for (auto &leaf : leaves)
+        stopTimes.push_back(leaf->stop());
+    stopTimes.push_back(relay.stop());
+    stopTimes.push_back(source.stop());
+
+    for (int i = 0; i < clients; ++i) {
+        cout << "Client " << i << " via relay " << i % 2 + 1 << ": ";
+        if (!results[i].error.empty()) {
+            cout << results[i].error << "\n";
+            continue;
+        }
+        cout << static_cast<double>(results[i].frames) / duration.count()
+             << " fps, " << results[i].dropped << " dropped upstream\n";
+    }
+    cout << "Stopping stalled relays took " << stopTimes[0] << " ms, "
+         << stopTimes[1] << " ms and " << stopTimes[2]
+         << " ms, the source " << stopTimes[3] << " ms" << endl;
+}
@@ -0,0 +1,182 @@
+// Recycling allocator for frame and package buffers.
+//
+// Buffers are rounded up to size classes of powers of two, and freed buffers
+// are kept per size class for the next allocation of that class. Once every
+// buffer a stream needs has been allocated, frames and packages are handled
+// without touching the heap. The pool is a std::pmr::memory_resource, so any
+// pmr container can allocate from it.
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <vector>
+
+using Buffer = std::pmr::vector<uint8_t>;
+
+class BufferPool : public std::pmr::memory_resource {
+  public:
+    struct Stats {
+        // Allocations made from the pool, and how many of them had to get
+        // new memory from the system rather than reusing a freed buffer.
+        uint64_t allocations;
+        uint64_t systemAllocations;
+        // Memory that the pool has gotten from the system and not returned.
+        uint64_t systemBytes;
+        // Memory that has been asked to be backed by huge pages, in total.
+        uint64_t hugePageBytes;
+    };
+
+  private:
+    static constexpr size_t MIN_CLASS_SHIFT = 6;  // 64 bytes.
+    static constexpr size_t NUM_CLASSES = 26;     // Up to 2 GB.
+    static constexpr size_t ALIGNMENT = 64;       // A cache line.
+    static constexpr size_t MMAP_SIZE = 2 << 20;  // Huge page size.
+    static constexpr size_t MAX_FREE_BLOCKS = 16; // Kept per class.
+
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<void *> free;
+    };
+
+    std::array<SizeClass, NUM_CLASSES> classes_;
+    std::atomic<bool> hugePages_ = false;
+    std::atomic<uint64_t> allocations_ = 0;
+    std::atomic<uint64_t> systemAllocations_ = 0;
+    std::atomic<uint64_t> systemBytes_ = 0;
+    std::atomic<uint64_t> hugePageBytes_ = 0;
+
+    static size_t classIndex(size_t bytes) {
+        size_t index = 0;
+        while ((size_t{1} << (index + MIN_CLASS_SHIFT)) < bytes)
+            ++index;
+        return index;
+    }
+
+    static size_t classSize(size_t index) {
+        return size_t{1} << (index + MIN_CLASS_SHIFT);
+    }
+
+    // Large blocks are mapped directly, so that they can be backed by huge
+    // pages and are returned to the system when freed.
+    void *systemAllocate(size_t size) {
+        void *p = nullptr;
+        if (size >= MMAP_SIZE) {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::bad_alloc();
+            if (hugePages_ && madvise(p, size, MADV_HUGEPAGE) == 0)
+                hugePageBytes_ += size;
+        } else {
+            p = std::aligned_alloc(ALIGNMENT, size);
+            if (p == nullptr)
+                throw std::bad_alloc();
+        }
+        ++systemAllocations_;
+        systemBytes_ += size;
+        return p;
+    }
+
+    void systemFree(void *p, size_t size) {
+        systemBytes_ -= size;
+        if (size >= MMAP_SIZE) {
+            munmap(p, size);
+        } else {
+            std::free(p);
+        }
+    }
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        if (alignment > ALIGNMENT || bytes > classSize(NUM_CLASSES - 1))
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+
+        ++allocations_;
+        const size_t index = classIndex(bytes);
+        SizeClass &sizeClass = classes_[index];
+        {
+            std::lock_guard<std::mutex> lock(sizeClass.mutex);
+            if (!sizeClass.free.empty()) {
+                void *p = sizeClass.free.back();
+                sizeClass.free.pop_back();
+                return p;
+            }
+        }
+        return systemAllocate(classSize(index));
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        if (alignment > ALIGNMENT || bytes > classSize(NUM_CLASSES - 1)) {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        const size_t index = classIndex(bytes);
+        SizeClass &sizeClass = classes_[index];
+        {
+            std::lock_guard<std::mutex> lock(sizeClass.mutex);
+            if (sizeClass.free.size() < MAX_FREE_BLOCKS) {
+                sizeClass.free.push_back(p);
+                return;
+            }
+        }
+        systemFree(p, classSize(index));
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const
+        noexcept override {
+        return this == &other;
+    }
+
+  public:
+    BufferPool() {
+        // Reserve the free lists up front, so that freeing never allocates.
+        for (auto &sizeClass : classes_)
+            sizeClass.free.reserve(MAX_FREE_BLOCKS);
+    }
+
+    BufferPool(BufferPool const &) = delete;
+    BufferPool &operator=(BufferPool const &) = delete;
+
+    ~BufferPool() {
+        for (size_t i = 0; i < NUM_CLASSES; ++i) {
+            for (void *p : classes_[i].free)
+                systemFree(p, classSize(i));
+        }
+    }
+
+    // The pool used for all frames and packages.
+    static BufferPool &shared() {
+        static BufferPool pool;
+        return pool;
+    }
+
+    // Asks for transparent huge pages for large buffers allocated from now
+    // on, which saves TLB misses when touching whole frames.
+    void useHugePages(bool enable) { hugePages_ = enable; }
+
+    Stats stats() const {
+        return {allocations_, systemAllocations_, systemBytes_,
+                hugePageBytes_};
+    }
+};
+
+// A buffer of size bytes allocating from the shared pool.
+Buffer makeBuffer(size_t size = 0) {
+    return Buffer(size, &BufferPool::shared());
+}
+
+// Scratch memory of the calling thread, kept from frame to frame so that the
+// kernels stop allocating once they have seen the largest frame. Every Id has
+// a vector of its own, valid until the next call with the same Id.
+template <typename T, int Id> std::vector<T> &scratch(size_t size) {
+    thread_local std::vector<T> memory;
+    memory.resize(size);
+    return memory;
+}
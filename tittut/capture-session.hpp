@@ -0,0 +1,667 @@
+// Shares one capture device between all clients of a server.
+//
+// The device is kept open for a while after the last client has left, and the
+// latest frame is cached, so that a client connecting again gets its first
+// frame without waiting for the device to start up.
+//
+// The device is opened at the largest resolution that any client asks for, and
+// every client gets the captured frames scaled down to its own resolution and
+// converted to its own pixel format. Uncompressed formats are captured as YUYV,
+// so clients can ask for formats that the camera does not produce natively.
+// Clients can also ask for just a region of the frames, which they then get in
+// the captured resolution. Clients that ask for MJPEG with a quality get YUYV
+// frames encoded by the server, for cameras without MJPEG of their own.
+//
+// The frames can also come from another server instead of a camera, which
+// makes the server a relay that serves the frames of one upstream connection
+// to all of its clients.
+#pragma once
+
+#include "buffer-pool.hpp"
+#include "convert.hpp"
+#include "event-loop.hpp"
+#include "jpeg-encoder.hpp"
+#include "motion-detector.hpp"
+#include "perf-counters.hpp"
+#include "realtime.hpp"
+#include "scaler.hpp"
+#include "v4l-stream.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// A captured frame together with the scaled and converted versions of it that
+// clients have asked for. Each variant is computed at most once, by the first
+// client that needs it, and is then shared with every other client using it.
+class SharedFrame {
+    struct Variant {
+        std::once_flag once;
+        Buffer data = makeBuffer();
+    };
+
+    Buffer data_;
+    int width_;
+    int height_;
+    int format_;
+    uint64_t sequence_;
+    std::chrono::steady_clock::time_point timestamp_;
+    bool motion_ = false;
+    std::mutex mutex_;
+    // Variants are keyed by the region of the frame they show (x, y, width,
+    // height), followed by their resolution, format and JPEG quality.
+    using VariantKey = std::tuple<int, int, int, int, int, int, int, int>;
+    std::pmr::map<VariantKey, Variant> variants_{&BufferPool::shared()};
+
+    Variant &variant(const Region &region, int width, int height, int format,
+                     int quality) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return variants_
+            .try_emplace({region.x, region.y, region.width, region.height,
+                          width, height, format, quality})
+            .first->second;
+    }
+
+    // Fills a variant from the YUYV frame of the same size, which is encoded
+    // for MJPEG and converted for other formats.
+    static void convert(Variant &var, const Buffer &yuyv, int width,
+                        int height, int format, int quality) {
+        std::call_once(var.once, [&] {
+            if (format == V4L2_PIX_FMT_MJPEG) {
+                TIMER("Encoding frame");
+                StageScope stage(Stage::ENCODE);
+                JpegEncoder::shared(quality).encode(yuyv.data(), width,
+                                                    height, var.data);
+            } else {
+                TIMER("Converting frame");
+                StageScope stage(Stage::CONVERT);
+                var.data.resize(frameSize(format, width, height));
+                convertFrame(V4L2_PIX_FMT_YUYV, format, yuyv.data(),
+                             var.data.data(), width, height);
+            }
+        });
+    }
+
+  public:
+    SharedFrame(Buffer data, int width, int height, int format,
+                uint64_t sequence,
+                std::chrono::steady_clock::time_point timestamp =
+                    std::chrono::steady_clock::now())
+        : data_(std::move(data)),
+          width_(width), height_(height), format_(format),
+          sequence_(sequence), timestamp_(timestamp) {}
+
+    SharedFrame(SharedFrame const &) = delete;
+    SharedFrame &operator=(SharedFrame const &) = delete;
+
+    uint64_t sequence() const { return sequence_; }
+    std::chrono::steady_clock::time_point timestamp() const {
+        return timestamp_;
+    }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int format() const { return format_; }
+    const Buffer &data() const { return data_; }
+
+    // Whether the frame is part of a motion event, including its post-roll.
+    bool motion() const { return motion_; }
+    void setMotion(bool motion) { motion_ = motion; }
+
+    // Returns the frame at the given resolution and format, scaling and
+    // converting it if needed. MJPEG is encoded with the given quality.
+    const Buffer &get(int width, int height, int format, int quality = 0) {
+        if (width == width_ && height == height_ && format == format_)
+            return data_;
+        if (format_ != V4L2_PIX_FMT_YUYV)
+            throw std::invalid_argument(
+                "Only YUYV frames can be scaled or converted");
+
+        Variant &var = variant({0, 0, width_, height_}, width, height, format,
+                               quality);
+        if (format != V4L2_PIX_FMT_YUYV) {
+            convert(var, get(width, height, V4L2_PIX_FMT_YUYV), width, height,
+                    format, quality);
+        } else {
+            std::call_once(var.once, [&] {
+                TIMER("Scaling frame");
+                StageScope stage(Stage::CONVERT);
+                var.data.resize(frameSize(format, width, height));
+                scaleYuyv(data_.data(), width_, height_, var.data.data(),
+                          width, height);
+            });
+        }
+        return var.data;
+    }
+
+    // Returns a region of the frame in its native resolution, converted to
+    // the given format. The region has to be aligned to even pixels.
+    const Buffer &crop(const Region &region, int format, int quality = 0) {
+        if (region.x == 0 && region.y == 0 && region.width == width_ &&
+            region.height == height_)
+            return get(width_, height_, format, quality);
+        if (format_ != V4L2_PIX_FMT_YUYV)
+            throw std::invalid_argument("Only YUYV frames can be cropped");
+
+        Variant &var =
+            variant(region, region.width, region.height, format, quality);
+        if (format != V4L2_PIX_FMT_YUYV) {
+            convert(var, crop(region, V4L2_PIX_FMT_YUYV), region.width,
+                    region.height, format, quality);
+        } else {
+            std::call_once(var.once, [&] {
+                TIMER("Cropping frame");
+                StageScope stage(Stage::CONVERT);
+                var.data.resize(
+                    frameSize(format, region.width, region.height));
+                cropYuyv(data_.data(), width_, height_, region.x, region.y,
+                         region.width, region.height, var.data.data());
+            });
+        }
+        return var.data;
+    }
+};
+
+// Opens the source of the frames for a resolution and format.
+using StreamFactory = std::function<std::unique_ptr<VideoStream>(
+    int width, int height, int format)>;
+
+struct CaptureConfig {
+    MotionConfig motion;
+    // How long the device is kept open after the last client has left.
+    int idleTimeoutMs = 10000;
+    // Opens the camera unless set.
+    StreamFactory openStream;
+    // What the camera captures into, when it is opened by default.
+    CaptureMemory captureMemory = CaptureMemory::AUTO;
+    // Seconds between printing frame statistics, 0 for never.
+    int statsIntervalS = 0;
+};
+
+class CaptureSession {
+    // What one client has asked for.
+    struct Request {
+        int width;
+        int height;
+        int captureFormat;
+        std::string error;
+        // A coroutine waiting for the next frame, and the loop it runs on.
+        std::coroutine_handle<> waiter;
+        EventLoop *loop = nullptr;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+    bool running_ = false;
+    bool stop_ = false;
+    int format_ = 0;
+    std::list<Request> requests_;
+    std::shared_ptr<SharedFrame> latest_;
+    // When latest_ was set, for measuring how late the senders wake up.
+    std::chrono::steady_clock::time_point publishedAt_;
+    MotionDetector motionDetector_;
+    std::chrono::milliseconds idleTimeout_;
+    StreamFactory openStream_;
+    // The stream that the capture thread reads from, for stop() to interrupt
+    // a read that waits for a stalled upstream server.
+    VideoStream *stream_ = nullptr;
+    // Kept across capture threads so that frame sequence numbers never repeat.
+    uint64_t sequence_ = 0;
+
+    // Frame counters since statistics were last printed.
+    std::atomic<uint64_t> framesIn_ = 0;
+    std::atomic<uint64_t> droppedIn_ = 0;
+    std::atomic<uint64_t> framesOut_ = 0;
+    std::atomic<uint64_t> droppedOut_ = 0;
+    std::atomic<uint64_t> latencyUs_ = 0;
+    std::atomic<uint64_t> latencyCount_ = 0;
+    std::atomic<uint64_t> maxLatencyUs_ = 0;
+    std::chrono::seconds statsInterval_;
+    std::chrono::steady_clock::time_point lastStats_;
+
+    // Prints and resets the counters, if it is time to. The stage counters
+    // can also be asked for with a signal.
+    void printStats() {
+        PerfCounters &perf = PerfCounters::shared();
+        if (perf.takePrintRequest())
+            perf.print(std::cout);
+        const auto now = std::chrono::steady_clock::now();
+        if (statsInterval_.count() <= 0 || now - lastStats_ < statsInterval_)
+            return;
+        const double seconds =
+            std::chrono::duration<double>(now - lastStats_).count();
+        lastStats_ = now;
+
+        const uint64_t latencyCount = latencyCount_.exchange(0);
+        const double averageLatency =
+            latencyCount == 0 ? 0.0
+                              : static_cast<double>(latencyUs_.exchange(0)) /
+                                    static_cast<double>(latencyCount) / 1000;
+        std::cout << std::fixed << std::setprecision(1) << "In "
+                  << static_cast<double>(framesIn_.exchange(0)) / seconds
+                  << " fps, " << droppedIn_.exchange(0)
+                  << " dropped upstream. Out "
+                  << static_cast<double>(framesOut_.exchange(0)) / seconds
+                  << " fps, " << droppedOut_.exchange(0)
+                  << " dropped. Latency " << averageLatency << " ms average, "
+                  << static_cast<double>(maxLatencyUs_.exchange(0)) / 1000
+                  << " ms max" << std::endl;
+        ThreadPlacer::shared().printWakeups(std::cout);
+        perf.print(std::cout);
+    }
+
+    // Resumes the coroutines waiting for a frame, after publishing one or on
+    // errors. Must hold mutex_.
+    void wakeWaiters() {
+        for (auto &req : requests_) {
+            if (req.waiter)
+                req.loop->schedule(std::exchange(req.waiter, {}));
+        }
+    }
+
+    // The resolution to capture in, i.e. the largest one that has been asked
+    // for and that the device has not rejected. Must hold mutex_.
+    std::pair<int, int> captureResolution() const {
+        std::pair<int, int> res = {0, 0};
+        for (auto &req : requests_) {
+            if (req.error.empty() &&
+                req.width * req.height > res.first * res.second)
+                res = {req.width, req.height};
+        }
+        return res;
+    }
+
+    // Whether a frame can be served to a request. A frame captured before the
+    // request was made may have been captured in another format, or in
+    // another resolution that a compressed format can't be scaled from.
+    static bool usable(const Request &req, const SharedFrame &frame) {
+        return frame.format() == req.captureFormat &&
+               (!isCompressed(frame.format()) ||
+                (frame.width() == req.width && frame.height() == req.height));
+    }
+
+    // Marks the frame as part of a motion event when it differs enough from
+    // the previous one, or when the last motion was within the post-roll.
+    // Sources that detect motion by themselves, like another server, are
+    // trusted instead.
+    void detectMotion(
+        SharedFrame &frame, const SharedFrame *previous,
+        std::optional<std::chrono::steady_clock::time_point> &lastMotion,
+        std::optional<bool> sourceMotion) {
+        if (sourceMotion) {
+            frame.setMotion(sourceMotion.value());
+            return;
+        }
+        if (frame.format() != V4L2_PIX_FMT_YUYV || previous == nullptr ||
+            previous->width() != frame.width() ||
+            previous->height() != frame.height())
+            return;
+
+        if (motionDetector_.detect(frame.data().data(),
+                                   previous->data().data(), frame.width(),
+                                   frame.height()))
+            lastMotion = frame.timestamp();
+
+        auto postRoll = std::chrono::milliseconds(
+            motionDetector_.config().postRollMs);
+        frame.setMotion(lastMotion.has_value() &&
+                        frame.timestamp() - lastMotion.value() <= postRoll);
+    }
+
+    // Interrupts the stream at once if stop() came before it was set.
+    void setStream(VideoStream *stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stream_ = stream;
+        if (stream_ && stop_)
+            stream_->interrupt();
+    }
+
+    void captureWork() {
+        std::unique_ptr<VideoStream> stream;
+        std::pair<int, int> current = {0, 0};
+        int format = 0;
+        std::shared_ptr<SharedFrame> previous;
+        std::optional<std::chrono::steady_clock::time_point> lastMotion;
+        bool idle = false;
+        std::chrono::steady_clock::time_point idleSince;
+        // Frames that the current stream has reported as dropped.
+        uint64_t streamDropped = 0;
+        ThreadPlacer &placer = ThreadPlacer::shared();
+        placer.place(ThreadRole::CAPTURE);
+
+        while (true) {
+            std::pair<int, int> wanted;
+            int wantedFormat = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                wanted = captureResolution();
+                wantedFormat = format_;
+
+                // Without clients, keep capturing in the current
+                // configuration until the idle timeout.
+                auto now = std::chrono::steady_clock::now();
+                if (wanted.first != 0) {
+                    idle = false;
+                } else if (stream) {
+                    if (!idle)
+                        idleSince = now;
+                    idle = true;
+                    wanted = current;
+                    wantedFormat = format;
+                }
+
+                if (stop_ || wanted.first == 0 ||
+                    (idle && now - idleSince >= idleTimeout_)) {
+                    running_ = false;
+                    latest_.reset();
+                    wakeWaiters();
+                    break;
+                }
+            }
+
+            if (!stream || wanted != current || wantedFormat != format) {
+                // The device has to be closed before it can be reopened with
+                // another resolution.
+                setStream(nullptr);
+                stream.reset();
+                try {
+                    TIMER("Opening capture device");
+                    stream = openStream_(wanted.first, wanted.second,
+                                         wantedFormat);
+                    setStream(stream.get());
+                    streamDropped = 0;
+                    current = wanted;
+                    format = wantedFormat;
+                    std::cout << "Capturing in " << current.first << "x"
+                              << current.second << std::endl;
+                } catch (std::exception const &e) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    for (auto &req : requests_) {
+                        if (req.width == wanted.first &&
+                            req.height == wanted.second)
+                            req.error = e.what();
+                    }
+                    wakeWaiters();
+                    cond_.notify_all();
+                    continue;
+                }
+            }
+
+            // The frame's own size, which another server that is relayed may
+            // have lowered from what was asked for.
+            int frameWidth = 0;
+            int frameHeight = 0;
+            int frameFormat = 0;
+            try {
+                stream->update();
+                if (auto ready = stream->frameTime())
+                    placer.wakeups(ThreadRole::CAPTURE)
+                        .record(std::chrono::steady_clock::now() -
+                                ready.value());
+                std::tie(frameWidth, frameHeight, frameFormat) =
+                    stream->getMetaData();
+                if (isCompressed(frameFormat) &&
+                    (frameWidth != current.first ||
+                     frameHeight != current.second))
+                    throw std::runtime_error(
+                        "Source streams compressed frames in " +
+                        std::to_string(frameWidth) + "x" +
+                        std::to_string(frameHeight) + " instead of " +
+                        std::to_string(current.first) + "x" +
+                        std::to_string(current.second));
+            } catch (std::exception const &e) {
+                setStream(nullptr);
+                stream.reset();
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &req : requests_)
+                    req.error = e.what();
+                wakeWaiters();
+                cond_.notify_all();
+                continue;
+            }
+
+            // Frames come and go at the frame rate, so they are allocated
+            // from the pool as well. The camera's memory is taken over when
+            // it is our own, and copied otherwise.
+            Buffer data = makeBuffer();
+            if (!stream->takeBuffer(data)) {
+                StageScope stage(Stage::COPY);
+                auto src = static_cast<const uint8_t *>(stream->getBuffer());
+                data.assign(src, src + stream->getBufferSize());
+            }
+            auto frame = std::allocate_shared<SharedFrame>(
+                std::pmr::polymorphic_allocator<SharedFrame>(
+                    &BufferPool::shared()),
+                std::move(data), frameWidth, frameHeight, frameFormat,
+                ++sequence_);
+            detectMotion(*frame, previous.get(), lastMotion, stream->motion());
+            ++framesIn_;
+            droppedIn_ += stream->droppedFrames() - streamDropped;
+            streamDropped = stream->droppedFrames();
+            printStats();
+            previous = frame;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                latest_ = std::move(frame);
+                publishedAt_ = std::chrono::steady_clock::now();
+                wakeWaiters();
+            }
+            cond_.notify_all();
+        }
+
+        setStream(nullptr);
+        if (stream)
+            std::cout << "Closing idle capture device" << std::endl;
+        // Wake up anyone waiting so they can notice that we are gone.
+        cond_.notify_all();
+    }
+
+    void unsubscribe(std::list<Request>::iterator req) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        requests_.erase(req);
+    }
+
+  public:
+    // A client's registration with the session. Frames are fetched with
+    // next(), or nextAsync() from a coroutine, and the client is deregistered
+    // when this goes out of scope.
+    class Subscription {
+        CaptureSession &session_;
+        std::list<Request>::iterator req_;
+        uint64_t lastSequence_ = 0;
+
+        // Whether there is a new frame or an error for the client. Must hold
+        // the session's mutex.
+        bool ready() const {
+            auto &latest = session_.latest_;
+            return !req_->error.empty() || !session_.running_ ||
+                   session_.stop_ ||
+                   (latest && latest->sequence() > lastSequence_ &&
+                    usable(*req_, *latest));
+        }
+
+        // Takes the frame that made the client ready, or throws its error.
+        // Must hold the session's mutex.
+        std::shared_ptr<SharedFrame> take(bool waited) {
+            if (!req_->error.empty())
+                throw std::runtime_error(req_->error);
+            if (!session_.running_ || session_.stop_)
+                throw std::runtime_error("Capture session stopped");
+
+            // Only a wait that was ended by the new frame says how long the
+            // thread took to run again.
+            if (waited)
+                ThreadPlacer::shared()
+                    .wakeups(ThreadRole::NETWORK)
+                    .record(std::chrono::steady_clock::now() -
+                            session_.publishedAt_);
+
+            lastSequence_ = session_.latest_->sequence();
+            return session_.latest_;
+        }
+
+        // Suspends a coroutine until the capture thread has published a
+        // frame or failed.
+        struct Wakeup {
+            Subscription &sub;
+            EventLoop &loop;
+
+            bool await_ready() { return false; }
+            bool await_suspend(std::coroutine_handle<> handle) {
+                std::lock_guard<std::mutex> lock(sub.session_.mutex_);
+                if (sub.ready())
+                    return false;
+                sub.req_->waiter = handle;
+                sub.req_->loop = &loop;
+                return true;
+            }
+            void await_resume() {}
+        };
+
+      public:
+        Subscription(CaptureSession &session, std::list<Request>::iterator req)
+            : session_(session), req_(req) {}
+        Subscription(Subscription const &) = delete;
+        Subscription &operator=(Subscription const &) = delete;
+        ~Subscription() { session_.unsubscribe(req_); }
+
+        // Blocks until a frame newer than the previous one is available. The
+        // first call returns the cached latest frame if there is one.
+        std::shared_ptr<SharedFrame> next() {
+            std::unique_lock<std::mutex> lock(session_.mutex_);
+            bool waited = false;
+            session_.cond_.wait(lock, [this, &waited] {
+                const bool isReady = ready();
+                waited |= !isReady;
+                return isReady;
+            });
+            return take(waited);
+        }
+
+        // Like next(), but suspends the calling coroutine of loop instead of
+        // blocking its thread.
+        Task<std::shared_ptr<SharedFrame>> nextAsync(EventLoop &loop) {
+            bool waited = false;
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> lock(session_.mutex_);
+                    if (ready())
+                        co_return take(waited);
+                }
+                waited = true;
+                co_await Wakeup{*this, loop};
+            }
+        }
+    };
+
+    CaptureSession(const CaptureConfig &cfg = {})
+        : motionDetector_(cfg.motion),
+          idleTimeout_(std::chrono::milliseconds(cfg.idleTimeoutMs)),
+          openStream_(cfg.openStream),
+          statsInterval_(std::chrono::seconds(cfg.statsIntervalS)),
+          lastStats_(std::chrono::steady_clock::now()) {
+        if (!openStream_) {
+            openStream_ = [memory = cfg.captureMemory](int width, int height,
+                                                       int format) {
+                return std::make_unique<V4LStream>(width, height, format,
+                                                   memory);
+            };
+        }
+    }
+
+    CaptureSession(CaptureSession const &) = delete;
+    CaptureSession &operator=(CaptureSession const &) = delete;
+
+    ~CaptureSession() {
+        stop();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    // Counts a frame sent to a client, and the frames that were skipped for
+    // the client since the previous one because it was too slow. The latency
+    // is only counted for frames sent as soon as they were available.
+    void frameSent(const SharedFrame &frame, uint64_t skipped,
+                   bool live = true) {
+        ++framesOut_;
+        droppedOut_ += skipped;
+        if (!live)
+            return;
+        const uint64_t us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - frame.timestamp())
+                .count());
+        latencyUs_ += us;
+        ++latencyCount_;
+        uint64_t max = maxLatencyUs_;
+        while (us > max && !maxLatencyUs_.compare_exchange_weak(max, us)) {
+        }
+    }
+
+    const MotionConfig &motionConfig() const {
+        return motionDetector_.config();
+    }
+
+    // Stops capturing and wakes up all subscribers, which then throw.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            if (stream_)
+                stream_->interrupt();
+            wakeWaiters();
+        }
+        cond_.notify_all();
+    }
+
+    // MJPEG with a quality is encoded from YUYV instead of captured.
+    std::unique_ptr<Subscription> subscribe(int width, int height, int format,
+                                            int quality = 0) {
+        const bool encode = format == V4L2_PIX_FMT_MJPEG && quality > 0;
+        int captureFormat = isCompressed(format) && !encode
+                                ? format
+                                : V4L2_PIX_FMT_YUYV;
+        if (!encode && !canConvert(captureFormat, format))
+            throw std::invalid_argument("Can not stream in " +
+                                        formatToString(format));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_)
+            throw std::runtime_error("Capture session stopped");
+        if (!requests_.empty() && captureFormat != format_)
+            throw std::invalid_argument(
+                "The camera is already streaming in another format");
+        if (!requests_.empty() && isCompressed(captureFormat) &&
+            captureResolution() != std::pair<int, int>{width, height})
+            throw std::invalid_argument(
+                "Compressed streams can not be shared with another resolution");
+
+        requests_.push_back({width, height, captureFormat, {}, {}, nullptr});
+        auto req = std::prev(requests_.end());
+        format_ = captureFormat;
+
+        if (!running_) {
+            // The previous capture thread has left its loop and does not need
+            // the lock anymore, so it can be joined while holding it.
+            if (thread_.joinable())
+                thread_.join();
+            running_ = true;
+            thread_ = std::thread(&CaptureSession::captureWork, this);
+        }
+
+        return std::make_unique<Subscription>(*this, req);
+    }
+};
@@ -1,6 +1,9 @@
 // Simple webcam application that uses Video4Linux for retrieving video stream
 // and SDL2 for viewing it in a window.
 #include "argparser.hpp"
+#include "headless.hpp"
+#include "mosaic.hpp"
+#include "realtime.hpp"
 #include "sdl.hpp"
 #include "tcp-stream.hpp"
 #include "v4l-stream.hpp"
@@ -27,15 +30,111 @@ int main(int argc, const char *argv[]) {
             "Connect to video stream over tcp.");
         parser.addArg("flip").optional("-f").defaultValue(false).description(
             "Flips the video 180 degrees.");
+        parser.addArg("latest").optional("-l").defaultValue(false).description(
+            "Show the latest frame at every vsync instead of every frame.");
         parser.addArg("mjpeg").optional("-m").defaultValue(false).description(
             "Stream in MJPEG format.");
+        parser.addArg("motion").optional("-o").defaultValue(false).description(
+            "Only stream frames with motion (tcp only).");
+        parser.addArg("format").optional("-c").defaultValue("yuyv").description(
+            "Pixel format: yuyv, uyvy, nv12, i420, rgb24, grey or mjpeg.");
+        parser.addArg("quality")
+            .optional("-q")
+            .defaultValue(0)
+            .description("Have the server encode MJPEG with this quality, "
+                         "from 1 to 100, instead of the camera (tcp only).");
+        parser.addArg("hugepages")
+            .optional("-g")
+            .defaultValue(false)
+            .description("Back frame buffers with transparent huge pages.");
+        parser.addArg("streams")
+            .optional("-u")
+            .defaultValue("")
+            .description("Show several tcp streams in a grid, given as a comma "
+                         "separated list of ip:port.");
+        parser.addArg("sink")
+            .optional("-s")
+            .defaultValue("")
+            .description("Write raw frames to a sink instead of showing them: "
+                         "discard, stdout, file:<path> or fifo:<path>.");
+        parser.addArg("frames")
+            .optional("-n")
+            .defaultValue(0)
+            .description("Stop after this many frames when writing to a sink.");
+        parser.addArg("threads")
+            .optional("-A")
+            .defaultValue("")
+            .description("Cores and SCHED_FIFO priorities of the threads, "
+                         "e.g. \"render=1:50;network=2\".");
+        parser.addArg("lock")
+            .optional("-L")
+            .defaultValue(false)
+            .description("Lock all memory, including frame buffers, in RAM.");
+        parser.addArg("perf")
+            .optional("-P")
+            .defaultValue(false)
+            .description("Count cycles, instructions, cache misses and "
+                         "context switches per pipeline stage.");
+        parser.addArg("rewind")
+            .optional("-r")
+            .defaultValue(0)
+            .description("Start this many seconds back in time, if the "
+                         "server keeps frames for rewinding (see its -w).");
+        parser.addArg("speed")
+            .optional("-R")
+            .defaultValue(100)
+            .description("Speed in percent that rewound frames are played "
+                         "back at.");
 
         parser.parse(argc, argv);
 
-        int format =
-            parser.get<bool>("mjpeg") ? V4L2_PIX_FMT_MJPEG : V4L2_PIX_FMT_YUYV;
+        const std::string sinkSpec = parser.get<std::string>("sink");
+        // Frames go to stdout, so everything else goes to stderr.
+        if (sinkSpec == "stdout")
+            cout.rdbuf(cerr.rdbuf());
+
+        BufferPool::shared().useHugePages(parser.get<bool>("hugepages"));
+        ThreadPlacer &placer = ThreadPlacer::shared();
+        placer.configure(parser.get<std::string>("threads"));
+        if (parser.get<bool>("lock"))
+            lockMemory();
+        PerfCounters::shared().enable(parser.get<bool>("perf"));
+        // The main thread shows the frames, or only receives them when they
+        // go to a sink.
+        placer.place(sinkSpec.empty() ? ThreadRole::RENDER
+                                      : ThreadRole::NETWORK);
+
+        int format = parser.get<bool>("mjpeg")
+                         ? V4L2_PIX_FMT_MJPEG
+                         : formatFromString(parser.get<std::string>("format"));
+        // A quality only makes sense for MJPEG, so it implies it.
+        const int quality = parser.get<int>("quality");
+        if (quality < 0 || quality > 100)
+            throw std::invalid_argument("The quality is from 1 to 100");
+        if (quality > 0)
+            format = V4L2_PIX_FMT_MJPEG;
         int width = parser.get<int>("width");
         int height = parser.get<int>("height");
+        const std::chrono::seconds rewind(parser.get<int>("rewind"));
+        const int speed = parser.get<int>("speed");
+        auto startRewind = [&](VideoStream &stream) {
+            if (rewind.count() > 0 && !stream.seek(rewind, speed))
+                cerr << "WARNING: The stream can not be rewound" << endl;
+        };
+
+        const std::string mosaic = parser.get<std::string>("streams");
+        if (!mosaic.empty()) {
+            vector<unique_ptr<VideoStream>> streams;
+            for (auto &[ip, port] : parseEndpoints(mosaic)) {
+                streams.push_back(std::make_unique<TcpStream>(
+                    ip, port, width, height, format,
+                    parser.get<bool>("motion"), quality));
+                startRewind(*streams.back());
+            }
+            MosaicWindow win("Tittut mosaic", streams);
+            win.run();
+            return 0;
+        }
 
         unique_ptr<VideoStream> stream;
         string windowName;
@@ -43,16 +142,33 @@ int main(int argc, const char *argv[]) {
             std::string ip = parser.get<std::string>("ip");
             int port = parser.get<int>("port");
 
-            stream =
-                std::make_unique<TcpStream>(ip, port, width, height, format);
+            stream = std::make_unique<TcpStream>(ip, port, width, height,
+                                                 format,
+                                                 parser.get<bool>("motion"),
+                                                 quality);
             windowName = "Video stream from " + ip + ":" + to_string(port);
+            startRewind(*stream);
         } else {
             stream = make_unique<V4LStream>(width, height, format);
             windowName = "Local video stream";
         }
 
-        SDLWindow win(windowName, stream, parser.get<bool>("flip"));
-        win.run();
+        if (!sinkSpec.empty()) {
+            FrameSink sink(sinkSpec);
+            HeadlessClient headless(stream, sink, parser.get<bool>("flip"));
+            headless.run(static_cast<uint64_t>(parser.get<int>("frames")));
+        } else {
+            SDLWindow win(windowName, stream, parser.get<bool>("flip"),
+                          parser.get<bool>("latest"));
+            win.run();
+        }
+
+        auto stats = BufferPool::shared().stats();
+        cout << "Buffer pool: " << stats.allocations << " allocations, "
+             << stats.systemAllocations << " from the system, "
+             << stats.systemBytes / 1024 << " kB held\n";
+        placer.printWakeups(cout);
+        PerfCounters::shared().print(cout);
     } catch (exception &e) {
         cout << "ERROR: " << e.what() << endl;
     }
@@ -0,0 +1,603 @@
+// Colour space conversion between the uncompressed pixel formats.
+//
+// Every conversion is built from a handful of row primitives that exist in a
+// scalar, an SSE2 and an AVX2 version. The fastest version that the CPU
+// supports is picked at runtime, so a binary built for generic x86-64 still
+// uses AVX2 where it is available.
+//
+// YUV <-> RGB uses BT.601 limited range with coefficients in 6 bit fixed point
+// and saturating 16 bit arithmetic, so that all versions give identical
+// results.
+#pragma once
+
+#include "buffer-pool.hpp"
+#include "pixel-format.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define TITTUT_AVX2 __attribute__((target("avx2")))
+#endif
+
+enum class SimdLevel { SCALAR = 0, SSE2 = 1, AVX2 = 2 };
+
+std::string simdLevelToString(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::SCALAR:
+        return "scalar";
+    case SimdLevel::SSE2:
+        return "sse2";
+    case SimdLevel::AVX2:
+        return "avx2";
+    default:
+        throw std::invalid_argument("Got invalid SimdLevel");
+    }
+}
+
+// The best SIMD level that the running CPU supports.
+SimdLevel simdLevel() {
+#ifdef __x86_64__
+    static const SimdLevel level = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? SimdLevel::AVX2
+                                              : SimdLevel::SSE2;
+    }();
+    return level;
+#else
+    return SimdLevel::SCALAR;
+#endif
+}
+
+int16_t saturate16(int v) {
+    return static_cast<int16_t>(std::clamp(v, -32768, 32767));
+}
+
+uint8_t clampByte(int v) { return static_cast<uint8_t>(std::clamp(v, 0, 255)); }
+
+// Row primitives. Widths are in pixels and chroma rows hold interleaved U and
+// V samples, i.e. width bytes for a row of width pixels.
+struct ScalarRows {
+    // Y samples of a YUYV row.
+    static void luma(const uint8_t *src, uint8_t *y, int width) {
+        for (int i = 0; i < width; ++i)
+            y[i] = src[2 * i];
+    }
+
+    // UV samples of two YUYV rows, averaged vertically.
+    static void chroma(const uint8_t *r0, const uint8_t *r1, uint8_t *uv,
+                       int width) {
+        for (int i = 0; i < width; ++i)
+            uv[i] = static_cast<uint8_t>((r0[2 * i + 1] + r1[2 * i + 1] + 1) >>
+                                         1);
+    }
+
+    // Splits n UV pairs into separate U and V rows.
+    static void splitUv(const uint8_t *uv, uint8_t *u, uint8_t *v, int n) {
+        for (int i = 0; i < n; ++i) {
+            u[i] = uv[2 * i];
+            v[i] = uv[2 * i + 1];
+        }
+    }
+
+    // Merges n U and V samples into UV pairs.
+    static void mergeUv(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        int n) {
+        for (int i = 0; i < n; ++i) {
+            uv[2 * i] = u[i];
+            uv[2 * i + 1] = v[i];
+        }
+    }
+
+    // Interleaves a luma row and a chroma row into a YUYV row.
+    static void packYuyv(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+                         int width) {
+        for (int i = 0; i < width; ++i) {
+            dst[2 * i] = y[i];
+            dst[2 * i + 1] = uv[i];
+        }
+    }
+
+    // Swaps the bytes of each byte pair, which turns YUYV into UYVY and back.
+    static void swapPairs(const uint8_t *src, uint8_t *dst, int bytes) {
+        for (int i = 0; i + 1 < bytes; i += 2) {
+            const uint8_t first = src[i];
+            dst[i] = src[i + 1];
+            dst[i + 1] = first;
+        }
+    }
+
+    static void yuvToRgb(int y, int u, int v, uint8_t *rgb) {
+        // 1.164 * 64 = 74.5
+        const int c = 74 * (y - 16) + ((y - 16) >> 1);
+        const int d = u - 128;
+        const int e = v - 128;
+        rgb[0] = clampByte(saturate16(saturate16(c + 102 * e) + 32) >> 6);
+        rgb[1] = clampByte(
+            saturate16(saturate16(saturate16(c - 25 * d) - 52 * e) + 32) >> 6);
+        rgb[2] = clampByte(saturate16(saturate16(c + 129 * d) + 32) >> 6);
+    }
+
+    static void rgb(const uint8_t *src, uint8_t *rgb, int width) {
+        for (int i = 0; i < width; i += 2) {
+            const uint8_t *p = src + 2 * i;
+            yuvToRgb(p[0], p[1], p[3], rgb + 3 * i);
+            yuvToRgb(p[2], p[1], p[3], rgb + 3 * i + 3);
+        }
+    }
+};
+
+#ifdef __x86_64__
+// Interleaves separately computed R, G and B rows.
+void interleaveRgb(const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                   uint8_t *rgb, int n) {
+    for (int i = 0; i < n; ++i) {
+        rgb[3 * i] = r[i];
+        rgb[3 * i + 1] = g[i];
+        rgb[3 * i + 2] = b[i];
+    }
+}
+
+struct Sse2Rows {
+    static __m128i load(const uint8_t *p) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    }
+
+    static void store(uint8_t *p, __m128i v) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+    }
+
+    static void luma(const uint8_t *src, uint8_t *y, int width) {
+        const __m128i mask = _mm_set1_epi16(0xff);
+        int i = 0;
+        for (; i + 16 <= width; i += 16) {
+            __m128i a = _mm_and_si128(load(src + 2 * i), mask);
+            __m128i b = _mm_and_si128(load(src + 2 * i + 16), mask);
+            store(y + i, _mm_packus_epi16(a, b));
+        }
+        ScalarRows::luma(src + 2 * i, y + i, width - i);
+    }
+
+    static __m128i oddBytes(const uint8_t *src) {
+        return _mm_packus_epi16(_mm_srli_epi16(load(src), 8),
+                                _mm_srli_epi16(load(src + 16), 8));
+    }
+
+    static void chroma(const uint8_t *r0, const uint8_t *r1, uint8_t *uv,
+                       int width) {
+        int i = 0;
+        for (; i + 16 <= width; i += 16)
+            store(uv + i,
+                  _mm_avg_epu8(oddBytes(r0 + 2 * i), oddBytes(r1 + 2 * i)));
+        ScalarRows::chroma(r0 + 2 * i, r1 + 2 * i, uv + i, width - i);
+    }
+
+    static void splitUv(const uint8_t *uv, uint8_t *u, uint8_t *v, int n) {
+        const __m128i mask = _mm_set1_epi16(0xff);
+        int i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = load(uv + 2 * i);
+            __m128i b = load(uv + 2 * i + 16);
+            store(u + i, _mm_packus_epi16(_mm_and_si128(a, mask),
+                                          _mm_and_si128(b, mask)));
+            store(v + i, _mm_packus_epi16(_mm_srli_epi16(a, 8),
+                                          _mm_srli_epi16(b, 8)));
+        }
+        ScalarRows::splitUv(uv + 2 * i, u + i, v + i, n - i);
+    }
+
+    static void interleave(const uint8_t *a, const uint8_t *b, uint8_t *dst) {
+        __m128i va = load(a);
+        __m128i vb = load(b);
+        store(dst, _mm_unpacklo_epi8(va, vb));
+        store(dst + 16, _mm_unpackhi_epi8(va, vb));
+    }
+
+    static void mergeUv(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        int n) {
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+            interleave(u + i, v + i, uv + 2 * i);
+        ScalarRows::mergeUv(u + i, v + i, uv + 2 * i, n - i);
+    }
+
+    static void packYuyv(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+                         int width) {
+        int i = 0;
+        for (; i + 16 <= width; i += 16)
+            interleave(y + i, uv + i, dst + 2 * i);
+        ScalarRows::packYuyv(y + i, uv + i, dst + 2 * i, width - i);
+    }
+
+    static void swapPairs(const uint8_t *src, uint8_t *dst, int bytes) {
+        int i = 0;
+        for (; i + 16 <= bytes; i += 16) {
+            __m128i v = load(src + i);
+            store(dst + i,
+                  _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+        }
+        ScalarRows::swapPairs(src + i, dst + i, bytes - i);
+    }
+
+    // R, G and B of 8 YUYV pixels as 16 bit lanes.
+    static void rgb8(__m128i p, __m128i &r, __m128i &g, __m128i &b) {
+        const __m128i y = _mm_sub_epi16(_mm_and_si128(p, _mm_set1_epi16(0xff)),
+                                        _mm_set1_epi16(16));
+        const __m128i c = _mm_add_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(74)),
+                                        _mm_srai_epi16(y, 1));
+        // Lanes are U0 V0 U1 V1 ..., duplicate them for both pixels of a pair.
+        __m128i uv = _mm_sub_epi16(_mm_srli_epi16(p, 8), _mm_set1_epi16(128));
+        __m128i d = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, 0xa0), 0xa0);
+        __m128i e = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, 0xf5), 0xf5);
+        const __m128i round = _mm_set1_epi16(32);
+
+        __m128i rv = _mm_mullo_epi16(e, _mm_set1_epi16(102));
+        __m128i gu = _mm_mullo_epi16(d, _mm_set1_epi16(25));
+        __m128i gv = _mm_mullo_epi16(e, _mm_set1_epi16(52));
+        __m128i bu = _mm_mullo_epi16(d, _mm_set1_epi16(129));
+        r = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(c, rv), round), 6);
+        g = _mm_srai_epi16(
+            _mm_adds_epi16(_mm_subs_epi16(_mm_subs_epi16(c, gu), gv), round),
+            6);
+        b = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(c, bu), round), 6);
+    }
+
+    static void rgb(const uint8_t *src, uint8_t *rgb, int width) {
+        alignas(16) uint8_t r[16], g[16], b[16];
+        int i = 0;
+        for (; i + 16 <= width; i += 16) {
+            __m128i r0, g0, b0, r1, g1, b1;
+            rgb8(load(src + 2 * i), r0, g0, b0);
+            rgb8(load(src + 2 * i + 16), r1, g1, b1);
+            store(r, _mm_packus_epi16(r0, r1));
+            store(g, _mm_packus_epi16(g0, g1));
+            store(b, _mm_packus_epi16(b0, b1));
+            interleaveRgb(r, g, b, rgb + 3 * i, 16);
+        }
+        ScalarRows::rgb(src + 2 * i, rgb + 3 * i, width - i);
+    }
+};
+
+// The AVX2 versions work like the SSE2 ones on twice as many bytes. Packing
+// and unpacking work within 128 bit lanes though, so the 64 bit quarters have
+// to be put back in order with a permute (0xd8 swaps the middle quarters).
+struct Avx2Rows {
+    TITTUT_AVX2 static __m256i load(const uint8_t *p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    }
+
+    TITTUT_AVX2 static void store(uint8_t *p, __m256i v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+    }
+
+    TITTUT_AVX2 static void luma(const uint8_t *src, uint8_t *y, int width) {
+        const __m256i mask = _mm256_set1_epi16(0xff);
+        int i = 0;
+        for (; i + 32 <= width; i += 32) {
+            __m256i a = _mm256_and_si256(load(src + 2 * i), mask);
+            __m256i b = _mm256_and_si256(load(src + 2 * i + 32), mask);
+            store(y + i,
+                  _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+        }
+        Sse2Rows::luma(src + 2 * i, y + i, width - i);
+    }
+
+    TITTUT_AVX2 static __m256i oddBytes(const uint8_t *src) {
+        __m256i a = _mm256_srli_epi16(load(src), 8);
+        __m256i b = _mm256_srli_epi16(load(src + 32), 8);
+        return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+    }
+
+    TITTUT_AVX2 static void chroma(const uint8_t *r0, const uint8_t *r1,
+                                   uint8_t *uv, int width) {
+        int i = 0;
+        for (; i + 32 <= width; i += 32) {
+            store(uv + i,
+                  _mm256_avg_epu8(oddBytes(r0 + 2 * i), oddBytes(r1 + 2 * i)));
+        }
+        Sse2Rows::chroma(r0 + 2 * i, r1 + 2 * i, uv + i, width - i);
+    }
+
+    TITTUT_AVX2 static void splitUv(const uint8_t *uv, uint8_t *u, uint8_t *v,
+                                    int n) {
+        const __m256i mask = _mm256_set1_epi16(0xff);
+        int i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i a = load(uv + 2 * i);
+            __m256i b = load(uv + 2 * i + 32);
+            store(u + i, _mm256_permute4x64_epi64(
+                             _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                                 _mm256_and_si256(b, mask)),
+                             0xd8));
+            store(v + i, _mm256_permute4x64_epi64(
+                             _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                                 _mm256_srli_epi16(b, 8)),
+                             0xd8));
+        }
+        Sse2Rows::splitUv(uv + 2 * i, u + i, v + i, n - i);
+    }
+
+    TITTUT_AVX2 static void interleave(const uint8_t *a, const uint8_t *b,
+                                       uint8_t *dst) {
+        __m256i va = _mm256_permute4x64_epi64(load(a), 0xd8);
+        __m256i vb = _mm256_permute4x64_epi64(load(b), 0xd8);
+        store(dst, _mm256_unpacklo_epi8(va, vb));
+        store(dst + 32, _mm256_unpackhi_epi8(va, vb));
+    }
+
+    TITTUT_AVX2 static void mergeUv(const uint8_t *u, const uint8_t *v,
+                                    uint8_t *uv, int n) {
+        int i = 0;
+        for (; i + 32 <= n; i += 32)
+            interleave(u + i, v + i, uv + 2 * i);
+        Sse2Rows::mergeUv(u + i, v + i, uv + 2 * i, n - i);
+    }
+
+    TITTUT_AVX2 static void packYuyv(const uint8_t *y, const uint8_t *uv,
+                                     uint8_t *dst, int width) {
+        int i = 0;
+        for (; i + 32 <= width; i += 32)
+            interleave(y + i, uv + i, dst + 2 * i);
+        Sse2Rows::packYuyv(y + i, uv + i, dst + 2 * i, width - i);
+    }
+
+    TITTUT_AVX2 static void swapPairs(const uint8_t *src, uint8_t *dst,
+                                      int bytes) {
+        int i = 0;
+        for (; i + 32 <= bytes; i += 32) {
+            __m256i v = load(src + i);
+            store(dst + i, _mm256_or_si256(_mm256_slli_epi16(v, 8),
+                                           _mm256_srli_epi16(v, 8)));
+        }
+        Sse2Rows::swapPairs(src + i, dst + i, bytes - i);
+    }
+
+    TITTUT_AVX2 static void rgb16(__m256i p, __m256i &r, __m256i &g,
+                                  __m256i &b) {
+        const __m256i y =
+            _mm256_sub_epi16(_mm256_and_si256(p, _mm256_set1_epi16(0xff)),
+                             _mm256_set1_epi16(16));
+        const __m256i c =
+            _mm256_add_epi16(_mm256_mullo_epi16(y, _mm256_set1_epi16(74)),
+                             _mm256_srai_epi16(y, 1));
+        __m256i uv =
+            _mm256_sub_epi16(_mm256_srli_epi16(p, 8), _mm256_set1_epi16(128));
+        __m256i d =
+            _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, 0xa0), 0xa0);
+        __m256i e =
+            _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, 0xf5), 0xf5);
+        const __m256i round = _mm256_set1_epi16(32);
+
+        __m256i rv = _mm256_mullo_epi16(e, _mm256_set1_epi16(102));
+        __m256i gu = _mm256_mullo_epi16(d, _mm256_set1_epi16(25));
+        __m256i gv = _mm256_mullo_epi16(e, _mm256_set1_epi16(52));
+        __m256i bu = _mm256_mullo_epi16(d, _mm256_set1_epi16(129));
+        r = _mm256_srai_epi16(
+            _mm256_adds_epi16(_mm256_adds_epi16(c, rv), round), 6);
+        g = _mm256_srai_epi16(
+            _mm256_adds_epi16(_mm256_subs_epi16(_mm256_subs_epi16(c, gu), gv),
+                              round),
+            6);
+        b = _mm256_srai_epi16(
+            _mm256_adds_epi16(_mm256_adds_epi16(c, bu), round), 6);
+    }
+
+    TITTUT_AVX2 static void rgb(const uint8_t *src, uint8_t *rgb, int width) {
+        alignas(32) uint8_t r[32], g[32], b[32];
+        int i = 0;
+        for (; i + 32 <= width; i += 32) {
+            __m256i r0, g0, b0, r1, g1, b1;
+            rgb16(load(src + 2 * i), r0, g0, b0);
+            rgb16(load(src + 2 * i + 32), r1, g1, b1);
+            store(r, _mm256_permute4x64_epi64(_mm256_packus_epi16(r0, r1),
+                                              0xd8));
+            store(g, _mm256_permute4x64_epi64(_mm256_packus_epi16(g0, g1),
+                                              0xd8));
+            store(b, _mm256_permute4x64_epi64(_mm256_packus_epi16(b0, b1),
+                                              0xd8));
+            interleaveRgb(r, g, b, rgb + 3 * i, 32);
+        }
+        Sse2Rows::rgb(src + 2 * i, rgb + 3 * i, width - i);
+    }
+};
+#endif
+
+// Frame kernels. All frames are tightly packed, planar formats with their
+// planes directly after each other.
+using ConvertKernel = void (*)(const uint8_t *src, uint8_t *dst, int width,
+                               int height);
+
+template <typename Rows>
+void yuyvToGrey(const uint8_t *src, uint8_t *dst, int width, int height) {
+    for (int y = 0; y < height; ++y)
+        Rows::luma(src + y * width * 2, dst + y * width, width);
+}
+
+template <typename Rows>
+void yuyvToNv12(const uint8_t *src, uint8_t *dst, int width, int height) {
+    uint8_t *uv = dst + width * height;
+    for (int y = 0; y < height; y += 2) {
+        const uint8_t *r0 = src + y * width * 2;
+        const uint8_t *r1 = r0 + width * 2;
+        Rows::luma(r0, dst + y * width, width);
+        Rows::luma(r1, dst + (y + 1) * width, width);
+        Rows::chroma(r0, r1, uv + (y / 2) * width, width);
+    }
+}
+
+template <typename Rows>
+void yuyvToI420(const uint8_t *src, uint8_t *dst, int width, int height) {
+    uint8_t *u = dst + width * height;
+    uint8_t *v = u + (width / 2) * (height / 2);
+    std::vector<uint8_t> &uv = scratch<uint8_t, 1>(width);
+    for (int y = 0; y < height; y += 2) {
+        const uint8_t *r0 = src + y * width * 2;
+        const uint8_t *r1 = r0 + width * 2;
+        Rows::luma(r0, dst + y * width, width);
+        Rows::luma(r1, dst + (y + 1) * width, width);
+        Rows::chroma(r0, r1, uv.data(), width);
+        Rows::splitUv(uv.data(), u + (y / 2) * (width / 2),
+                      v + (y / 2) * (width / 2), width / 2);
+    }
+}
+
+template <typename Rows>
+void yuyvToRgb24(const uint8_t *src, uint8_t *dst, int width, int height) {
+    for (int y = 0; y < height; ++y)
+        Rows::rgb(src + y * width * 2, dst + y * width * 3, width);
+}
+
+template <typename Rows>
+void nv12ToYuyv(const uint8_t *src, uint8_t *dst, int width, int height) {
+    const uint8_t *uv = src + width * height;
+    for (int y = 0; y < height; ++y)
+        Rows::packYuyv(src + y * width, uv + (y / 2) * width,
+                       dst + y * width * 2, width);
+}
+
+template <typename Rows>
+void i420ToYuyv(const uint8_t *src, uint8_t *dst, int width, int height) {
+    const uint8_t *u = src + width * height;
+    const uint8_t *v = u + (width / 2) * (height / 2);
+    std::vector<uint8_t> &uv = scratch<uint8_t, 1>(width);
+    for (int y = 0; y < height; ++y) {
+        if (y % 2 == 0)
+            Rows::mergeUv(u + (y / 2) * (width / 2), v + (y / 2) * (width / 2),
+                          uv.data(), width / 2);
+        Rows::packYuyv(src + y * width, uv.data(), dst + y * width * 2, width);
+    }
+}
+
+template <typename Rows>
+void greyToYuyv(const uint8_t *src, uint8_t *dst, int width, int height) {
+    std::vector<uint8_t> &uv = scratch<uint8_t, 1>(width);
+    std::fill(uv.begin(), uv.end(), 128);
+    for (int y = 0; y < height; ++y)
+        Rows::packYuyv(src + y * width, uv.data(), dst + y * width * 2, width);
+}
+
+template <typename Rows>
+void nv12ToI420(const uint8_t *src, uint8_t *dst, int width, int height) {
+    const int chromaSize = (width / 2) * (height / 2);
+    std::memcpy(dst, src, width * height);
+    Rows::splitUv(src + width * height, dst + width * height,
+                  dst + width * height + chromaSize, chromaSize);
+}
+
+template <typename Rows>
+void i420ToNv12(const uint8_t *src, uint8_t *dst, int width, int height) {
+    const int chromaSize = (width / 2) * (height / 2);
+    std::memcpy(dst, src, width * height);
+    Rows::mergeUv(src + width * height, src + width * height + chromaSize,
+                  dst + width * height, chromaSize);
+}
+
+// YUYV to UYVY and back, the same byte swap both ways.
+template <typename Rows>
+void swapPacked422(const uint8_t *src, uint8_t *dst, int width, int height) {
+    for (int y = 0; y < height; ++y)
+        Rows::swapPairs(src + y * width * 2, dst + y * width * 2, width * 2);
+}
+
+// There is no SIMD version of this one since nothing time critical produces
+// RGB frames that need to be streamed.
+void rgb24ToYuyv(const uint8_t *src, uint8_t *dst, int width, int height) {
+    auto luma = [](const uint8_t *p) {
+        return clampByte(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) +
+                         16);
+    };
+    for (int i = 0; i < width * height; i += 2) {
+        const uint8_t *p0 = src + 3 * i;
+        const uint8_t *p1 = p0 + 3;
+        int r = (p0[0] + p1[0]) / 2, g = (p0[1] + p1[1]) / 2,
+            b = (p0[2] + p1[2]) / 2;
+        dst[2 * i] = luma(p0);
+        dst[2 * i + 1] =
+            clampByte(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        dst[2 * i + 2] = luma(p1);
+        dst[2 * i + 3] =
+            clampByte(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+template <typename Rows>
+ConvertKernel selectKernel(int srcFormat, int dstFormat) {
+    if (srcFormat == V4L2_PIX_FMT_YUYV) {
+        switch (dstFormat) {
+        case V4L2_PIX_FMT_GREY:
+            return yuyvToGrey<Rows>;
+        case V4L2_PIX_FMT_NV12:
+            return yuyvToNv12<Rows>;
+        case V4L2_PIX_FMT_YUV420:
+            return yuyvToI420<Rows>;
+        case V4L2_PIX_FMT_RGB24:
+            return yuyvToRgb24<Rows>;
+        case V4L2_PIX_FMT_UYVY:
+            return swapPacked422<Rows>;
+        }
+    } else if (dstFormat == V4L2_PIX_FMT_YUYV) {
+        switch (srcFormat) {
+        case V4L2_PIX_FMT_GREY:
+            return greyToYuyv<Rows>;
+        case V4L2_PIX_FMT_NV12:
+            return nv12ToYuyv<Rows>;
+        case V4L2_PIX_FMT_YUV420:
+            return i420ToYuyv<Rows>;
+        case V4L2_PIX_FMT_RGB24:
+            return rgb24ToYuyv;
+        case V4L2_PIX_FMT_UYVY:
+            return swapPacked422<Rows>;
+        }
+    } else if (srcFormat == V4L2_PIX_FMT_NV12 &&
+               dstFormat == V4L2_PIX_FMT_YUV420) {
+        return nv12ToI420<Rows>;
+    } else if (srcFormat == V4L2_PIX_FMT_YUV420 &&
+               dstFormat == V4L2_PIX_FMT_NV12) {
+        return i420ToNv12<Rows>;
+    }
+    return nullptr;
+}
+
+// Returns the conversion kernel between two formats, or nullptr if there is
+// none.
+ConvertKernel convertKernel(int srcFormat, int dstFormat,
+                            SimdLevel level = simdLevel()) {
+    switch (level) {
+#ifdef __x86_64__
+    case SimdLevel::AVX2:
+        return selectKernel<Avx2Rows>(srcFormat, dstFormat);
+    case SimdLevel::SSE2:
+        return selectKernel<Sse2Rows>(srcFormat, dstFormat);
+#endif
+    default:
+        return selectKernel<ScalarRows>(srcFormat, dstFormat);
+    }
+}
+
+bool canConvert(int srcFormat, int dstFormat) {
+    return srcFormat == dstFormat ||
+           convertKernel(srcFormat, dstFormat) != nullptr;
+}
+
+// Converts a frame, dst has to be frameSize(dstFormat, width, height) bytes.
+void convertFrame(int srcFormat, int dstFormat, const uint8_t *src,
+                  uint8_t *dst, int width, int height) {
+    if (width % 2 || height % 2)
+        throw std::invalid_argument("Can only convert frames of even size");
+    if (srcFormat == dstFormat) {
+        std::memcpy(dst, src, frameSize(srcFormat, width, height));
+        return;
+    }
+
+    ConvertKernel kernel = convertKernel(srcFormat, dstFormat);
+    if (kernel == nullptr)
+        throw std::invalid_argument("Can not convert from " +
+                                    formatToString(srcFormat) + " to " +
+                                    formatToString(dstFormat));
+    kernel(src, dst, width, height);
+}
@@ -0,0 +1,394 @@
+// Shares the server's uplink between its clients. With a bandwidth budget,
+// every frame waits for its turn before it is sent. Turns are given in
+// weighted fair order, i.e. by the virtual time at which a client's frame
+// would be done if the clients shared the link in proportion to their
+// weights, and no faster than the budget allows. A client only ever has its
+// newest frame waiting, so one that gets few turns skips frames rather than
+// falling behind.
+//
+// Admission control reserves the bandwidth that every stream is expected to
+// take, and has a new stream sent in a lower resolution, or turns it away,
+// when it does not fit in what is left of the budget.
+#pragma once
+
+#include "event-loop.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+struct EgressConfig {
+    // Bandwidth of all frames sent to clients, in Mbit/s, 0 for no limit.
+    double budgetMbps = 0;
+    // Weights of clients by IP address, the others have weight 1.
+    std::map<std::string, int> weights;
+    // Frame rate that admission control expects streams to take.
+    int fps = 30;
+    // Seconds between printing the statistics, 0 for never.
+    int statsIntervalS = 0;
+};
+
+// Parses weights written as "ip=weight", separated by ','.
+std::map<std::string, int> parseWeights(std::string_view str) {
+    std::map<std::string, int> weights;
+    while (!str.empty()) {
+        size_t end = str.find(',');
+        std::string part(str.substr(0, end));
+        str = end == std::string_view::npos ? "" : str.substr(end + 1);
+        if (part.empty())
+            continue;
+
+        size_t eq = part.find('=');
+        int weight = 0;
+        if (eq == 0 || eq == std::string::npos ||
+            sscanf(part.c_str() + eq + 1, "%d", &weight) != 1 ||
+            weight < 1 || weight > 1000)
+            throw std::invalid_argument("Invalid weight: " + part);
+        weights[part.substr(0, eq)] = weight;
+    }
+    return weights;
+}
+
+class EgressScheduler {
+    using Clock = std::chrono::steady_clock;
+
+  public:
+    // A connected client's share of the budget.
+    class Client {
+        friend class EgressScheduler;
+
+        EgressScheduler &scheduler_;
+        std::string address_;
+        int weight_ = 1;
+        // Bytes per second reserved by admission control.
+        double reserved_ = 0;
+        // The frame waiting for its turn, and the virtual time at which the
+        // client's last frame is done.
+        size_t size_ = 0;
+        double finish_ = 0;
+        EventLoop *loop_ = nullptr;
+        std::coroutine_handle<> waiter_;
+        Clock::time_point since_;
+        // Statistics since they were last printed.
+        uint64_t bytes_ = 0;
+        uint64_t frames_ = 0;
+        uint64_t waited_ = 0;
+        Clock::duration waitTime_{};
+        Clock::duration maxWait_{};
+
+        // Suspends until a frame of size bytes may be sent.
+        struct Turn {
+            Client &client;
+            size_t size;
+            EventLoop &loop;
+
+            bool await_ready() { return !client.scheduler_.limited(); }
+            bool await_suspend(std::coroutine_handle<> handle) {
+                // Printed here too, since the frames of admitted streams
+                // seldom have to wait for the pump.
+                client.scheduler_.printStats(Clock::now());
+                return client.scheduler_.enqueue(client, size, loop, handle);
+            }
+            void await_resume() {}
+        };
+
+      public:
+        // address is the client's "ip:port", whose ip gives the weight.
+        Client(EgressScheduler &scheduler, std::string address)
+            : scheduler_(scheduler), address_(std::move(address)) {
+            auto it = scheduler_.config_.weights.find(
+                address_.substr(0, address_.rfind(':')));
+            if (it != scheduler_.config_.weights.end())
+                weight_ = it->second;
+            scheduler_.add(*this);
+        }
+
+        Client(Client const &) = delete;
+        Client &operator=(Client const &) = delete;
+
+        ~Client() { scheduler_.remove(*this); }
+
+        int weight() const { return weight_; }
+
+        // Awaited before sending a frame of size bytes from loop.
+        Turn turn(size_t size, EventLoop &loop) { return {*this, size, loop}; }
+
+        // Admission control for a stream of width x height, where frameSize
+        // gives the bytes of a frame in any resolution, in place of what the
+        // client had reserved before. A scalable stream that does not fit is
+        // halved in resolution until it does. Returns the resolution to
+        // stream in, or nullopt if the stream does not fit at all.
+        template <typename FrameSize>
+        std::optional<std::pair<int, int>>
+        admit(int width, int height, bool scalable, FrameSize frameSize) {
+            return scheduler_.admit(*this, width, height, scalable, frameSize);
+        }
+    };
+
+  private:
+    // Most of the budget that is saved up while nothing is sent.
+    static constexpr std::chrono::milliseconds MAX_BURST{50};
+    // Streams are not downgraded to less than this width.
+    static constexpr int MIN_WIDTH = 160;
+
+    EgressConfig config_;
+    // Budget in bytes per second, 0 for no limit.
+    double rate_ = 0;
+    std::mutex mutex_;
+    std::vector<Client *> clients_;
+    // Clients with a frame waiting for its turn, in no particular order.
+    std::vector<Client *> waiting_;
+    // Bytes that may be sent right away. A frame larger than what is left
+    // makes it negative, and the next frame waits until it has been paid
+    // for.
+    double tokens_ = 0;
+    Clock::time_point refilled_;
+    // Virtual time of the last frame given its turn.
+    double virtualTime_ = 0;
+    // Bytes per second reserved by all clients.
+    double reserved_ = 0;
+    bool stopped_ = false;
+    // The pump, while no client is waiting.
+    std::coroutine_handle<> pump_;
+    EventLoop *pumpLoop_ = nullptr;
+    // Statistics since they were last printed.
+    Clock::time_point lastStats_;
+    uint64_t bytes_ = 0;
+    uint64_t admitted_ = 0;
+    uint64_t downgraded_ = 0;
+    uint64_t rejected_ = 0;
+
+    // Suspends the pump until a client waits for its turn.
+    struct Idle {
+        EgressScheduler &scheduler;
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> handle) {
+            std::lock_guard<std::mutex> lock(scheduler.mutex_);
+            if (scheduler.stopped_ || !scheduler.waiting_.empty())
+                return false;
+            scheduler.pump_ = handle;
+            return true;
+        }
+        void await_resume() {}
+    };
+
+    void add(Client &client) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clients_.push_back(&client);
+        // So that waiting never allocates.
+        waiting_.reserve(clients_.size());
+    }
+
+    void remove(Client &client) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::erase(clients_, &client);
+        std::erase(waiting_, &client);
+        reserved_ -= client.reserved_;
+    }
+
+    // Must hold mutex_.
+    void refill(Clock::time_point now) {
+        const double seconds = std::chrono::duration<double>(now - refilled_)
+                                   .count();
+        refilled_ = now;
+        tokens_ = std::min(tokens_ + rate_ * seconds,
+                           rate_ * std::chrono::duration<double>(MAX_BURST)
+                                       .count());
+    }
+
+    // Must hold mutex_.
+    void grant(Client &client, size_t size, Clock::duration wait) {
+        tokens_ -= static_cast<double>(size);
+        virtualTime_ = client.finish_;
+        bytes_ += size;
+        client.bytes_ += size;
+        ++client.frames_;
+        if (wait.count() > 0) {
+            ++client.waited_;
+            client.waitTime_ += wait;
+            client.maxWait_ = std::max(client.maxWait_, wait);
+        }
+    }
+
+    // Gives the frame its turn right away if no one else is waiting and the
+    // budget allows, and returns false, or queues it and returns true.
+    bool enqueue(Client &client, size_t size, EventLoop &loop,
+                 std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto now = Clock::now();
+        refill(now);
+        client.finish_ = std::max(virtualTime_, client.finish_) +
+                         static_cast<double>(size) / client.weight_;
+        if (stopped_ || (waiting_.empty() && tokens_ >= 0)) {
+            grant(client, size, {});
+            return false;
+        }
+
+        client.size_ = size;
+        client.loop_ = &loop;
+        client.waiter_ = handle;
+        client.since_ = now;
+        waiting_.push_back(&client);
+        if (pump_)
+            pumpLoop_->schedule(std::exchange(pump_, {}));
+        return true;
+    }
+
+    // Gives turns to the waiting clients, the one whose frame is done first
+    // in virtual time first, while the budget allows. Returns how long until
+    // it allows the next one, or nullopt if no client is waiting. Must hold
+    // mutex_.
+    std::optional<Clock::duration> dispatch(Clock::time_point now) {
+        refill(now);
+        while (!waiting_.empty()) {
+            if (tokens_ < 0)
+                return std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(-tokens_ / rate_));
+
+            auto next = std::min_element(
+                waiting_.begin(), waiting_.end(),
+                [](Client *a, Client *b) { return a->finish_ < b->finish_; });
+            Client &client = **next;
+            *next = waiting_.back();
+            waiting_.pop_back();
+            grant(client, client.size_, now - client.since_);
+            client.loop_->schedule(std::exchange(client.waiter_, {}));
+        }
+        return std::nullopt;
+    }
+
+    template <typename FrameSize>
+    std::optional<std::pair<int, int>> admit(Client &client, int width,
+                                             int height, bool scalable,
+                                             FrameSize frameSize) {
+        if (!limited())
+            return std::pair{width, height};
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        const double available = rate_ - reserved_ + client.reserved_;
+        auto needed = [&](int w, int h) {
+            return static_cast<double>(frameSize(w, h)) * config_.fps;
+        };
+        int w = width;
+        int h = height;
+        while (needed(w, h) > available) {
+            if (!scalable || w / 2 < MIN_WIDTH) {
+                ++rejected_;
+                return std::nullopt;
+            }
+            w = w / 4 * 2;
+            h = std::max(2, h / 4 * 2);
+        }
+        reserved_ += needed(w, h) - client.reserved_;
+        client.reserved_ = needed(w, h);
+        ++(w == width ? admitted_ : downgraded_);
+        return std::pair{w, h};
+    }
+
+    void printStats(Clock::time_point now) {
+        if (config_.statsIntervalS <= 0)
+            return;
+
+        std::string stats;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (now - lastStats_ < std::chrono::seconds(config_.statsIntervalS))
+                return;
+            const double seconds =
+                std::chrono::duration<double>(now - lastStats_).count();
+            lastStats_ = now;
+            auto mbps = [seconds](double bytes) {
+                return bytes * 8 / seconds / 1e6;
+            };
+            auto ms = [](Clock::duration d) {
+                return std::chrono::duration<double, std::milli>(d).count();
+            };
+
+            std::ostringstream os;
+            os << std::fixed << std::setprecision(1) << "Egress "
+               << mbps(static_cast<double>(bytes_)) << " of "
+               << config_.budgetMbps << " Mbit/s ("
+               << static_cast<double>(bytes_) / (rate_ * seconds) * 100
+               << "%), " << reserved_ * 8 / 1e6
+               << " Mbit/s reserved. Streams " << admitted_ << " admitted, "
+               << downgraded_ << " downgraded, " << rejected_
+               << " rejected\n";
+            bytes_ = admitted_ = downgraded_ = rejected_ = 0;
+            for (Client *c : clients_) {
+                os << "  " << c->address_ << " weight " << c->weight_ << ": "
+                   << mbps(static_cast<double>(c->bytes_)) << " Mbit/s, "
+                   << static_cast<double>(c->frames_) / seconds << " fps, "
+                   << c->waited_ << " frames waited "
+                   << (c->waited_ == 0 ? 0.0
+                                       : ms(c->waitTime_) /
+                                             static_cast<double>(c->waited_))
+                   << " ms average, " << ms(c->maxWait_) << " ms max\n";
+                c->bytes_ = c->frames_ = c->waited_ = 0;
+                c->waitTime_ = c->maxWait_ = {};
+            }
+            stats = os.str();
+        }
+        std::cout << stats << std::flush;
+    }
+
+  public:
+    explicit EgressScheduler(const EgressConfig &cfg)
+        : config_(cfg), rate_(cfg.budgetMbps * 1e6 / 8),
+          refilled_(Clock::now()), lastStats_(refilled_) {
+        if (config_.budgetMbps < 0 || config_.fps <= 0)
+            throw std::invalid_argument("Invalid bandwidth budget");
+    }
+
+    EgressScheduler(EgressScheduler const &) = delete;
+    EgressScheduler &operator=(EgressScheduler const &) = delete;
+
+    // Whether there is a budget, without one frames are sent right away.
+    bool limited() const { return rate_ > 0; }
+
+    // Gives out the turns of the waiting clients from loop until stop().
+    Task<> run(EventLoop &loop) {
+        AsyncTimer timer(loop);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pumpLoop_ = &loop;
+        }
+        while (true) {
+            const auto now = Clock::now();
+            std::optional<Clock::duration> wait;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopped_)
+                    break;
+                wait = dispatch(now);
+            }
+            printStats(now);
+            if (wait)
+                co_await timer.sleepUntil(now + *wait);
+            else
+                co_await Idle{*this};
+        }
+    }
+
+    // Gives all waiting clients their turn, and from now on every frame
+    // right away, and ends run(). Can be called from any thread.
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        for (Client *client : waiting_)
+            client->loop_->schedule(std::exchange(client->waiter_, {}));
+        waiting_.clear();
+        if (pump_)
+            pumpLoop_->schedule(std::exchange(pump_, {}));
+    }
+};
@@ -0,0 +1,578 @@
+// Coroutines and an event loop running them, for serving many connections
+// from a few threads.
+//
+// A connection is served by coroutines that suspend whenever its socket has
+// nothing to read or no room to write, so an idle or slow connection costs its
+// buffers and coroutine frames, but no thread. An EventLoop resumes the
+// coroutines of its sockets on its own thread with epoll, and other threads
+// can hand it coroutines to resume, e.g. when a new frame has been captured.
+#pragma once
+
+#include "buffer-pool.hpp"
+#include "perf-counters.hpp"
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Coroutine frames come from the buffer pool, since connections make a few of
+// them for every package.
+struct PooledFrame {
+    static void *operator new(size_t size) {
+        return BufferPool::shared().allocate(size);
+    }
+    static void operator delete(void *p, size_t size) {
+        BufferPool::shared().deallocate(p, size);
+    }
+};
+
+struct TaskPromiseBase : PooledFrame {
+    // Resumed when the task is done.
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr exception;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T> struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    template <typename U> void return_value(U &&v) {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T result() {
+        if (exception)
+            std::rethrow_exception(exception);
+        return std::move(value.value());
+    }
+};
+
+template <> struct TaskPromise<void> : TaskPromiseBase {
+    void return_void() {}
+
+    void result() {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+
+// A coroutine returning T. It starts when it is awaited, and the awaiting
+// coroutine continues when it is done, getting its result or exception.
+template <typename T = void> class [[nodiscard]] Task {
+  public:
+    struct promise_type : TaskPromise<T> {
+        Task get_return_object() {
+            return Task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+  private:
+    std::coroutine_handle<promise_type> handle_;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+
+  public:
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Task(Task const &) = delete;
+    Task &operator=(Task const &) = delete;
+    Task &operator=(Task &&) = delete;
+
+    ~Task() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+
+    T await_resume() { return handle_.promise().result(); }
+};
+
+// A coroutine that nobody awaits, which frees itself when done. It starts
+// suspended, to be resumed by an EventLoop.
+struct Detached {
+    struct promise_type : PooledFrame {
+        Detached get_return_object() {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Drops the first bytes of the vectors of msg, after a partial send.
+void skipSent(msghdr &msg, size_t bytes) {
+    while (msg.msg_iovlen > 0 && bytes >= msg.msg_iov->iov_len) {
+        bytes -= msg.msg_iov->iov_len;
+        ++msg.msg_iov;
+        --msg.msg_iovlen;
+    }
+    if (msg.msg_iovlen > 0) {
+        msg.msg_iov->iov_base = static_cast<uint8_t *>(msg.msg_iov->iov_base) +
+                                bytes;
+        msg.msg_iov->iov_len -= bytes;
+    }
+}
+
+class EventLoop {
+    friend class AsyncSocket;
+    friend class AsyncTimer;
+
+    // The coroutines waiting for a socket.
+    struct IoWatch {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+    };
+
+    int epoll_ = -1;
+    // Written to wake up the loop when a coroutine is scheduled.
+    int wakeup_ = -1;
+    std::mutex mutex_;
+    // Coroutines scheduled from any thread, guarded by mutex_.
+    std::vector<std::coroutine_handle<>> scheduled_;
+    // Sockets of the loop, guarded by mutex_ so that stop() can shut them
+    // down from another thread.
+    std::set<int> sockets_;
+    std::atomic<bool> stopping_ = false;
+    // Spawned coroutines that have not ended.
+    std::atomic<size_t> tasks_ = 0;
+    // Coroutines to resume, only used on the loop's thread.
+    std::vector<std::coroutine_handle<>> ready_;
+    std::vector<std::coroutine_handle<>> resuming_;
+
+    [[noreturn]] static void fail(const std::string &msg) {
+        throw std::runtime_error(msg + ": " + strerror(errno));
+    }
+
+    void wake() {
+        const uint64_t one = 1;
+        if (::write(wakeup_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            fail("Could not wake up event loop");
+    }
+
+    void watch(int fd, IoWatch *watch) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = watch;
+        if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event))
+            fail("Could not watch socket");
+        sockets_.insert(fd);
+        if (stopping_)
+            ::shutdown(fd, SHUT_RDWR);
+    }
+
+    // Stops watching fd and closes it, under the lock so that stop() never
+    // shuts down a closed and reused fd.
+    void close(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+        sockets_.erase(fd);
+        ::close(fd);
+    }
+
+    // Resumes scheduled coroutines until there are none left.
+    void resumeReady() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_.insert(ready_.end(), scheduled_.begin(),
+                              scheduled_.end());
+                scheduled_.clear();
+            }
+            if (ready_.empty())
+                return;
+            resuming_.swap(ready_);
+            for (auto handle : resuming_)
+                handle.resume();
+            resuming_.clear();
+        }
+    }
+
+    // Runs coroutines until done() returns true.
+    template <typename Done> void runUntil(Done done) {
+        std::array<epoll_event, 64> events;
+        while (true) {
+            resumeReady();
+            if (done())
+                return;
+
+            const int n = epoll_wait(epoll_, events.data(),
+                                     static_cast<int>(events.size()), -1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                fail("epoll_wait failed");
+
+            // Only take the coroutines here, since resuming one can close
+            // the socket of a later event.
+            for (int i = 0; i < n; ++i) {
+                auto *watch = static_cast<IoWatch *>(events[i].data.ptr);
+                const uint32_t flags = events[i].events;
+                if (watch == nullptr) {
+                    uint64_t count = 0;
+                    if (::read(wakeup_, &count, sizeof(count)) < 0 &&
+                        errno != EAGAIN)
+                        fail("Could not read event loop wakeup");
+                    continue;
+                }
+                if ((flags & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) &&
+                    watch->reader)
+                    ready_.push_back(std::exchange(watch->reader, {}));
+                if ((flags & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+                    watch->writer)
+                    ready_.push_back(std::exchange(watch->writer, {}));
+            }
+        }
+    }
+
+    static Detached detach(EventLoop &loop, Task<> task) {
+        try {
+            co_await task;
+        } catch (std::exception const &e) {
+            std::cerr << "WARNING: " << e.what() << std::endl;
+        }
+        --loop.tasks_;
+    }
+
+    static Detached complete(Task<> task, bool &done,
+                             std::exception_ptr &error) {
+        try {
+            co_await task;
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done = true;
+    }
+
+  public:
+    EventLoop() {
+        epoll_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_ < 0)
+            fail("Could not create epoll instance");
+        wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_ < 0) {
+            ::close(epoll_);
+            fail("Could not create eventfd");
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        if (epoll_ctl(epoll_, EPOLL_CTL_ADD, wakeup_, &event)) {
+            ::close(wakeup_);
+            ::close(epoll_);
+            fail("Could not watch eventfd");
+        }
+    }
+
+    EventLoop(EventLoop const &) = delete;
+    EventLoop &operator=(EventLoop const &) = delete;
+
+    ~EventLoop() {
+        ::close(wakeup_);
+        ::close(epoll_);
+    }
+
+    // Resumes handle on the loop's thread. Can be called from any thread.
+    void schedule(std::coroutine_handle<> handle) {
+        bool wasEmpty = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wasEmpty = scheduled_.empty();
+            scheduled_.push_back(handle);
+        }
+        if (wasEmpty)
+            wake();
+    }
+
+    // Runs task on the loop without waiting for it, and only prints what it
+    // throws. Can be called from any thread.
+    void spawn(Task<> task) {
+        ++tasks_;
+        schedule(detach(*this, std::move(task)).handle);
+    }
+
+    // Shuts down all sockets of the loop, which ends the coroutines using
+    // them, and makes run() return once all spawned coroutines have ended.
+    // Can be called from any thread.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            for (int fd : sockets_)
+                ::shutdown(fd, SHUT_RDWR);
+        }
+        wake();
+    }
+
+    // Runs the spawned coroutines until stopped.
+    void run() {
+        runUntil([this] { return stopping_ && tasks_ == 0; });
+    }
+
+    // Runs the loop until task is done, and rethrows what it threw, so that
+    // blocking code can use coroutines.
+    void run(Task<> task) {
+        bool done = false;
+        std::exception_ptr error;
+        schedule(complete(std::move(task), done, error).handle);
+        runUntil([&done] { return done; });
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+// A non-blocking socket read and written by coroutines of an event loop,
+// which owns the socket. One coroutine can read while others write, and what
+// several coroutines write is never interleaved.
+class AsyncSocket {
+    EventLoop &loop_;
+    int fd_;
+    EventLoop::IoWatch watch_;
+    bool writing_ = false;
+    std::vector<std::coroutine_handle<>> writers_;
+
+    // Suspends until the socket is ready for events, unless it already is.
+    struct Ready {
+        int fd;
+        short events;
+        std::coroutine_handle<> &slot;
+
+        bool await_ready() {
+            pollfd pfd = {fd, events, 0};
+            return poll(&pfd, 1, 0) > 0;
+        }
+        void await_suspend(std::coroutine_handle<> handle) { slot = handle; }
+        void await_resume() {}
+    };
+
+    // Suspends until no other coroutine is writing.
+    struct WriteTurn {
+        AsyncSocket &socket;
+
+        bool await_ready() { return !socket.writing_; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            socket.writers_.push_back(handle);
+        }
+        void await_resume() {}
+    };
+
+    // Holds the turn to write until it goes out of scope.
+    struct WriteGuard {
+        AsyncSocket &socket;
+        ~WriteGuard() { socket.endWrite(); }
+    };
+
+    void endWrite() {
+        writing_ = false;
+        if (!writers_.empty()) {
+            loop_.schedule(writers_.front());
+            writers_.erase(writers_.begin());
+        }
+    }
+
+  public:
+    AsyncSocket(EventLoop &loop, int fd) : loop_(loop), fd_(fd) {
+        const int flags = fcntl(fd_, F_GETFL);
+        if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+            ::close(fd_);
+            EventLoop::fail("Could not make socket non-blocking");
+        }
+        try {
+            loop_.watch(fd_, &watch_);
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    AsyncSocket(AsyncSocket const &) = delete;
+    AsyncSocket &operator=(AsyncSocket const &) = delete;
+
+    ~AsyncSocket() { loop_.close(fd_); }
+
+    int fd() const { return fd_; }
+    EventLoop &loop() const { return loop_; }
+
+    void shutdown(int how) { ::shutdown(fd_, how); }
+
+    Ready readable() { return {fd_, POLLIN, watch_.reader}; }
+    // Only for coroutines that don't write, or hold the turn to write, since
+    // one waiting writer replaces another.
+    Ready writable() { return {fd_, POLLOUT, watch_.writer}; }
+
+    // Waits until the socket has room, in turn with the coroutines writing to
+    // it, so that a write that is waiting for room is never displaced.
+    Task<> waitWritable() {
+        while (writing_)
+            co_await WriteTurn{*this};
+        writing_ = true;
+        WriteGuard turn{*this};
+        co_await writable();
+    }
+
+    // Reads size bytes, or fewer if the peer closes the connection.
+    Task<size_t> read(void *data, size_t size) {
+        size_t done = 0;
+        while (done < size) {
+            const ssize_t n = recv(fd_, static_cast<uint8_t *>(data) + done,
+                                   size - done, 0);
+            if (n > 0) {
+                done += static_cast<size_t>(n);
+            } else if (n == 0) {
+                break;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await readable();
+            } else if (errno != EINTR) {
+                EventLoop::fail("Could not read from socket");
+            }
+        }
+        co_return done;
+    }
+
+    // Writes all of iov, waiting for room in the socket when it is full.
+    Task<> write(iovec *iov, size_t count) {
+        while (writing_)
+            co_await WriteTurn{*this};
+        writing_ = true;
+        WriteGuard turn{*this};
+
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        while (msg.msg_iovlen > 0) {
+            ssize_t n;
+            {
+                StageScope stage(Stage::SEND);
+                n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+            }
+            if (n >= 0) {
+                skipSent(msg, static_cast<size_t>(n));
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await writable();
+            } else if (errno != EINTR) {
+                EventLoop::fail("Could not send package");
+            }
+        }
+    }
+
+    // Returns a new connection to a listening socket.
+    Task<int> accept() {
+        while (true) {
+            const int fd = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0)
+                co_return fd;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                co_await readable();
+            else if (errno != EINTR && errno != ECONNABORTED)
+                EventLoop::fail("Could not accept connection");
+        }
+    }
+};
+
+// A timer that coroutines of an event loop sleep on.
+class AsyncTimer {
+    EventLoop &loop_;
+    int fd_;
+    EventLoop::IoWatch watch_;
+
+    // Suspends until the timer has expired, unless it already has.
+    struct Expired {
+        AsyncTimer &timer;
+
+        bool await_ready() {
+            pollfd pfd = {timer.fd_, POLLIN, 0};
+            return poll(&pfd, 1, 0) > 0;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            timer.watch_.reader = handle;
+        }
+        void await_resume() {}
+    };
+
+  public:
+    explicit AsyncTimer(EventLoop &loop) : loop_(loop) {
+        fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd_ < 0)
+            EventLoop::fail("Could not create timer");
+        try {
+            loop_.watch(fd_, &watch_);
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    AsyncTimer(AsyncTimer const &) = delete;
+    AsyncTimer &operator=(AsyncTimer const &) = delete;
+
+    ~AsyncTimer() { loop_.close(fd_); }
+
+    // Suspends until time, on the steady clock, which is CLOCK_MONOTONIC.
+    Task<> sleepUntil(std::chrono::steady_clock::time_point time) {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            time.time_since_epoch())
+                            .count();
+        if (time <= std::chrono::steady_clock::now())
+            co_return;
+
+        itimerspec spec = {};
+        spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+        spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+        if (timerfd_settime(fd_, TFD_TIMER_ABSTIME, &spec, nullptr))
+            EventLoop::fail("Could not set timer");
+        while (true) {
+            uint64_t expirations = 0;
+            if (::read(fd_, &expirations, sizeof(expirations)) ==
+                sizeof(expirations))
+                co_return;
+            if (errno != EAGAIN && errno != EINTR)
+                EventLoop::fail("Could not read timer");
+            co_await Expired{*this};
+        }
+    }
+};
@@ -0,0 +1,78 @@
+// Hands frames from a producer thread to a consumer that only wants the latest
+// one, e.g. a window that presents at the display's refresh rate.
+#pragma once
+
+#include "buffer-pool.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+class FrameMailbox {
+  public:
+    struct Frame {
+        Buffer data = makeBuffer();
+        int width = 0;
+        int height = 0;
+        int format = 0;
+        uint64_t sequence = 0;
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+  private:
+    std::mutex mutex_;
+    // The latest frame. A new frame replaces it whether or not it has been
+    // taken, so the consumer never works through a queue of old frames.
+    Frame slot_;
+    // Only touched by the producer, swapped with the slot.
+    Frame spare_;
+    uint64_t sequence_ = 0;
+    bool closed_ = false;
+    std::exception_ptr error_;
+
+  public:
+    // Copies in a frame. The copy is made before taking the lock, and the
+    // buffers are swapped so that nothing is allocated once they have grown.
+    void put(const void *data, size_t size, int width, int height,
+             int format) {
+        spare_.data.resize(size);
+        std::memcpy(spare_.data.data(), data, size);
+        spare_.width = width;
+        spare_.height = height;
+        spare_.format = format;
+        spare_.arrival = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        spare_.sequence = ++sequence_;
+        std::swap(spare_, slot_);
+    }
+
+    // Swaps the latest frame into frame if it is newer than the one frame
+    // holds. Returns how many frames were replaced before being taken, or -1
+    // if there is no newer frame.
+    int64_t take(Frame &frame) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (slot_.sequence <= frame.sequence)
+            return -1;
+        const uint64_t previous = frame.sequence;
+        std::swap(frame, slot_);
+        return static_cast<int64_t>(frame.sequence - previous - 1);
+    }
+
+    // Called by the producer when it stops, with the reason if it failed.
+    void close(std::exception_ptr error = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        error_ = error;
+    }
+
+    // Rethrows the producer's error, returns whether it has stopped.
+    bool closed() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_)
+            std::rethrow_exception(error_);
+        return closed_;
+    }
+};
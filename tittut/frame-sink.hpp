@@ -0,0 +1,200 @@
+// Destinations for raw frames when the client runs without a window, e.g. to
+// feed the stream to ffmpeg or an analytics tool.
+//
+// Frames coming from a socket are moved into the sink with splice(), so their
+// bytes never pass through userspace. splice() needs a pipe at one end, so
+// sinks that are not pipes themselves get an intermediate pipe. Sockets may be
+// non-blocking, in which case the sink waits for the rest of the frame.
+#pragma once
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class FrameSink {
+    int fd_ = -1;
+    bool ownsFd_ = true;
+    bool isPipe_ = false;
+    // Only used when fd_ is not a pipe.
+    int pipe_[2] = {-1, -1};
+    // Cleared if the sink does not support splice(), e.g. a terminal.
+    bool splice_ = true;
+    std::string name_;
+    uint64_t frames_ = 0;
+    uint64_t bytes_ = 0;
+
+    // Size asked for of the pipes, enough for a 720p YUYV frame.
+    static constexpr int PIPE_SIZE = 2 << 20;
+
+    [[noreturn]] void fail(const std::string &msg) const {
+        throw std::runtime_error(msg + " (" + name_ + "): " + strerror(errno));
+    }
+
+    void open(const std::string &path, int flags) {
+        fd_ = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            fail("Could not open sink");
+    }
+
+    // Moves size bytes from in to out, where one of them is a pipe.
+    void spliceAll(int in, int out, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::splice(in, nullptr, out, nullptr, size,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN) {
+                waitFor(in, POLLIN);
+                continue;
+            }
+            if (n < 0)
+                fail("splice failed");
+            if (n == 0)
+                throw std::runtime_error("Connection closed in a frame");
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    // For sinks that can't be spliced into.
+    void copy(int socket, size_t size) {
+        char buffer[64 * 1024];
+        while (size > 0) {
+            ssize_t n = ::read(socket, buffer, std::min(size, sizeof(buffer)));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN) {
+                waitFor(socket, POLLIN);
+                continue;
+            }
+            if (n < 0)
+                fail("Reading frame failed");
+            if (n == 0)
+                throw std::runtime_error("Connection closed in a frame");
+            writeAll(buffer, static_cast<size_t>(n));
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    void writeAll(const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t n = ::write(fd_, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                fail("Writing frame failed");
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+  public:
+    // spec is "discard", "stdout", "file:<path>" or "fifo:<path>". A fifo is
+    // created if it does not exist, and opening it waits for a reader.
+    explicit FrameSink(const std::string &spec) : name_(spec) {
+        if (spec == "discard") {
+            open("/dev/null", O_WRONLY);
+        } else if (spec == "stdout") {
+            fd_ = STDOUT_FILENO;
+            ownsFd_ = false;
+        } else if (spec.rfind("file:", 0) == 0) {
+            open(spec.substr(5), O_WRONLY | O_CREAT | O_TRUNC);
+        } else if (spec.rfind("fifo:", 0) == 0) {
+            const std::string path = spec.substr(5);
+            if (mkfifo(path.c_str(), 0644) && errno != EEXIST)
+                fail("Could not create fifo");
+            open(path, O_WRONLY);
+        } else {
+            throw std::invalid_argument("Unknown sink: " + spec);
+        }
+
+        struct stat st = {};
+        if (fstat(fd_, &st))
+            fail("Could not stat sink");
+        isPipe_ = S_ISFIFO(st.st_mode);
+        if (isPipe_) {
+            fcntl(fd_, F_SETPIPE_SZ, PIPE_SIZE);
+        } else {
+            if (pipe2(pipe_, O_CLOEXEC))
+                fail("Could not create pipe");
+            fcntl(pipe_[1], F_SETPIPE_SZ, PIPE_SIZE);
+        }
+    }
+
+    FrameSink(FrameSink const &) = delete;
+    FrameSink &operator=(FrameSink const &) = delete;
+
+    ~FrameSink() {
+        if (ownsFd_ && fd_ >= 0)
+            close(fd_);
+        for (int fd : pipe_) {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    const std::string &name() const { return name_; }
+    uint64_t frames() const { return frames_; }
+    uint64_t bytes() const { return bytes_; }
+
+    // Moves a frame of size bytes from a socket into the sink.
+    void splice(int socket, size_t size) {
+        if (splice_ && isPipe_) {
+            spliceAll(socket, fd_, size);
+        } else if (splice_) {
+            // Through the pipe in pieces of at most the pipe's size, since
+            // the pipe has to be emptied before it can take more.
+            size_t left = size;
+            while (left > 0) {
+                ssize_t n = ::splice(socket, nullptr, pipe_[1], nullptr, left,
+                                     SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && errno == EAGAIN) {
+                    waitFor(socket, POLLIN);
+                    continue;
+                }
+                if (n < 0)
+                    fail("splice failed");
+                if (n == 0)
+                    throw std::runtime_error("Connection closed in a frame");
+                try {
+                    spliceAll(pipe_[0], fd_, static_cast<size_t>(n));
+                } catch (std::runtime_error const &) {
+                    if (errno != EINVAL || left != size)
+                        throw;
+                    // The sink does not support splice(), and nothing has
+                    // been written yet. Copy what is in the pipe instead.
+                    splice_ = false;
+                    copy(pipe_[0], static_cast<size_t>(n));
+                }
+                left -= static_cast<size_t>(n);
+                if (!splice_) {
+                    copy(socket, left);
+                    break;
+                }
+            }
+        } else {
+            copy(socket, size);
+        }
+        ++frames_;
+        bytes_ += size;
+    }
+
+    // Writes a frame from memory, for frames that are not read from a socket
+    // or have been transformed.
+    void write(const void *data, size_t size) {
+        writeAll(data, size);
+        ++frames_;
+        bytes_ += size;
+    }
+};
@@ -0,0 +1,122 @@
+// Runs a video stream without a window, writing its frames to a FrameSink.
+#pragma once
+
+#include "buffer-pool.hpp"
+#include "frame-sink.hpp"
+#include "perf-counters.hpp"
+#include "pixel-format.hpp"
+#include "scaler.hpp"
+#include "thread-pool.hpp"
+#include "video-stream.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+class HeadlessClient {
+    std::unique_ptr<VideoStream> stream_;
+    FrameSink &sink_;
+    void (*flipRows_)(const uint8_t *, uint8_t *, int, int, int,
+                      int) = nullptr;
+    Buffer flippedBuffer_ = makeBuffer();
+    // Whether the stream splices its frames into the sink by itself.
+    bool forwarding_ = false;
+
+    static constexpr auto STATS_PERIOD = std::chrono::seconds(1);
+
+  public:
+    HeadlessClient(std::unique_ptr<VideoStream> &stream, FrameSink &sink,
+                   bool flip = false)
+        : stream_(std::move(stream)), sink_(sink) {
+        // A sink whose reader has gone away fails with EPIPE instead.
+        std::signal(SIGPIPE, SIG_IGN);
+
+        auto [width, height, format] = stream_->getMetaData();
+        if (flip) {
+            if (format == V4L2_PIX_FMT_YUYV)
+                flipRows_ = flipYuyv;
+            else if (format == V4L2_PIX_FMT_UYVY)
+                flipRows_ = flipUyvy;
+            else
+                std::cerr << "WARNING: Flipping is only supported for yuyv "
+                             "and uyvy\n";
+        }
+        // Frames that are not transformed don't have to be read at all.
+        if (flipRows_ == nullptr)
+            forwarding_ = stream_->forwardTo(&sink_);
+        std::cerr << "Writing " << formatToString(format) << " frames of "
+                  << width << "x" << height << " to " << sink_.name()
+                  << (forwarding_ ? " with splice" : "") << "\n";
+    }
+
+    ~HeadlessClient() {
+        if (forwarding_)
+            stream_->forwardTo(nullptr);
+    }
+
+    // Runs until the stream ends, or for maxFrames frames if it is not 0.
+    // Statistics go to stderr, since stdout may be the sink.
+    void run(uint64_t maxFrames = 0) {
+        using Clock = std::chrono::steady_clock;
+        const Clock::time_point start = Clock::now();
+        Clock::time_point lastStats = start;
+        uint64_t lastFrames = 0;
+        uint64_t lastBytes = 0;
+
+        auto printStats = [](Clock::duration elapsed, uint64_t frames,
+                             uint64_t bytes) {
+            const double seconds =
+                std::chrono::duration<double>(elapsed).count();
+            std::cerr << std::fixed << std::setprecision(1)
+                      << static_cast<double>(frames) / seconds << " fps, "
+                      << static_cast<double>(bytes) / seconds / 1e6
+                      << " MB/s\n";
+        };
+        auto printSummary = [&] {
+            std::cerr << "Wrote " << sink_.frames() << " frames, average ";
+            printStats(Clock::now() - start, sink_.frames(), sink_.bytes());
+        };
+
+        try {
+            while (maxFrames == 0 || sink_.frames() < maxFrames) {
+                stream_->update();
+                if (!forwarding_)
+                    writeFrame();
+
+                const Clock::time_point now = Clock::now();
+                if (now - lastStats >= STATS_PERIOD) {
+                    printStats(now - lastStats, sink_.frames() - lastFrames,
+                               sink_.bytes() - lastBytes);
+                    lastStats = now;
+                    lastFrames = sink_.frames();
+                    lastBytes = sink_.bytes();
+                }
+            }
+        } catch (...) {
+            printSummary();
+            throw;
+        }
+        printSummary();
+    }
+
+  private:
+    void writeFrame() {
+        const uint8_t *data =
+            static_cast<const uint8_t *>(stream_->getBuffer());
+        const size_t size = stream_->getBufferSize();
+        if (flipRows_ != nullptr) {
+            StageScope stage(Stage::FLIP);
+            const auto [width, height, format] = stream_->getMetaData();
+            const int w = width;
+            const int h = height;
+            flippedBuffer_.resize(size);
+            ThreadPool::shared().parallelRows(h, [&](int begin, int end) {
+                flipRows_(data, flippedBuffer_.data(), w, h, begin, end);
+            });
+            data = flippedBuffer_.data();
+        }
+        sink_.write(data, size);
+    }
+};
@@ -0,0 +1,661 @@
+// Baseline JPEG encoder for YUYV frames, for serving MJPEG from cameras that
+// only deliver uncompressed frames.
+//
+// Frames are encoded in 4:2:2 with the standard Huffman tables, in MCUs of
+// 16x8 pixels: two luma blocks and one block of each chroma. The MCU rows are
+// split into slices that each end with a restart marker. Slices don't depend
+// on each other, so they are encoded in parallel on the ThreadPool and then
+// just concatenated.
+//
+// The forward DCT is two passes of a matrix product in 13 bit fixed point,
+// and quantization multiplies by reciprocals. Both exist in a scalar, an SSE2
+// and an AVX2 version, which give identical results.
+#pragma once
+
+#include "buffer-pool.hpp"
+#include "convert.hpp"
+#include "thread-pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// JPEG_ZIGZAG[i] is the index in natural order of the i-th coefficient in
+// zigzag order.
+constexpr uint8_t JPEG_ZIGZAG[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// Quantization tables of the JPEG standard (Annex K) for quality 50, in
+// natural order.
+constexpr uint8_t JPEG_LUMA_QUANT[64] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+
+constexpr uint8_t JPEG_CHROMA_QUANT[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+// Huffman tables of the JPEG standard (Annex K), as the number of codes of
+// each length from 1 to 16 followed by the symbols in code order.
+struct HuffmanSpec {
+    uint8_t counts[16];
+    std::vector<uint8_t> symbols;
+};
+
+const HuffmanSpec JPEG_LUMA_DC = {
+    {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}};
+
+const HuffmanSpec JPEG_CHROMA_DC = {
+    {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}};
+
+const HuffmanSpec JPEG_LUMA_AC = {
+    {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d},
+    {0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+     0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+     0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+     0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+     0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+     0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+     0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+     0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+     0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+     0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+     0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+     0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+     0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+     0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa}};
+
+const HuffmanSpec JPEG_CHROMA_AC = {
+    {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77},
+    {0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+     0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+     0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+     0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+     0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+     0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+     0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+     0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+     0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+     0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+     0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+     0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+     0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+     0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa}};
+
+// Code and length in bits of every symbol of a Huffman table.
+struct HuffmanCodes {
+    uint16_t code[256] = {};
+    uint8_t length[256] = {};
+
+    explicit HuffmanCodes(const HuffmanSpec &spec) {
+        uint16_t next = 0;
+        size_t symbol = 0;
+        for (int len = 1; len <= 16; ++len) {
+            for (int i = 0; i < spec.counts[len - 1]; ++i) {
+                code[spec.symbols[symbol]] = next++;
+                length[spec.symbols[symbol]] = static_cast<uint8_t>(len);
+                ++symbol;
+            }
+            next <<= 1;
+        }
+    }
+};
+
+// A quantization table as reciprocals, in natural order. A coefficient c is
+// quantized to sign(c) * ((|c| + half) * recip >> 16 + ((|c| + half) & mask)),
+// where mask only is set for a divisor of 1, whose reciprocal doesn't fit.
+struct JpegQuant {
+    alignas(32) uint16_t recip[64];
+    alignas(32) uint16_t half[64];
+    alignas(32) uint16_t mask[64];
+    // The divisors, for the DQT segment.
+    uint8_t divisors[64];
+
+    JpegQuant(const uint8_t *base, int quality) {
+        // Scaled like libjpeg does, so qualities mean the same as there.
+        quality = std::clamp(quality, 1, 100);
+        const int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+        for (int i = 0; i < 64; ++i) {
+            const int q = std::clamp((base[i] * scale + 50) / 100, 1, 255);
+            divisors[i] = static_cast<uint8_t>(q);
+            recip[i] = q == 1 ? 0 : static_cast<uint16_t>(65536 / q);
+            half[i] = static_cast<uint16_t>(q / 2);
+            mask[i] = q == 1 ? 0xffff : 0;
+        }
+    }
+};
+
+// DCT-II basis in 13 bit fixed point, scaled so that two passes give the
+// coefficients of the JPEG standard. Row k holds frequency k.
+const std::array<int16_t, 64> &jpegDctMatrix() {
+    static const std::array<int16_t, 64> matrix = [] {
+        std::array<int16_t, 64> m = {};
+        const double pi = std::acos(-1.0);
+        for (int k = 0; k < 8; ++k) {
+            const double c = k == 0 ? std::sqrt(0.125) : 0.5;
+            for (int n = 0; n < 8; ++n)
+                m[k * 8 + n] = static_cast<int16_t>(std::lround(
+                    8192 * c * std::cos((2 * n + 1) * k * pi / 16)));
+        }
+        return m;
+    }();
+    return matrix;
+}
+
+// The first pass keeps 2 fractional bits, the second none.
+constexpr int JPEG_DCT_SHIFT1 = 11;
+constexpr int JPEG_DCT_SHIFT2 = 15;
+
+// Block primitives. Blocks are 64 samples in rows of 8, with 128 subtracted.
+struct ScalarDct {
+    // out = M * in, i.e. the DCT of every column, rounded and shifted.
+    static void pass(const int16_t *in, int16_t *out, int shift) {
+        const auto &m = jpegDctMatrix();
+        for (int k = 0; k < 8; ++k) {
+            for (int c = 0; c < 8; ++c) {
+                int32_t sum = 0;
+                for (int n = 0; n < 8; ++n)
+                    sum += m[k * 8 + n] * in[n * 8 + c];
+                out[k * 8 + c] =
+                    static_cast<int16_t>((sum + (1 << (shift - 1))) >> shift);
+            }
+        }
+    }
+
+    static void transpose(int16_t *block) {
+        for (int r = 0; r < 8; ++r) {
+            for (int c = r + 1; c < 8; ++c)
+                std::swap(block[r * 8 + c], block[c * 8 + r]);
+        }
+    }
+
+    static void forward(const int16_t *in, int16_t *out) {
+        int16_t tmp[64];
+        pass(in, tmp, JPEG_DCT_SHIFT1);
+        transpose(tmp);
+        pass(tmp, out, JPEG_DCT_SHIFT2);
+        transpose(out);
+    }
+
+    static void quantize(const int16_t *in, const JpegQuant &q,
+                         int16_t *out) {
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t a =
+                static_cast<uint32_t>(std::abs(in[i])) + q.half[i];
+            const int v = static_cast<int>(((a * q.recip[i]) >> 16) +
+                                           (a & q.mask[i]));
+            out[i] = static_cast<int16_t>(in[i] < 0 ? -v : v);
+        }
+    }
+};
+
+#ifdef __x86_64__
+// Transposes 8 rows of 8 int16.
+inline void transpose8x8(__m128i *r) {
+    const __m128i b0 = _mm_unpacklo_epi16(r[0], r[1]);
+    const __m128i b1 = _mm_unpackhi_epi16(r[0], r[1]);
+    const __m128i b2 = _mm_unpacklo_epi16(r[2], r[3]);
+    const __m128i b3 = _mm_unpackhi_epi16(r[2], r[3]);
+    const __m128i b4 = _mm_unpacklo_epi16(r[4], r[5]);
+    const __m128i b5 = _mm_unpackhi_epi16(r[4], r[5]);
+    const __m128i b6 = _mm_unpacklo_epi16(r[6], r[7]);
+    const __m128i b7 = _mm_unpackhi_epi16(r[6], r[7]);
+    const __m128i c0 = _mm_unpacklo_epi32(b0, b2);
+    const __m128i c1 = _mm_unpackhi_epi32(b0, b2);
+    const __m128i c2 = _mm_unpacklo_epi32(b1, b3);
+    const __m128i c3 = _mm_unpackhi_epi32(b1, b3);
+    const __m128i c4 = _mm_unpacklo_epi32(b4, b6);
+    const __m128i c5 = _mm_unpackhi_epi32(b4, b6);
+    const __m128i c6 = _mm_unpacklo_epi32(b5, b7);
+    const __m128i c7 = _mm_unpackhi_epi32(b5, b7);
+    r[0] = _mm_unpacklo_epi64(c0, c4);
+    r[1] = _mm_unpackhi_epi64(c0, c4);
+    r[2] = _mm_unpacklo_epi64(c1, c5);
+    r[3] = _mm_unpackhi_epi64(c1, c5);
+    r[4] = _mm_unpacklo_epi64(c2, c6);
+    r[5] = _mm_unpackhi_epi64(c2, c6);
+    r[6] = _mm_unpacklo_epi64(c3, c7);
+    r[7] = _mm_unpackhi_epi64(c3, c7);
+}
+
+// The matrix entries of row k for rows 2p and 2p + 1 of the block, at
+// [k * 4 + p], as pairs for _mm_madd_epi16.
+const std::array<int32_t, 32> &jpegDctPairs() {
+    static const std::array<int32_t, 32> pairs = [] {
+        const auto &m = jpegDctMatrix();
+        std::array<int32_t, 32> p = {};
+        for (int i = 0; i < 32; ++i) {
+            p[i] = static_cast<int32_t>(
+                static_cast<uint32_t>(static_cast<uint16_t>(m[i * 2])) |
+                (static_cast<uint32_t>(static_cast<uint16_t>(m[i * 2 + 1]))
+                 << 16));
+        }
+        return p;
+    }();
+    return pairs;
+}
+
+struct Sse2Dct {
+    // Every frequency is the sum of the rows interleaved in pairs, multiplied
+    // with the matching pairs of the matrix.
+    static void pass(__m128i *r, int shift) {
+        __m128i lo[4], hi[4];
+        for (int p = 0; p < 4; ++p) {
+            lo[p] = _mm_unpacklo_epi16(r[2 * p], r[2 * p + 1]);
+            hi[p] = _mm_unpackhi_epi16(r[2 * p], r[2 * p + 1]);
+        }
+        const auto &pairs = jpegDctPairs();
+        const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+        for (int k = 0; k < 8; ++k) {
+            __m128i sumLo = round;
+            __m128i sumHi = round;
+            for (int p = 0; p < 4; ++p) {
+                const __m128i m = _mm_set1_epi32(pairs[k * 4 + p]);
+                sumLo = _mm_add_epi32(sumLo, _mm_madd_epi16(lo[p], m));
+                sumHi = _mm_add_epi32(sumHi, _mm_madd_epi16(hi[p], m));
+            }
+            r[k] = _mm_packs_epi32(_mm_srai_epi32(sumLo, shift),
+                                   _mm_srai_epi32(sumHi, shift));
+        }
+    }
+
+    static void forward(const int16_t *in, int16_t *out) {
+        __m128i r[8];
+        for (int i = 0; i < 8; ++i)
+            r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in) + i);
+        pass(r, JPEG_DCT_SHIFT1);
+        transpose8x8(r);
+        pass(r, JPEG_DCT_SHIFT2);
+        transpose8x8(r);
+        for (int i = 0; i < 8; ++i)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out) + i, r[i]);
+    }
+
+    static void quantize(const int16_t *in, const JpegQuant &q,
+                         int16_t *out) {
+        for (int i = 0; i < 64; i += 8) {
+            const __m128i c =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+            const __m128i sign = _mm_srai_epi16(c, 15);
+            const __m128i a = _mm_add_epi16(
+                _mm_sub_epi16(_mm_xor_si128(c, sign), sign),
+                _mm_load_si128(reinterpret_cast<const __m128i *>(q.half + i)));
+            const __m128i v = _mm_add_epi16(
+                _mm_mulhi_epu16(a, _mm_load_si128(reinterpret_cast<
+                                                  const __m128i *>(q.recip +
+                                                                   i))),
+                _mm_and_si128(a, _mm_load_si128(reinterpret_cast<
+                                                const __m128i *>(q.mask + i))));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                             _mm_sub_epi16(_mm_xor_si128(v, sign), sign));
+        }
+    }
+};
+
+struct Avx2Dct {
+    // Like Sse2Dct::pass, but with the low and high halves of the row pairs
+    // in one register, so that a frequency takes half the multiplies.
+    TITTUT_AVX2 static void pass(__m128i *r, int shift) {
+        __m256i pairs[4];
+        for (int p = 0; p < 4; ++p) {
+            pairs[p] = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_unpacklo_epi16(r[2 * p], r[2 * p + 1])),
+                _mm_unpackhi_epi16(r[2 * p], r[2 * p + 1]), 1);
+        }
+        const auto &m = jpegDctPairs();
+        const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+        for (int k = 0; k < 8; ++k) {
+            __m256i sum = round;
+            for (int p = 0; p < 4; ++p)
+                sum = _mm256_add_epi32(
+                    sum, _mm256_madd_epi16(
+                             pairs[p], _mm256_set1_epi32(m[k * 4 + p])));
+            sum = _mm256_srai_epi32(sum, shift);
+            r[k] = _mm_packs_epi32(_mm256_castsi256_si128(sum),
+                                   _mm256_extracti128_si256(sum, 1));
+        }
+    }
+
+    TITTUT_AVX2 static void forward(const int16_t *in, int16_t *out) {
+        __m128i r[8];
+        for (int i = 0; i < 8; ++i)
+            r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in) + i);
+        pass(r, JPEG_DCT_SHIFT1);
+        transpose8x8(r);
+        pass(r, JPEG_DCT_SHIFT2);
+        transpose8x8(r);
+        for (int i = 0; i < 8; ++i)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out) + i, r[i]);
+    }
+
+    TITTUT_AVX2 static void quantize(const int16_t *in, const JpegQuant &q,
+                                     int16_t *out) {
+        for (int i = 0; i < 64; i += 16) {
+            const __m256i c =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+            const __m256i sign = _mm256_srai_epi16(c, 15);
+            const __m256i a = _mm256_add_epi16(
+                _mm256_abs_epi16(c),
+                _mm256_load_si256(
+                    reinterpret_cast<const __m256i *>(q.half + i)));
+            const __m256i v = _mm256_add_epi16(
+                _mm256_mulhi_epu16(a, _mm256_load_si256(reinterpret_cast<
+                                                        const __m256i *>(
+                                          q.recip + i))),
+                _mm256_and_si256(a, _mm256_load_si256(reinterpret_cast<
+                                                      const __m256i *>(
+                                        q.mask + i))));
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i *>(out + i),
+                _mm256_sub_epi16(_mm256_xor_si256(v, sign), sign));
+        }
+    }
+};
+#endif
+
+// Transforms and quantizes a block, leaving the result in natural order.
+using JpegBlockKernel = void (*)(const int16_t *in, const JpegQuant &q,
+                                 int16_t *out);
+
+template <typename Dct>
+void jpegBlock(const int16_t *in, const JpegQuant &q, int16_t *out) {
+    alignas(32) int16_t coefficients[64];
+    Dct::forward(in, coefficients);
+    Dct::quantize(coefficients, q, out);
+}
+
+JpegBlockKernel jpegBlockKernel(SimdLevel level = simdLevel()) {
+    switch (level) {
+#ifdef __x86_64__
+    case SimdLevel::AVX2:
+        return jpegBlock<Avx2Dct>;
+    case SimdLevel::SSE2:
+        return jpegBlock<Sse2Dct>;
+#endif
+    default:
+        return jpegBlock<ScalarDct>;
+    }
+}
+
+// Writes the entropy coded data of a slice, with 0xff bytes stuffed.
+class JpegBitWriter {
+    Buffer &out_;
+    uint64_t bits_ = 0;
+    int count_ = 0;
+
+  public:
+    explicit JpegBitWriter(Buffer &out) : out_(out) {}
+
+    void put(uint32_t code, int length) {
+        bits_ = (bits_ << length) | code;
+        count_ += length;
+        while (count_ >= 8) {
+            count_ -= 8;
+            const uint8_t byte = static_cast<uint8_t>(bits_ >> count_);
+            out_.push_back(byte);
+            if (byte == 0xff)
+                out_.push_back(0);
+        }
+    }
+
+    // Pads the last byte with ones.
+    void flush() {
+        if (count_ > 0)
+            put((1u << (8 - count_)) - 1, 8 - count_);
+    }
+};
+
+class JpegEncoder {
+    JpegQuant luma_;
+    JpegQuant chroma_;
+    int quality_;
+    JpegBlockKernel block_;
+
+    struct Tables {
+        HuffmanCodes lumaDc{JPEG_LUMA_DC};
+        HuffmanCodes lumaAc{JPEG_LUMA_AC};
+        HuffmanCodes chromaDc{JPEG_CHROMA_DC};
+        HuffmanCodes chromaAc{JPEG_CHROMA_AC};
+    };
+
+    static const Tables &tables() {
+        static const Tables t;
+        return t;
+    }
+
+    // Number of bits of the magnitude of v, its category.
+    static int bitLength(int v) {
+        v = std::abs(v);
+        return v == 0 ? 0 : 32 - __builtin_clz(static_cast<unsigned>(v));
+    }
+
+    static void encodeBlock(JpegBitWriter &bits, const int16_t *block,
+                            int &previousDc, const HuffmanCodes &dc,
+                            const HuffmanCodes &ac) {
+        // Negative values are sent as their ones' complement.
+        auto putValue = [&bits](int v, int length) {
+            if (length > 0)
+                bits.put(static_cast<uint32_t>(v < 0 ? v - 1 : v) &
+                             ((1u << length) - 1),
+                         length);
+        };
+
+        const int diff = block[0] - previousDc;
+        previousDc = block[0];
+        int length = bitLength(diff);
+        bits.put(dc.code[length], dc.length[length]);
+        putValue(diff, length);
+
+        int run = 0;
+        for (int i = 1; i < 64; ++i) {
+            const int v = block[JPEG_ZIGZAG[i]];
+            if (v == 0) {
+                ++run;
+                continue;
+            }
+            for (; run > 15; run -= 16)
+                bits.put(ac.code[0xf0], ac.length[0xf0]);
+            length = bitLength(v);
+            const int symbol = (run << 4) | length;
+            bits.put(ac.code[symbol], ac.length[symbol]);
+            putValue(v, length);
+            run = 0;
+        }
+        if (run > 0)
+            bits.put(ac.code[0], ac.length[0]);
+    }
+
+    // Encodes the MCU rows [rowBegin, rowEnd) into out.
+    void encodeSlice(const uint8_t *src, int width, int height, int rowBegin,
+                     int rowEnd, Buffer &out) const {
+        const Tables &t = tables();
+        JpegBitWriter bits(out);
+        int dcY = 0, dcU = 0, dcV = 0;
+        alignas(32) int16_t y0[64], y1[64], u[64], v[64], q[64];
+        int xs[16];
+
+        const int mcuColumns = (width + 15) / 16;
+        for (int row = rowBegin; row < rowEnd; ++row) {
+            for (int column = 0; column < mcuColumns; ++column) {
+                // Pixels outside of the frame repeat the edge.
+                for (int i = 0; i < 16; ++i)
+                    xs[i] = std::min(column * 16 + i, width - 1);
+                for (int r = 0; r < 8; ++r) {
+                    const uint8_t *line =
+                        src + static_cast<size_t>(std::min(row * 8 + r,
+                                                           height - 1)) *
+                                  width * 2;
+                    for (int i = 0; i < 8; ++i) {
+                        y0[r * 8 + i] =
+                            static_cast<int16_t>(line[xs[i] * 2] - 128);
+                        y1[r * 8 + i] =
+                            static_cast<int16_t>(line[xs[i + 8] * 2] - 128);
+                        const uint8_t *pair = line + (xs[2 * i] & ~1) * 2;
+                        u[r * 8 + i] = static_cast<int16_t>(pair[1] - 128);
+                        v[r * 8 + i] = static_cast<int16_t>(pair[3] - 128);
+                    }
+                }
+                block_(y0, luma_, q);
+                encodeBlock(bits, q, dcY, t.lumaDc, t.lumaAc);
+                block_(y1, luma_, q);
+                encodeBlock(bits, q, dcY, t.lumaDc, t.lumaAc);
+                block_(u, chroma_, q);
+                encodeBlock(bits, q, dcU, t.chromaDc, t.chromaAc);
+                block_(v, chroma_, q);
+                encodeBlock(bits, q, dcV, t.chromaDc, t.chromaAc);
+            }
+        }
+        bits.flush();
+    }
+
+    static void put16(Buffer &out, int v) {
+        out.push_back(static_cast<uint8_t>(v >> 8));
+        out.push_back(static_cast<uint8_t>(v));
+    }
+
+    static void putHuffman(Buffer &out, uint8_t id, const HuffmanSpec &spec) {
+        out.push_back(id);
+        out.insert(out.end(), spec.counts, spec.counts + 16);
+        out.insert(out.end(), spec.symbols.begin(), spec.symbols.end());
+    }
+
+    void writeHeaders(Buffer &out, int width, int height,
+                      int restartInterval) const {
+        static constexpr uint8_t JFIF[] = {0xff, 0xd8, 0xff, 0xe0, 0, 16,
+                                           'J',  'F',  'I',  'F',  0, 1,
+                                           1,    0,    0,    1,    0, 1,
+                                           0,    0};
+        out.insert(out.end(), JFIF, JFIF + sizeof(JFIF));
+
+        // Quantization tables, in zigzag order.
+        out.push_back(0xff);
+        out.push_back(0xdb);
+        put16(out, 2 + 2 * 65);
+        for (int table = 0; table < 2; ++table) {
+            const JpegQuant &q = table == 0 ? luma_ : chroma_;
+            out.push_back(static_cast<uint8_t>(table));
+            for (int i = 0; i < 64; ++i)
+                out.push_back(q.divisors[JPEG_ZIGZAG[i]]);
+        }
+
+        // Baseline frame of Y sampled 2x1 and U and V sampled 1x1.
+        static constexpr uint8_t COMPONENTS[] = {1, 0x21, 0, 2, 0x11, 1,
+                                                 3, 0x11, 1};
+        out.push_back(0xff);
+        out.push_back(0xc0);
+        put16(out, 8 + 3 * 3);
+        out.push_back(8);
+        put16(out, height);
+        put16(out, width);
+        out.push_back(3);
+        out.insert(out.end(), COMPONENTS, COMPONENTS + sizeof(COMPONENTS));
+
+        out.push_back(0xff);
+        out.push_back(0xc4);
+        put16(out, static_cast<int>(2 + 4 * 17 + JPEG_LUMA_DC.symbols.size() +
+                                    JPEG_LUMA_AC.symbols.size() +
+                                    JPEG_CHROMA_DC.symbols.size() +
+                                    JPEG_CHROMA_AC.symbols.size()));
+        putHuffman(out, 0x00, JPEG_LUMA_DC);
+        putHuffman(out, 0x10, JPEG_LUMA_AC);
+        putHuffman(out, 0x01, JPEG_CHROMA_DC);
+        putHuffman(out, 0x11, JPEG_CHROMA_AC);
+
+        out.push_back(0xff);
+        out.push_back(0xdd);
+        put16(out, 4);
+        put16(out, restartInterval);
+
+        static constexpr uint8_t SCAN[] = {0xff, 0xda, 0, 12, 3, 1, 0x00, 2,
+                                           0x11, 3,    0x11, 0, 63, 0};
+        out.insert(out.end(), SCAN, SCAN + sizeof(SCAN));
+    }
+
+  public:
+    // quality is from 1 to 100, like for libjpeg.
+    explicit JpegEncoder(int quality, SimdLevel level = simdLevel())
+        : luma_(JPEG_LUMA_QUANT, quality), chroma_(JPEG_CHROMA_QUANT, quality),
+          quality_(quality), block_(jpegBlockKernel(level)) {
+        if (quality < 1 || quality > 100)
+            throw std::invalid_argument("Invalid JPEG quality " +
+                                        std::to_string(quality));
+    }
+
+    int quality() const { return quality_; }
+
+    // The encoder of a quality, made on first use with the best SIMD level,
+    // so that its tables are not scaled again for every frame.
+    static const JpegEncoder &shared(int quality) {
+        static std::array<std::once_flag, 101> once;
+        static std::array<std::unique_ptr<JpegEncoder>, 101> encoders;
+        if (quality < 1 || quality > 100)
+            throw std::invalid_argument("Invalid JPEG quality " +
+                                        std::to_string(quality));
+        std::call_once(once[quality], [quality] {
+            encoders[quality] = std::make_unique<JpegEncoder>(quality);
+        });
+        return *encoders[quality];
+    }
+
+    // Encodes a YUYV frame into out, which is replaced, with the slices
+    // spread over the threads of pool.
+    void encode(const uint8_t *src, int width, int height, Buffer &out,
+                ThreadPool &pool = ThreadPool::shared()) const {
+        if (width <= 0 || height <= 0 || width % 2 || width > 65535 ||
+            height > 65535)
+            throw std::invalid_argument("Invalid JPEG dimensions");
+
+        const int mcuColumns = (width + 15) / 16;
+        const int mcuRows = (height + 7) / 8;
+        // A few slices per thread, which the restart interval, counted in
+        // MCUs, has to fit.
+        const int maxRows = std::max(1, 65535 / mcuColumns);
+        const int slices =
+            std::min<int>(mcuRows, static_cast<int>(pool.threads()) * 2);
+        const int sliceRows =
+            std::min(maxRows, (mcuRows + slices - 1) / slices);
+        const int sliceCount = (mcuRows + sliceRows - 1) / sliceRows;
+
+        // The slices are allocated from the pool too.
+        std::pmr::vector<Buffer> data(static_cast<size_t>(sliceCount),
+                                      &BufferPool::shared());
+        pool.parallelFor(0, data.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                const int rowBegin = static_cast<int>(i) * sliceRows;
+                // Roughly what a slice at quality 75 comes to.
+                data[i].reserve(static_cast<size_t>(sliceRows) * mcuColumns *
+                                64);
+                encodeSlice(src, width, height, rowBegin,
+                            std::min(rowBegin + sliceRows, mcuRows), data[i]);
+            }
+        });
+
+        out.clear();
+        writeHeaders(out, width, height, sliceRows * mcuColumns);
+        for (size_t i = 0; i < data.size(); ++i) {
+            out.insert(out.end(), data[i].begin(), data[i].end());
+            if (i + 1 < data.size()) {
+                out.push_back(0xff);
+                out.push_back(static_cast<uint8_t>(0xd0 + i % 8));
+            }
+        }
+        out.push_back(0xff);
+        out.push_back(0xd9);
+    }
+};
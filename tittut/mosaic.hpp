@@ -0,0 +1,301 @@
+// Window that shows several video streams in a grid.
+//
+// Every stream is uploaded into its own tile of a single texture, an atlas,
+// which is drawn with one copy per refresh, so the rendering cost hardly grows
+// with the number of streams. Every stream is read in its own thread into a
+// FrameMailbox, so a slow stream never holds up the others, and each tile
+// shows the latest frame of its stream.
+#pragma once
+
+#include "frame-mailbox.hpp"
+#include "sdl.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 3x5 pixel glyphs of the digits, row by row from the top left, for showing
+// frame rates without a font library.
+constexpr const char *DIGIT_GLYPHS[10] = {
+    "111101101101111", "010110010010111", "111001111100111",
+    "111001111001111", "101101111001001", "111100111001111",
+    "111100111101111", "111001001001001", "111101111101111",
+    "111101111001111"};
+
+// Adds the pixels of the digits in text, each pixel a scale x scale square,
+// with the top left corner at (x, y).
+void addDigits(std::vector<SDL_Rect> &pixels, const std::string &text, int x,
+               int y, int scale) {
+    for (char c : text) {
+        if (c < '0' || c > '9')
+            continue;
+        const char *glyph = DIGIT_GLYPHS[c - '0'];
+        for (int i = 0; i < 15; ++i) {
+            if (glyph[i] == '1')
+                pixels.push_back({x + (i % 3) * scale, y + (i / 3) * scale,
+                                  scale, scale});
+        }
+        x += 4 * scale;
+    }
+}
+
+class MosaicWindow {
+    struct Tile {
+        std::unique_ptr<VideoStream> stream;
+        FrameMailbox mailbox;
+        std::thread reader;
+        FrameMailbox::Frame frame;
+        // Where the tile is, both in the atlas and in the window.
+        SDL_Rect rect = {};
+        Buffer converted = makeBuffer();
+        bool closed = false;
+        // Frame rate over the last second.
+        uint64_t lastSequence = 0;
+        int fps = 0;
+    };
+
+    std::unique_ptr<SDL_Window, std::function<void(SDL_Window *)>> win_{
+        nullptr, [](SDL_Window *w) { SDL_DestroyWindow(w); }};
+    SDL_Renderer *ren_ = nullptr;
+    SDL_Texture *atlas_ = nullptr;
+    std::vector<std::unique_ptr<Tile>> tiles_;
+    int tileWidth_ = 0;
+    int tileHeight_ = 0;
+    int format_ = 0;
+    int uploadFormat_ = 0;
+    using UploadFn = void (*)(SDL_Texture *, const SDL_Rect &,
+                              const uint8_t *, const uint8_t *);
+    UploadFn upload_ = nullptr;
+    Buffer greyChroma_ = makeBuffer();
+    // Pixels of the frame rates drawn on top of the tiles.
+    std::vector<SDL_Rect> text_;
+    std::atomic<bool> stop_ = false;
+    bool quit_ = false;
+
+    static constexpr int TEXT_SCALE = 3;
+    static constexpr auto FPS_PERIOD = std::chrono::seconds(1);
+
+    void startReaders() {
+        for (auto &tile : tiles_) {
+            Tile *t = tile.get();
+            t->reader = std::thread([this, t] {
+                ThreadPlacer::shared().place(ThreadRole::NETWORK);
+                try {
+                    while (!stop_) {
+                        t->stream->update();
+                        auto [width, height, format] =
+                            t->stream->getMetaData();
+                        t->mailbox.put(t->stream->getBuffer(),
+                                       t->stream->getBufferSize(), width,
+                                       height, format);
+                    }
+                    t->mailbox.close();
+                } catch (...) {
+                    t->mailbox.close(stop_ ? nullptr
+                                           : std::current_exception());
+                }
+            });
+        }
+    }
+
+    void stopReaders() {
+        stop_ = true;
+        for (auto &tile : tiles_) {
+            if (tile->reader.joinable()) {
+                tile->stream->interrupt();
+                tile->reader.join();
+            }
+        }
+    }
+
+    // Uploads the latest frame of the tile into the atlas, if there is a new
+    // one. A stream that fails only closes its own tile.
+    void updateTile(size_t index) {
+        Tile &tile = *tiles_[index];
+        if (tile.closed)
+            return;
+        try {
+            if (tile.mailbox.closed())
+                tile.closed = true;
+        } catch (std::exception const &e) {
+            std::cerr << "Stream " << index << " stopped: " << e.what()
+                      << "\n";
+            tile.closed = true;
+        }
+
+        if (tile.mailbox.take(tile.frame) < 0)
+            return;
+        if (tile.frame.width != tileWidth_ || tile.frame.height != tileHeight_)
+            return;
+
+        const uint8_t *data = tile.frame.data.data();
+        if (uploadFormat_ != format_) {
+            tile.converted.resize(
+                frameSize(uploadFormat_, tileWidth_, tileHeight_));
+            convertFrame(format_, uploadFormat_, data, tile.converted.data(),
+                         tileWidth_, tileHeight_);
+            data = tile.converted.data();
+        }
+        StageScope stage(Stage::TEXTURE);
+        upload_(atlas_, tile.rect, data, greyChroma_.data());
+    }
+
+    void pollEvents() {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT ||
+                (event.type == SDL_KEYDOWN &&
+                 event.key.keysym.sym == SDLK_ESCAPE))
+                quit_ = true;
+        }
+    }
+
+    // The atlas is laid out like the window, so it is drawn with one copy,
+    // followed by the frame rates of all tiles in one batch.
+    void draw() {
+        if (SDL_RenderClear(ren_))
+            sdlError("SDL_RenderClear");
+        if (SDL_RenderCopy(ren_, atlas_, NULL, NULL))
+            sdlError("SDL_RenderCopy");
+
+        text_.clear();
+        const int margin = 2 * TEXT_SCALE;
+        for (auto &tile : tiles_) {
+            addDigits(text_, std::to_string(tile->fps), tile->rect.x + margin,
+                      tile->rect.y + margin, TEXT_SCALE);
+        }
+        SDL_SetRenderDrawColor(ren_, 255, 255, 0, 255);
+        SDL_RenderFillRects(ren_, text_.data(), static_cast<int>(text_.size()));
+        SDL_SetRenderDrawColor(ren_, 0, 0, 0, 255);
+    }
+
+  public:
+    // All streams need to have the same frame size and format.
+    MosaicWindow(const std::string &name,
+                 std::vector<std::unique_ptr<VideoStream>> &streams) {
+        if (streams.empty())
+            throw std::invalid_argument("The mosaic needs at least one stream");
+        initSDL();
+
+        std::tie(tileWidth_, tileHeight_, format_) =
+            streams.front()->getMetaData();
+        if (isCompressed(format_))
+            throw std::invalid_argument(
+                "The mosaic needs an uncompressed format");
+        for (auto &stream : streams) {
+            if (stream->getMetaData() != streams.front()->getMetaData())
+                throw std::invalid_argument(
+                    "All streams of the mosaic need the same size and format");
+        }
+
+        const int n = static_cast<int>(streams.size());
+        const int columns = static_cast<int>(std::ceil(std::sqrt(n)));
+        const int rows = (n + columns - 1) / columns;
+        for (int i = 0; i < n; ++i) {
+            auto tile = std::make_unique<Tile>();
+            tile->stream = std::move(streams[i]);
+            tile->rect = {(i % columns) * tileWidth_,
+                          (i / columns) * tileHeight_, tileWidth_,
+                          tileHeight_};
+            tiles_.push_back(std::move(tile));
+        }
+        streams.clear();
+
+        const int width = columns * tileWidth_;
+        const int height = rows * tileHeight_;
+        win_.reset(SDL_CreateWindow(name.c_str(), 100, 100, width, height,
+                                    SDL_WINDOW_SHOWN));
+        if (win_.get() == nullptr)
+            sdlError("SDL_CreateWindow");
+        ren_ = SDL_CreateRenderer(win_.get(), -1,
+                                  SDL_RENDERER_ACCELERATED |
+                                      SDL_RENDERER_PRESENTVSYNC);
+        if (ren_ == nullptr)
+            sdlError("SDL_CreateRenderer");
+
+        SDL_RendererInfo info;
+        if (SDL_GetRendererInfo(ren_, &info))
+            sdlError("SDL_GetRendererInfo");
+        if ((info.max_texture_width > 0 && width > info.max_texture_width) ||
+            (info.max_texture_height > 0 && height > info.max_texture_height))
+            throw std::invalid_argument(
+                "The mosaic is too large for a texture, use smaller frames");
+
+        uploadFormat_ = chooseUploadFormat(ren_, format_);
+        upload_ = visitFormat(uploadFormat_, [](auto traits) {
+            using Traits = decltype(traits);
+            if constexpr (Traits::compressed)
+                return UploadFn(nullptr);
+            else
+                return UploadFn(&uploadTexture<Traits>);
+        });
+        if (format_ == V4L2_PIX_FMT_GREY)
+            greyChroma_.assign(
+                static_cast<size_t>(tileWidth_ / 2) * (tileHeight_ / 2), 128);
+
+        atlas_ = SDL_CreateTexture(ren_, toSdlFormat(uploadFormat_),
+                                   SDL_TEXTUREACCESS_STREAMING, width, height);
+        if (atlas_ == nullptr)
+            sdlError("SDL_CreateTexture");
+        std::cout << "Showing " << n << " streams of " << tileWidth_ << "x"
+                  << tileHeight_ << " in a " << columns << "x" << rows
+                  << " grid\n";
+    }
+
+    MosaicWindow(MosaicWindow const &) = delete;
+    MosaicWindow &operator=(MosaicWindow const &) = delete;
+
+    ~MosaicWindow() {
+        stopReaders();
+        if (atlas_ != nullptr)
+            SDL_DestroyTexture(atlas_);
+    }
+
+    // Shows the latest frame of every stream at every refresh of the display,
+    // until the window is closed or all streams have stopped.
+    void run() {
+        using Clock = std::chrono::steady_clock;
+        startReaders();
+
+        Clock::time_point lastFps = Clock::now();
+        while (!quit_) {
+            pollEvents();
+            bool open = false;
+            for (size_t i = 0; i < tiles_.size(); ++i) {
+                updateTile(i);
+                open |= !tiles_[i]->closed;
+            }
+            if (!open)
+                break;
+
+            const Clock::time_point now = Clock::now();
+            if (now - lastFps >= FPS_PERIOD) {
+                const double seconds =
+                    std::chrono::duration<double>(now - lastFps).count();
+                for (auto &tile : tiles_) {
+                    tile->fps = static_cast<int>(
+                        static_cast<double>(tile->frame.sequence -
+                                            tile->lastSequence) /
+                            seconds +
+                        0.5);
+                    tile->lastSequence = tile->frame.sequence;
+                }
+                lastFps = now;
+            }
+
+            draw();
+            SDL_RenderPresent(ren_);
+        }
+        stopReaders();
+
+        for (size_t i = 0; i < tiles_.size(); ++i) {
+            std::cout << "Stream " << i << ": " << tiles_[i]->frame.sequence
+                      << " frames\n";
+        }
+    }
+};
@@ -0,0 +1,142 @@
+// Motion detection on YUYV frames.
+//
+// The frame is divided into a grid of blocks and each block is compared with
+// the same block of the previous frame, as the sum of absolute differences of
+// the luma samples. To keep it cheap only every second row of a block is
+// sampled. A block has changed when the mean difference per sample exceeds the
+// sensitivity threshold, and there is motion when enough blocks have changed.
+#pragma once
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct MotionConfig {
+    // Mean absolute luma difference for a block to count as changed. Lower
+    // is more sensitive.
+    int threshold = 12;
+    // Number of changed blocks needed for motion.
+    int minBlocks = 2;
+    int blockSize = 16;
+    // Regions of the frame that are ignored, e.g. a busy road or a clock.
+    std::vector<Region> masks;
+    // How long frames are kept from before motion starts and sent after it
+    // has stopped, to clients that only want frames with motion.
+    int preRollMs = 1000;
+    int postRollMs = 2000;
+};
+
+// Sum of absolute differences between the luma samples of two YUYV rows.
+uint32_t lumaSad(const uint8_t *a, const uint8_t *b, int pixels) {
+    uint32_t sad = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // Masking out the chroma bytes of both rows makes them cancel out.
+    const __m128i mask = _mm_set1_epi16(0xff);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= pixels; i += 8) {
+        __m128i va = _mm_and_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + 2 * i)),
+            mask);
+        __m128i vb = _mm_and_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + 2 * i)),
+            mask);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    sad = static_cast<uint32_t>(_mm_cvtsi128_si32(acc) +
+                                _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#endif
+    for (; i < pixels; ++i)
+        sad += static_cast<uint32_t>(std::abs(a[2 * i] - b[2 * i]));
+    return sad;
+}
+
+class MotionDetector {
+    MotionConfig cfg_;
+    int width_ = 0;
+    int height_ = 0;
+    int cols_ = 0;
+    int rows_ = 0;
+    // Blocks whose center is inside a mask.
+    std::vector<bool> masked_;
+    std::vector<uint32_t> sad_;
+    std::vector<uint32_t> samples_;
+
+    void setSize(int width, int height) {
+        width_ = width;
+        height_ = height;
+        cols_ = (width + cfg_.blockSize - 1) / cfg_.blockSize;
+        rows_ = (height + cfg_.blockSize - 1) / cfg_.blockSize;
+        masked_.assign(cols_ * rows_, false);
+        sad_.resize(cols_ * rows_);
+        samples_.assign(cols_ * rows_, 0);
+
+        for (int by = 0; by < rows_; ++by) {
+            for (int bx = 0; bx < cols_; ++bx) {
+                int cx = bx * cfg_.blockSize + cfg_.blockSize / 2;
+                int cy = by * cfg_.blockSize + cfg_.blockSize / 2;
+                for (auto &mask : cfg_.masks) {
+                    if (mask.contains(cx, cy))
+                        masked_[by * cols_ + bx] = true;
+                }
+            }
+        }
+
+        for (int y = 0; y < height; y += 2) {
+            for (int bx = 0; bx < cols_; ++bx) {
+                int x0 = bx * cfg_.blockSize;
+                int n = std::min(cfg_.blockSize, width - x0);
+                samples_[(y / cfg_.blockSize) * cols_ + bx] += n;
+            }
+        }
+    }
+
+  public:
+    MotionDetector(const MotionConfig &cfg) : cfg_(cfg) {
+        if (cfg_.blockSize <= 0 || cfg_.blockSize % 2)
+            throw std::invalid_argument("Motion block size must be even");
+    }
+
+    const MotionConfig &config() const { return cfg_; }
+
+    // Number of blocks that have changed between two frames.
+    int changedBlocks(const uint8_t *frame, const uint8_t *previous, int width,
+                      int height) {
+        if (width != width_ || height != height_)
+            setSize(width, height);
+
+        std::fill(sad_.begin(), sad_.end(), 0);
+        const int pitch = width * 2;
+        for (int y = 0; y < height; y += 2) {
+            uint32_t *sad = sad_.data() + (y / cfg_.blockSize) * cols_;
+            const uint8_t *a = frame + y * pitch;
+            const uint8_t *b = previous + y * pitch;
+            for (int bx = 0; bx < cols_; ++bx) {
+                int x0 = bx * cfg_.blockSize;
+                sad[bx] += lumaSad(a + x0 * 2, b + x0 * 2,
+                                   std::min(cfg_.blockSize, width - x0));
+            }
+        }
+
+        int changed = 0;
+        for (size_t i = 0; i < sad_.size(); ++i) {
+            if (!masked_[i] &&
+                sad_[i] > static_cast<uint32_t>(cfg_.threshold) * samples_[i])
+                ++changed;
+        }
+        return changed;
+    }
+
+    bool detect(const uint8_t *frame, const uint8_t *previous, int width,
+                int height) {
+        return changedBlocks(frame, previous, width, height) >= cfg_.minBlocks;
+    }
+};
@@ -0,0 +1,309 @@
+// Hardware performance counters per stage of the frame pipeline, to tell which
+// stage is to blame when frames are dropped, and whether it is because of cache
+// misses, a slow CPU or the thread being switched out.
+//
+// Every thread opens its own counters, with perf_event_open, the first time it
+// enters a stage, and a stage adds what the counters moved while the thread was
+// in it. Work a stage hands over to the thread pool is only counted in its
+// time. When perf events are not allowed (see
+// /proc/sys/kernel/perf_event_paranoid) or not supported, e.g. in many virtual
+// machines, only time and context switches are counted.
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum class Stage {
+    CAPTURE = 0,
+    COPY,
+    CONVERT,
+    ENCODE,
+    SEND,
+    RECEIVE,
+    FLIP,
+    DECODE,
+    TEXTURE,
+    NUM_STAGES
+};
+
+std::string stageToString(Stage stage) {
+    switch (stage) {
+    case Stage::CAPTURE:
+        return "capture";
+    case Stage::COPY:
+        return "copy";
+    case Stage::CONVERT:
+        return "convert";
+    case Stage::ENCODE:
+        return "encode";
+    case Stage::SEND:
+        return "send";
+    case Stage::RECEIVE:
+        return "receive";
+    case Stage::FLIP:
+        return "flip";
+    case Stage::DECODE:
+        return "decode";
+    case Stage::TEXTURE:
+        return "texture";
+    default:
+        throw std::invalid_argument("Got invalid Stage");
+    }
+}
+
+// The counters of one thread.
+class ThreadCounters {
+  public:
+    enum Event { CYCLES = 0, INSTRUCTIONS = 1, CACHE_MISSES = 2, NUM_EVENTS };
+
+    struct Sample {
+        std::chrono::steady_clock::time_point time;
+        uint64_t contextSwitches = 0;
+        std::array<uint64_t, NUM_EVENTS> events = {};
+        // Time the events were enabled and counting, which differ when the
+        // kernel has to share the hardware counters between events.
+        uint64_t enabled = 0;
+        uint64_t running = 0;
+    };
+
+  private:
+    // The first event leads the group, so that all are read at once.
+    std::array<int, NUM_EVENTS> fds_;
+    // Position of each event in a read of the group, or -1 if it could not
+    // be opened.
+    std::array<int, NUM_EVENTS> slots_;
+    int opened_ = 0;
+
+    static int openEvent(uint64_t config, int group) {
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        // Only the thread's own work, which is allowed with the default
+        // perf_event_paranoid.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(
+            syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+    }
+
+  public:
+    ThreadCounters() {
+        fds_.fill(-1);
+        slots_.fill(-1);
+        static constexpr std::array<uint64_t, NUM_EVENTS> configs = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES};
+        for (size_t i = 0; i < configs.size(); ++i) {
+            fds_[i] = openEvent(configs[i], fds_[0]);
+            if (fds_[i] >= 0) {
+                slots_[i] = opened_++;
+            } else if (i == 0) {
+                // Every thread would fail the same way.
+                static std::atomic<bool> warned = false;
+                if (!warned.exchange(true))
+                    std::cerr << "WARNING: No hardware performance counters ("
+                              << strerror(errno)
+                              << "), only counting time and context switches"
+                              << std::endl;
+                break;
+            }
+        }
+    }
+
+    ThreadCounters(ThreadCounters const &) = delete;
+    ThreadCounters &operator=(ThreadCounters const &) = delete;
+    ~ThreadCounters() {
+        for (int fd : fds_) {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    bool hasEvent(Event event) const { return slots_[event] >= 0; }
+
+    Sample read() const {
+        Sample sample;
+        sample.time = std::chrono::steady_clock::now();
+        rusage usage = {};
+        if (getrusage(RUSAGE_THREAD, &usage) == 0)
+            sample.contextSwitches =
+                static_cast<uint64_t>(usage.ru_nvcsw + usage.ru_nivcsw);
+        if (opened_ == 0)
+            return sample;
+
+        // Number of events, the two times and then the values.
+        std::array<uint64_t, 3 + NUM_EVENTS> values = {};
+        const size_t size = (3 + static_cast<size_t>(opened_)) *
+                            sizeof(uint64_t);
+        if (::read(fds_[0], values.data(), size) !=
+            static_cast<ssize_t>(size))
+            return sample;
+        sample.enabled = values[1];
+        sample.running = values[2];
+        for (size_t i = 0; i < NUM_EVENTS; ++i) {
+            if (slots_[i] >= 0)
+                sample.events[i] = values[3 + static_cast<size_t>(slots_[i])];
+        }
+        return sample;
+    }
+};
+
+// What the threads have counted in one stage.
+class StageStats {
+    std::atomic<uint64_t> calls_ = 0;
+    std::atomic<uint64_t> ns_ = 0;
+    std::atomic<uint64_t> contextSwitches_ = 0;
+    std::array<std::atomic<uint64_t>, ThreadCounters::NUM_EVENTS> events_ = {};
+    // Calls in which each event was counted.
+    std::array<std::atomic<uint64_t>, ThreadCounters::NUM_EVENTS> counted_ =
+        {};
+
+  public:
+    void record(const ThreadCounters &counters,
+                const ThreadCounters::Sample &start,
+                const ThreadCounters::Sample &end) {
+        ++calls_;
+        ns_ += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end.time -
+                                                                 start.time)
+                .count());
+        contextSwitches_ += end.contextSwitches - start.contextSwitches;
+
+        // Scale up the counts if the events only counted part of the time.
+        const uint64_t running = end.running - start.running;
+        if (running == 0)
+            return;
+        const double scale =
+            static_cast<double>(end.enabled - start.enabled) /
+            static_cast<double>(running);
+        for (size_t i = 0; i < ThreadCounters::NUM_EVENTS; ++i) {
+            if (!counters.hasEvent(static_cast<ThreadCounters::Event>(i)))
+                continue;
+            events_[i] += static_cast<uint64_t>(
+                static_cast<double>(end.events[i] - start.events[i]) * scale);
+            ++counted_[i];
+        }
+    }
+
+    // Prints the averages per call since the last call, if there were any
+    // calls.
+    void print(std::ostream &os, const std::string &name) {
+        const uint64_t calls = calls_.exchange(0);
+        const uint64_t ns = ns_.exchange(0);
+        const uint64_t contextSwitches = contextSwitches_.exchange(0);
+        std::array<uint64_t, ThreadCounters::NUM_EVENTS> events, counted;
+        for (size_t i = 0; i < ThreadCounters::NUM_EVENTS; ++i) {
+            events[i] = events_[i].exchange(0);
+            counted[i] = counted_[i].exchange(0);
+        }
+        if (calls == 0)
+            return;
+
+        auto average = [](uint64_t total, uint64_t count) {
+            return static_cast<double>(total) / static_cast<double>(count);
+        };
+        os << std::fixed << std::setprecision(2) << "Stage " << name << ": "
+           << calls << " calls, " << average(ns, calls) / 1e6 << " ms, "
+           << average(contextSwitches, calls) << " context switches";
+        if (counted[ThreadCounters::CYCLES] > 0)
+            os << ", "
+               << average(events[ThreadCounters::CYCLES],
+                          counted[ThreadCounters::CYCLES]) /
+                      1e6
+               << " Mcycles";
+        if (counted[ThreadCounters::INSTRUCTIONS] > 0 &&
+            events[ThreadCounters::CYCLES] > 0)
+            os << ", "
+               << average(events[ThreadCounters::INSTRUCTIONS],
+                          events[ThreadCounters::CYCLES])
+               << " instructions per cycle";
+        if (counted[ThreadCounters::CACHE_MISSES] > 0)
+            os << ", "
+               << average(events[ThreadCounters::CACHE_MISSES],
+                          counted[ThreadCounters::CACHE_MISSES]) /
+                      1e3
+               << " k cache misses";
+        os << " per call" << std::endl;
+    }
+};
+
+class PerfCounters {
+    static constexpr size_t NUM_STAGES = static_cast<size_t>(Stage::NUM_STAGES);
+
+    std::atomic<bool> enabled_ = false;
+    std::atomic<bool> printRequested_ = false;
+    std::array<StageStats, NUM_STAGES> stages_;
+
+    static void requestPrint(int) { shared().printRequested_ = true; }
+
+  public:
+    // The counters of the whole program.
+    static PerfCounters &shared() {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    // Starts counting in the stages. Threads open their counters when they
+    // first enter a stage after this.
+    void enable(bool enable) { enabled_ = enable; }
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    // Makes sig ask for the counters to be printed, see takePrintRequest().
+    void printOnSignal(int sig) { std::signal(sig, requestPrint); }
+
+    // Whether the counters have been asked for by the signal since the last
+    // call.
+    bool takePrintRequest() { return printRequested_.exchange(false); }
+
+    StageStats &stage(Stage stage) {
+        return stages_[static_cast<size_t>(stage)];
+    }
+
+    // Prints the averages of all stages since the last call.
+    void print(std::ostream &os) {
+        for (size_t i = 0; i < NUM_STAGES; ++i)
+            stages_[i].print(os, stageToString(static_cast<Stage>(i)));
+    }
+};
+
+// Counts the calling thread's work in a stage until it goes out of scope.
+// Does nothing unless the counters are enabled.
+class StageScope {
+    Stage stage_;
+    const ThreadCounters *counters_ = nullptr;
+    ThreadCounters::Sample start_;
+
+  public:
+    explicit StageScope(Stage stage) : stage_(stage) {
+        if (!PerfCounters::shared().enabled())
+            return;
+        thread_local ThreadCounters counters;
+        counters_ = &counters;
+        start_ = counters.read();
+    }
+
+    StageScope(StageScope const &) = delete;
+    StageScope &operator=(StageScope const &) = delete;
+    ~StageScope() {
+        if (counters_ != nullptr)
+            PerfCounters::shared().stage(stage_).record(*counters_, start_,
+                                                        counters_->read());
+    }
+};
@@ -0,0 +1,150 @@
+// Pixel formats that frames can be streamed in. Formats are identified by their
+// V4L2 fourcc, both locally and in the stream configuration sent over tcp.
+//
+// Each format is described by its FormatTraits, so that code handling frames
+// can be specialized for a format at compile time. visitFormat() turns a
+// format only known at runtime into its traits.
+#pragma once
+
+#include <cstddef>
+#include <linux/videodev2.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+template <int Format, int BitsPerPixel, int PitchBytes, int Planes,
+          bool Compressed>
+struct FormatInfo {
+    static constexpr int format = Format;
+    // Bits per pixel of the whole frame, over all planes.
+    static constexpr int bitsPerPixel = BitsPerPixel;
+    // Bytes per pixel of a row in the first plane.
+    static constexpr int pitchBytes = PitchBytes;
+    static constexpr int planes = Planes;
+    // Compressed frames vary in size from frame to frame.
+    static constexpr bool compressed = Compressed;
+
+    static constexpr size_t pitch(int width) {
+        return static_cast<size_t>(width) * PitchBytes;
+    }
+
+    static constexpr size_t size(int width, int height) {
+        return static_cast<size_t>(width) * static_cast<size_t>(height) *
+               BitsPerPixel / 8;
+    }
+};
+
+template <int Format> struct FormatTraits;
+
+// Packed 4:2:2, Y0 U Y1 V.
+template <>
+struct FormatTraits<V4L2_PIX_FMT_YUYV>
+    : FormatInfo<V4L2_PIX_FMT_YUYV, 16, 2, 1, false> {
+    static constexpr const char *name = "yuyv";
+};
+
+// Packed 4:2:2, U Y0 V Y1.
+template <>
+struct FormatTraits<V4L2_PIX_FMT_UYVY>
+    : FormatInfo<V4L2_PIX_FMT_UYVY, 16, 2, 1, false> {
+    static constexpr const char *name = "uyvy";
+};
+
+// Planar 4:2:0, a Y plane followed by a plane of interleaved U and V.
+template <>
+struct FormatTraits<V4L2_PIX_FMT_NV12>
+    : FormatInfo<V4L2_PIX_FMT_NV12, 12, 1, 2, false> {
+    static constexpr const char *name = "nv12";
+};
+
+// Planar 4:2:0, Y, U and V planes.
+template <>
+struct FormatTraits<V4L2_PIX_FMT_YUV420>
+    : FormatInfo<V4L2_PIX_FMT_YUV420, 12, 1, 3, false> {
+    static constexpr const char *name = "i420";
+};
+
+template <>
+struct FormatTraits<V4L2_PIX_FMT_RGB24>
+    : FormatInfo<V4L2_PIX_FMT_RGB24, 24, 3, 1, false> {
+    static constexpr const char *name = "rgb24";
+};
+
+// Luma only.
+template <>
+struct FormatTraits<V4L2_PIX_FMT_GREY>
+    : FormatInfo<V4L2_PIX_FMT_GREY, 8, 1, 1, false> {
+    static constexpr const char *name = "grey";
+};
+
+template <>
+struct FormatTraits<V4L2_PIX_FMT_MJPEG>
+    : FormatInfo<V4L2_PIX_FMT_MJPEG, 0, 0, 1, true> {
+    static constexpr const char *name = "mjpeg";
+};
+
+template <int... Formats> struct FormatList {};
+
+using AllFormats =
+    FormatList<V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_NV12,
+               V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_GREY,
+               V4L2_PIX_FMT_MJPEG>;
+
+template <typename Fn, int First, int... Rest>
+auto visitFormat(int format, Fn &&fn, FormatList<First, Rest...>) {
+    if (format == First)
+        return fn(FormatTraits<First>{});
+    if constexpr (sizeof...(Rest) > 0)
+        return visitFormat(format, fn, FormatList<Rest...>{});
+    else
+        throw std::invalid_argument("Unknown pixel format " +
+                                    std::to_string(format));
+}
+
+// Calls fn with the FormatTraits of format and returns what it returns.
+template <typename Fn> auto visitFormat(int format, Fn &&fn) {
+    return visitFormat(format, fn, AllFormats{});
+}
+
+template <int... Formats>
+bool isKnownFormat(int format, FormatList<Formats...>) {
+    return ((format == Formats) || ...);
+}
+
+bool isKnownFormat(int format) { return isKnownFormat(format, AllFormats{}); }
+
+bool isCompressed(int format) {
+    return isKnownFormat(format) &&
+           visitFormat(format, [](auto traits) { return traits.compressed; });
+}
+
+// Size in bytes of a frame, or 0 for compressed formats whose size varies
+// from frame to frame.
+size_t frameSize(int format, int width, int height) {
+    return visitFormat(format, [&](auto traits) {
+        return traits.size(width, height);
+    });
+}
+
+std::string formatToString(int format) {
+    if (!isKnownFormat(format))
+        return "unknown (" + std::to_string(format) + ")";
+    return visitFormat(format,
+                       [](auto traits) { return std::string(traits.name); });
+}
+
+template <int... Formats>
+int formatFromString(std::string_view name, FormatList<Formats...>) {
+    int format = 0;
+    ((name == FormatTraits<Formats>::name ? (format = Formats, true) : false) ||
+     ...);
+    return format;
+}
+
+int formatFromString(std::string_view name) {
+    int format = formatFromString(name, AllFormats{});
+    if (format == 0)
+        throw std::invalid_argument("Unknown pixel format: " +
+                                    std::string(name));
+    return format;
+}
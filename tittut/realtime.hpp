@@ -0,0 +1,207 @@
+// Pinning of threads to cores, real-time scheduling and locked memory, for
+// steady frame times on a loaded host.
+//
+// Threads are placed by their role: the capture thread, the threads sending or
+// receiving frames over the network and the thread rendering them. For each
+// role it is also measured how long its threads take to run after being woken
+// up by a new frame or a timer, which shows how much they get preempted.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <vector>
+
+enum class ThreadRole { CAPTURE = 0, NETWORK = 1, RENDER = 2, NUM_ROLES = 3 };
+
+std::string threadRoleToString(ThreadRole role) {
+    switch (role) {
+    case ThreadRole::CAPTURE:
+        return "capture";
+    case ThreadRole::NETWORK:
+        return "network";
+    case ThreadRole::RENDER:
+        return "render";
+    default:
+        throw std::invalid_argument("Got invalid ThreadRole");
+    }
+}
+
+// Parses a list of cores written like "0,2-3".
+std::vector<int> parseCpuList(std::string_view str) {
+    std::vector<int> cpus;
+    while (!str.empty()) {
+        size_t end = str.find(',');
+        std::string part(str.substr(0, end));
+        str = end == std::string_view::npos ? "" : str.substr(end + 1);
+
+        int first = 0, last = 0;
+        const int n = sscanf(part.c_str(), "%d-%d", &first, &last);
+        if (n == 1)
+            last = first;
+        if (n < 1 || first < 0 || last < first || last >= CPU_SETSIZE)
+            throw std::invalid_argument("Invalid cpu list: " + part);
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// How late threads run after being woken up.
+class WakeupStats {
+    std::atomic<uint64_t> count_ = 0;
+    std::atomic<uint64_t> totalUs_ = 0;
+    std::atomic<uint64_t> maxUs_ = 0;
+
+  public:
+    void record(std::chrono::steady_clock::duration delay) {
+        const uint64_t us = static_cast<uint64_t>(std::max<int64_t>(
+            0, std::chrono::duration_cast<std::chrono::microseconds>(delay)
+                   .count()));
+        ++count_;
+        totalUs_ += us;
+        uint64_t max = maxUs_;
+        while (us > max && !maxUs_.compare_exchange_weak(max, us)) {
+        }
+    }
+
+    // Prints the average and maximum delay since the last call, if there
+    // were any wakeups.
+    void print(std::ostream &os, const std::string &name) {
+        const uint64_t count = count_.exchange(0);
+        const uint64_t total = totalUs_.exchange(0);
+        const uint64_t max = maxUs_.exchange(0);
+        if (count == 0)
+            return;
+        os << std::fixed << std::setprecision(1) << "Wakeup latency of "
+           << name << " threads: "
+           << static_cast<double>(total) / static_cast<double>(count) / 1000
+           << " ms average, " << static_cast<double>(max) / 1000
+           << " ms max over " << count << " wakeups" << std::endl;
+    }
+};
+
+class ThreadPlacer {
+  public:
+    // Where and how the threads of a role run.
+    struct Placement {
+        // Cores to run on, any if empty.
+        std::vector<int> cpus;
+        // SCHED_FIFO priority, 0 for the normal scheduler.
+        int priority = 0;
+    };
+
+  private:
+    static constexpr size_t NUM_ROLES =
+        static_cast<size_t>(ThreadRole::NUM_ROLES);
+
+    std::array<Placement, NUM_ROLES> placements_;
+    std::array<WakeupStats, NUM_ROLES> wakeups_;
+
+  public:
+    // The placements used by the whole program.
+    static ThreadPlacer &shared() {
+        static ThreadPlacer placer;
+        return placer;
+    }
+
+    // Sets the placements from a string like "capture=2:50;network=3-5", i.e.
+    // the cores of each role optionally followed by a SCHED_FIFO priority.
+    // Must be called before starting the threads.
+    void configure(std::string_view str) {
+        while (!str.empty()) {
+            size_t end = str.find(';');
+            std::string part(str.substr(0, end));
+            str = end == std::string_view::npos ? "" : str.substr(end + 1);
+            if (part.empty())
+                continue;
+
+            const size_t equals = part.find('=');
+            if (equals == std::string::npos)
+                throw std::invalid_argument("Invalid thread placement: " +
+                                            part);
+            const std::string name = part.substr(0, equals);
+            size_t index = 0;
+            while (index < NUM_ROLES &&
+                   threadRoleToString(static_cast<ThreadRole>(index)) != name)
+                ++index;
+            if (index == NUM_ROLES)
+                throw std::invalid_argument("Unknown thread role: " + name);
+
+            Placement placement;
+            std::string cpus = part.substr(equals + 1);
+            const size_t colon = cpus.find(':');
+            if (colon != std::string::npos) {
+                placement.priority = std::stoi(cpus.substr(colon + 1));
+                cpus.resize(colon);
+            }
+            if (placement.priority < 0 ||
+                placement.priority > sched_get_priority_max(SCHED_FIFO))
+                throw std::invalid_argument("Invalid priority in: " + part);
+            placement.cpus = parseCpuList(cpus);
+            placements_[index] = placement;
+        }
+    }
+
+    // Moves the calling thread to the cores of role, and to real-time
+    // scheduling if it has a priority. Failing to do so only gives a warning,
+    // since the thread still works, just with less steady timing.
+    void place(ThreadRole role) const {
+        const Placement &placement = placements_[static_cast<size_t>(role)];
+        if (!placement.cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : placement.cpus)
+                CPU_SET(cpu, &set);
+            const int err =
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (err)
+                std::cerr << "WARNING: Could not pin the "
+                          << threadRoleToString(role)
+                          << " thread: " << strerror(err) << std::endl;
+        }
+        if (placement.priority > 0) {
+            sched_param param = {};
+            param.sched_priority = placement.priority;
+            const int err =
+                pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (err)
+                std::cerr << "WARNING: Could not use SCHED_FIFO for the "
+                          << threadRoleToString(role)
+                          << " thread: " << strerror(err)
+                          << " (it needs CAP_SYS_NICE)" << std::endl;
+        }
+    }
+
+    WakeupStats &wakeups(ThreadRole role) {
+        return wakeups_[static_cast<size_t>(role)];
+    }
+
+    // Prints the wakeup latencies of all roles since the last call.
+    void printWakeups(std::ostream &os) {
+        for (size_t i = 0; i < NUM_ROLES; ++i)
+            wakeups_[i].print(os,
+                              threadRoleToString(static_cast<ThreadRole>(i)));
+    }
+};
+
+// Locks all current and future memory of the process in RAM, including the
+// frame buffers and the mapped capture buffers, so that it is never paged out.
+void lockMemory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+        throw std::runtime_error(std::string("Could not lock memory: ") +
+                                 strerror(errno) +
+                                 " (check ulimit -l or CAP_IPC_LOCK)");
+}
@@ -0,0 +1,660 @@
+// Downscaling, cropping and flipping of packed YUYV images. Cropping and
+// flipping also work on UYVY images.
+//
+// A YUYV row consists of macropixels of four bytes, Y0 U Y1 V, where two
+// horizontally neighbouring pixels share the same chroma samples. The scalers
+// first combine the source rows that contribute to an output row, and then
+// resample the resulting row horizontally, treating luma and chroma samples
+// separately. Both passes are built from row primitives that exist in a
+// scalar, an SSE2 and an AVX2 version, which give identical results, and the
+// fastest one that the CPU supports is picked at runtime as for conversions.
+#pragma once
+
+#include "buffer-pool.hpp"
+#include "convert.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Sample position and weight (0..128) of the second sample for linear
+// interpolation between two neighbouring source samples.
+struct LerpTap {
+    int idx;
+    int w;
+};
+
+// Row primitives. Rows of accumulators hold a 16 bit sum for every byte of a
+// YUYV row.
+struct ScalarScaleRows {
+    // Adds a row of bytes to a row of accumulators.
+    static void accumulate(const uint8_t *src, uint16_t *acc, int size) {
+        for (int i = 0; i < size; ++i)
+            acc[i] += src[i];
+    }
+
+    // Blends two rows of bytes, dst = (a * (128 - w) + b * w) / 128 with
+    // 0 <= w <= 128.
+    static void blend(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+                      int size, int w) {
+        for (int i = 0; i < size; ++i)
+            dst[i] =
+                static_cast<uint8_t>((a[i] * (128 - w) + b[i] * w + 64) >> 7);
+    }
+
+    // Sums every f neighbouring macropixels of a row of accumulators into
+    // one, for n macropixels out. Works in place.
+    static void sum(const uint16_t *in, uint16_t *out, int n, int f) {
+        for (int m = 0; m < n; ++m) {
+            const uint16_t *p = in + m * f * 4;
+            uint32_t y0 = 0, y1 = 0, u = 0, v = 0;
+            for (int i = 0; i < f; ++i) {
+                y0 += p[i * 2];
+                y1 += p[(f + i) * 2];
+                u += p[i * 4 + 1];
+                v += p[i * 4 + 3];
+            }
+            out[m * 4 + 0] = static_cast<uint16_t>(y0);
+            out[m * 4 + 1] = static_cast<uint16_t>(u);
+            out[m * 4 + 2] = static_cast<uint16_t>(y1);
+            out[m * 4 + 3] = static_cast<uint16_t>(v);
+        }
+    }
+
+    static void halve(const uint16_t *in, uint16_t *out, int n) {
+        sum(in, out, n, 2);
+    }
+
+    // Divides sums by the number of samples that they hold, given as its 16
+    // bit fixed point reciprocal, rounding to nearest.
+    static void divide(const uint16_t *in, uint8_t *out, int size,
+                       uint32_t recip) {
+        for (int i = 0; i < size; ++i)
+            out[i] = static_cast<uint8_t>((in[i] * recip + 0x8000) >> 16);
+    }
+
+    // Interpolates n macropixels from a row, with two luma taps and one
+    // chroma tap per macropixel.
+    static void lerp(const uint8_t *in, const LerpTap *luma,
+                     const LerpTap *chroma, uint8_t *out, int n) {
+        auto mix = [](int a, int b, int w) {
+            return static_cast<uint8_t>((a * (128 - w) + b * w + 64) >> 7);
+        };
+        for (int m = 0; m < n; ++m) {
+            for (int i = 0; i < 2; ++i) {
+                const LerpTap &t = luma[m * 2 + i];
+                const int next = t.w ? t.idx + 1 : t.idx;
+                out[m * 4 + i * 2] = mix(in[t.idx * 2], in[next * 2], t.w);
+            }
+            const LerpTap &t = chroma[m];
+            const int next = t.w ? t.idx + 1 : t.idx;
+            for (int c = 1; c < 4; c += 2) {
+                out[m * 4 + c] =
+                    mix(in[t.idx * 4 + c], in[next * 4 + c], t.w);
+            }
+        }
+    }
+};
+
+#ifdef __x86_64__
+// The SIMD versions interpolate by loading the two samples of a tap as one
+// word, which may reach two bytes (luma) or four bytes (chroma) past the
+// samples themselves, so they must only be given taps that stay in the row.
+struct Sse2ScaleRows {
+    static __m128i load(const void *p) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    }
+
+    static void store(void *p, __m128i v) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+    }
+
+    static void accumulate(const uint8_t *src, uint16_t *acc, int size) {
+        const __m128i zero = _mm_setzero_si128();
+        int i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i s = load(src + i);
+            store(acc + i, _mm_add_epi16(load(acc + i),
+                                         _mm_unpacklo_epi8(s, zero)));
+            store(acc + i + 8, _mm_add_epi16(load(acc + i + 8),
+                                             _mm_unpackhi_epi8(s, zero)));
+        }
+        ScalarScaleRows::accumulate(src + i, acc + i, size - i);
+    }
+
+    static void blend(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+                      int size, int w) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i wa = _mm_set1_epi16(static_cast<int16_t>(128 - w));
+        const __m128i wb = _mm_set1_epi16(static_cast<int16_t>(w));
+        const __m128i round = _mm_set1_epi16(64);
+        int i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i va = load(a + i);
+            __m128i vb = load(b + i);
+            __m128i lo = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                              _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb)),
+                round);
+            __m128i hi = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                              _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb)),
+                round);
+            store(dst + i, _mm_packus_epi16(_mm_srli_epi16(lo, 7),
+                                            _mm_srli_epi16(hi, 7)));
+        }
+        ScalarScaleRows::blend(a + i, b + i, dst + i, size - i, w);
+    }
+
+    // Seen as 32 bit lanes, a macropixel is (Y0, U) (Y1, V). The luma sums of
+    // two macropixels are in the low halves of the even plus the odd lanes,
+    // and the chroma sums in the high halves of the first plus the last two.
+    static void halve(const uint16_t *in, uint16_t *out, int n) {
+        const __m128i lumaMask = _mm_set1_epi32(0xffff);
+        int m = 0;
+        for (; m + 2 <= n; m += 2) {
+            __m128 a = _mm_castsi128_ps(load(in + m * 8));
+            __m128 b = _mm_castsi128_ps(load(in + m * 8 + 8));
+            __m128i luma =
+                _mm_add_epi16(_mm_castps_si128(_mm_shuffle_ps(a, b, 0x88)),
+                              _mm_castps_si128(_mm_shuffle_ps(a, b, 0xdd)));
+            __m128i chroma =
+                _mm_add_epi16(_mm_castps_si128(_mm_movelh_ps(a, b)),
+                              _mm_castps_si128(_mm_movehl_ps(b, a)));
+            store(out + m * 4,
+                  _mm_or_si128(_mm_and_si128(luma, lumaMask),
+                               _mm_andnot_si128(lumaMask, chroma)));
+        }
+        ScalarScaleRows::halve(in + m * 8, out + m * 4, n - m);
+    }
+
+    // (s * recip + 0x8000) >> 16, from the high and low halves of s * recip.
+    static __m128i divide(__m128i s, __m128i recip) {
+        return _mm_add_epi16(_mm_mulhi_epu16(s, recip),
+                             _mm_srli_epi16(_mm_mullo_epi16(s, recip), 15));
+    }
+
+    static void divide(const uint16_t *in, uint8_t *out, int size,
+                       uint32_t recip) {
+        const __m128i r = _mm_set1_epi16(static_cast<int16_t>(recip));
+        int i = 0;
+        for (; i + 16 <= size; i += 16) {
+            store(out + i, _mm_packus_epi16(divide(load(in + i), r),
+                                            divide(load(in + i + 8), r)));
+        }
+        ScalarScaleRows::divide(in + i, out + i, size - i, recip);
+    }
+
+    // The weights (128 - w, w) of 32 bit lanes of w, as 16 bit pairs.
+    static __m128i weights(__m128i w) {
+        return _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(w, 16), w),
+                             _mm_set1_epi32(128));
+    }
+
+    // Interpolates each pair of 16 bit samples with its weights, giving 32
+    // bit lanes.
+    static __m128i mix(__m128i pairs, __m128i w) {
+        return _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(pairs, weights(w)),
+                                            _mm_set1_epi32(64)),
+                              7);
+    }
+
+    static int load32(const uint8_t *p) {
+        int v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // Four luma samples.
+    static __m128i lerpLuma(const uint8_t *in, const LerpTap *taps) {
+        __m128i w = _mm_castps_si128(_mm_shuffle_ps(
+            _mm_castsi128_ps(load(taps)), _mm_castsi128_ps(load(taps + 2)),
+            0xdd));
+        __m128i pairs = _mm_setr_epi32(
+            load32(in + taps[0].idx * 2), load32(in + taps[1].idx * 2),
+            load32(in + taps[2].idx * 2), load32(in + taps[3].idx * 2));
+        return mix(_mm_and_si128(pairs, _mm_set1_epi32(0x00ff00ff)), w);
+    }
+
+    static __m128i load64(const uint8_t *p) {
+        return _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+    }
+
+    // U and V of two macropixels, from the macropixels of their taps and the
+    // next ones, reordered from U V U' V' to U U' V V'.
+    static __m128i lerpChroma(const uint8_t *in, const LerpTap *taps) {
+        __m128i w = _mm_shuffle_epi32(load(taps), 0xf5);
+        __m128i pairs = _mm_srli_epi16(
+            _mm_unpacklo_epi64(load64(in + taps[0].idx * 4),
+                               load64(in + taps[1].idx * 4)),
+            8);
+        return mix(
+            _mm_shufflehi_epi16(_mm_shufflelo_epi16(pairs, 0xd8), 0xd8), w);
+    }
+
+    static void lerp(const uint8_t *in, const LerpTap *luma,
+                     const LerpTap *chroma, uint8_t *out, int n) {
+        int m = 0;
+        for (; m + 4 <= n; m += 4) {
+            __m128i y = _mm_packs_epi32(lerpLuma(in, luma + m * 2),
+                                        lerpLuma(in, luma + m * 2 + 4));
+            __m128i c = _mm_packs_epi32(lerpChroma(in, chroma + m),
+                                        lerpChroma(in, chroma + m + 2));
+            store(out + m * 4, _mm_packus_epi16(_mm_unpacklo_epi16(y, c),
+                                                _mm_unpackhi_epi16(y, c)));
+        }
+        ScalarScaleRows::lerp(in, luma + m * 2, chroma + m, out + m * 4,
+                              n - m);
+    }
+};
+
+// The AVX2 versions work like the SSE2 ones within 128 bit lanes, with the
+// 64 bit quarters put back in order with a permute where packing or
+// shuffling mixed them up (0xd8 swaps the middle quarters). Taps are loaded
+// with gathers.
+struct Avx2ScaleRows {
+    TITTUT_AVX2 static __m256i load(const void *p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    }
+
+    TITTUT_AVX2 static void store(void *p, __m256i v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+    }
+
+    TITTUT_AVX2 static void accumulate(const uint8_t *src, uint16_t *acc,
+                                       int size) {
+        int i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m128i lo = Sse2ScaleRows::load(src + i);
+            __m128i hi = Sse2ScaleRows::load(src + i + 16);
+            store(acc + i,
+                  _mm256_add_epi16(load(acc + i), _mm256_cvtepu8_epi16(lo)));
+            store(acc + i + 16, _mm256_add_epi16(load(acc + i + 16),
+                                                 _mm256_cvtepu8_epi16(hi)));
+        }
+        Sse2ScaleRows::accumulate(src + i, acc + i, size - i);
+    }
+
+    TITTUT_AVX2 static __m256i blend(__m256i a, __m256i b, __m256i wa,
+                                     __m256i wb) {
+        return _mm256_srli_epi16(
+            _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, wa),
+                                              _mm256_mullo_epi16(b, wb)),
+                             _mm256_set1_epi16(64)),
+            7);
+    }
+
+    TITTUT_AVX2 static void blend(const uint8_t *a, const uint8_t *b,
+                                  uint8_t *dst, int size, int w) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i wa = _mm256_set1_epi16(static_cast<int16_t>(128 - w));
+        const __m256i wb = _mm256_set1_epi16(static_cast<int16_t>(w));
+        int i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m256i va = load(a + i);
+            __m256i vb = load(b + i);
+            store(dst + i, _mm256_packus_epi16(
+                               blend(_mm256_unpacklo_epi8(va, zero),
+                                     _mm256_unpacklo_epi8(vb, zero), wa, wb),
+                               blend(_mm256_unpackhi_epi8(va, zero),
+                                     _mm256_unpackhi_epi8(vb, zero), wa, wb)));
+        }
+        Sse2ScaleRows::blend(a + i, b + i, dst + i, size - i, w);
+    }
+
+    TITTUT_AVX2 static void halve(const uint16_t *in, uint16_t *out, int n) {
+        const __m256i lumaMask = _mm256_set1_epi32(0xffff);
+        int m = 0;
+        for (; m + 4 <= n; m += 4) {
+            __m256i a = load(in + m * 8);
+            __m256i b = load(in + m * 8 + 16);
+            __m256 fa = _mm256_castsi256_ps(a);
+            __m256 fb = _mm256_castsi256_ps(b);
+            __m256i luma = _mm256_add_epi16(
+                _mm256_castps_si256(_mm256_shuffle_ps(fa, fb, 0x88)),
+                _mm256_castps_si256(_mm256_shuffle_ps(fa, fb, 0xdd)));
+            __m256i chroma = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b),
+                                              _mm256_unpackhi_epi64(a, b));
+            store(out + m * 4,
+                  _mm256_permute4x64_epi64(
+                      _mm256_or_si256(_mm256_and_si256(luma, lumaMask),
+                                      _mm256_andnot_si256(lumaMask, chroma)),
+                      0xd8));
+        }
+        Sse2ScaleRows::halve(in + m * 8, out + m * 4, n - m);
+    }
+
+    TITTUT_AVX2 static __m256i divide(__m256i s, __m256i recip) {
+        return _mm256_add_epi16(
+            _mm256_mulhi_epu16(s, recip),
+            _mm256_srli_epi16(_mm256_mullo_epi16(s, recip), 15));
+    }
+
+    TITTUT_AVX2 static void divide(const uint16_t *in, uint8_t *out, int size,
+                                   uint32_t recip) {
+        const __m256i r = _mm256_set1_epi16(static_cast<int16_t>(recip));
+        int i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m256i lo = divide(load(in + i), r);
+            __m256i hi = divide(load(in + i + 16), r);
+            store(out + i, _mm256_permute4x64_epi64(
+                               _mm256_packus_epi16(lo, hi), 0xd8));
+        }
+        Sse2ScaleRows::divide(in + i, out + i, size - i, recip);
+    }
+
+    TITTUT_AVX2 static __m256i mix(__m256i pairs, __m256i w) {
+        const __m256i weights = _mm256_add_epi32(
+            _mm256_sub_epi32(_mm256_slli_epi32(w, 16), w),
+            _mm256_set1_epi32(128));
+        return _mm256_srai_epi32(
+            _mm256_add_epi32(_mm256_madd_epi16(pairs, weights),
+                             _mm256_set1_epi32(64)),
+            7);
+    }
+
+    // Eight luma samples.
+    TITTUT_AVX2 static __m256i lerpLuma(const uint8_t *in,
+                                        const LerpTap *taps) {
+        __m256 t0 = _mm256_castsi256_ps(load(taps));
+        __m256 t1 = _mm256_castsi256_ps(load(taps + 4));
+        __m256i idx = _mm256_permute4x64_epi64(
+            _mm256_castps_si256(_mm256_shuffle_ps(t0, t1, 0x88)), 0xd8);
+        __m256i w = _mm256_permute4x64_epi64(
+            _mm256_castps_si256(_mm256_shuffle_ps(t0, t1, 0xdd)), 0xd8);
+        __m256i pairs = _mm256_i32gather_epi32(
+            reinterpret_cast<const int *>(in), _mm256_add_epi32(idx, idx), 1);
+        return mix(_mm256_and_si256(pairs, _mm256_set1_epi32(0x00ff00ff)), w);
+    }
+
+    // U and V of four macropixels.
+    TITTUT_AVX2 static __m256i lerpChroma(const uint8_t *in,
+                                          const LerpTap *taps) {
+        __m256i t = load(taps);
+        __m128i idx = _mm256_castsi256_si128(
+            _mm256_permute4x64_epi64(_mm256_shuffle_epi32(t, 0x88), 0x08));
+        __m256i pairs = _mm256_srli_epi16(
+            _mm256_i32gather_epi64(reinterpret_cast<const long long *>(in),
+                                   _mm_slli_epi32(idx, 2), 1),
+            8);
+        return mix(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pairs, 0xd8),
+                                          0xd8),
+                   _mm256_shuffle_epi32(t, 0xf5));
+    }
+
+    TITTUT_AVX2 static void lerp(const uint8_t *in, const LerpTap *luma,
+                                 const LerpTap *chroma, uint8_t *out, int n) {
+        int m = 0;
+        for (; m + 8 <= n; m += 8) {
+            __m256i y = _mm256_permute4x64_epi64(
+                _mm256_packs_epi32(lerpLuma(in, luma + m * 2),
+                                   lerpLuma(in, luma + m * 2 + 8)),
+                0xd8);
+            __m256i c = _mm256_permute4x64_epi64(
+                _mm256_packs_epi32(lerpChroma(in, chroma + m),
+                                   lerpChroma(in, chroma + m + 4)),
+                0xd8);
+            store(out + m * 4,
+                  _mm256_packus_epi16(_mm256_unpacklo_epi16(y, c),
+                                      _mm256_unpackhi_epi16(y, c)));
+        }
+        Sse2ScaleRows::lerp(in, luma + m * 2, chroma + m, out + m * 4, n - m);
+    }
+};
+#endif
+
+void checkYuyvDimensions(int srcWidth, int srcHeight, int dstWidth,
+                         int dstHeight) {
+    if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0 ||
+        srcWidth % 2 || dstWidth % 2) {
+        throw std::invalid_argument(
+            "Invalid YUYV scaling " + std::to_string(srcWidth) + "x" +
+            std::to_string(srcHeight) + " -> " + std::to_string(dstWidth) +
+            "x" + std::to_string(dstHeight));
+    }
+}
+
+// Every output pixel is the average of a fx x fy block of source pixels. A row
+// of sums is halved as long as fx is even, and odd factors are summed by the
+// scalar code.
+template <typename Rows>
+void boxRows(const uint8_t *src, int srcWidth, int srcHeight, uint8_t *dst,
+             int dstWidth, int dstHeight) {
+    const int fx = srcWidth / dstWidth;
+    const int fy = srcHeight / dstHeight;
+    const int srcPitch = srcWidth * 2;
+    const int dstPitch = dstWidth * 2;
+    if (fx * fy == 1) {
+        std::memcpy(dst, src, static_cast<size_t>(srcPitch) * srcHeight);
+        return;
+    }
+    // Fixed point reciprocal of the number of samples in a box.
+    const uint32_t recip = (1u << 16) / static_cast<uint32_t>(fx * fy);
+    std::vector<uint16_t> &acc = scratch<uint16_t, 0>(srcPitch);
+
+    for (int y = 0; y < dstHeight; ++y) {
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int r = 0; r < fy; ++r)
+            Rows::accumulate(src + (y * fy + r) * srcPitch, acc.data(),
+                             srcPitch);
+
+        int n = srcWidth / 2;
+        int f = fx;
+        for (; f % 2 == 0; f /= 2) {
+            n /= 2;
+            Rows::halve(acc.data(), acc.data(), n);
+        }
+        if (f > 1)
+            ScalarScaleRows::sum(acc.data(), acc.data(), n / f, f);
+        Rows::divide(acc.data(), dst + y * dstPitch, dstPitch, recip);
+    }
+}
+
+// Box filter for integer scaling factors. Every output pixel is the average of
+// a (srcWidth / dstWidth) x (srcHeight / dstHeight) block of source pixels.
+void scaleYuyvBox(const uint8_t *src, int srcWidth, int srcHeight,
+                  uint8_t *dst, int dstWidth, int dstHeight,
+                  SimdLevel level = simdLevel()) {
+    checkYuyvDimensions(srcWidth, srcHeight, dstWidth, dstHeight);
+    if (srcWidth % dstWidth || srcHeight % dstHeight)
+        throw std::invalid_argument("Box scaling needs integer factors");
+    if ((srcWidth / dstWidth) * (srcHeight / dstHeight) > 256)
+        throw std::invalid_argument("Box scaling factor is too large");
+
+    switch (level) {
+#ifdef __x86_64__
+    case SimdLevel::AVX2:
+        return boxRows<Avx2ScaleRows>(src, srcWidth, srcHeight, dst, dstWidth,
+                                      dstHeight);
+    case SimdLevel::SSE2:
+        return boxRows<Sse2ScaleRows>(src, srcWidth, srcHeight, dst, dstWidth,
+                                      dstHeight);
+#endif
+    default:
+        return boxRows<ScalarScaleRows>(src, srcWidth, srcHeight, dst,
+                                        dstWidth, dstHeight);
+    }
+}
+
+// Fills taps with the taps of every destination sample.
+void lerpTaps(int srcSize, int dstSize, std::vector<LerpTap> &taps) {
+    taps.resize(dstSize);
+    for (int i = 0; i < dstSize; ++i) {
+        // Align pixel centers, in 16.16 fixed point.
+        int64_t pos = ((2 * i + 1) * (int64_t(srcSize) << 16)) / (2 * dstSize) -
+                      (1 << 15);
+        if (pos < 0)
+            pos = 0;
+        int idx = static_cast<int>(pos >> 16);
+        int w = static_cast<int>((pos & 0xffff) >> 9);
+        if (idx >= srcSize - 1) {
+            idx = srcSize - 1;
+            w = 0;
+        }
+        taps[i] = {idx, w};
+    }
+}
+
+template <typename Rows>
+void bilinearRows(const uint8_t *src, int srcWidth, int srcHeight,
+                  uint8_t *dst, int dstWidth, int dstHeight) {
+    const int srcPitch = srcWidth * 2;
+    const int dstPitch = dstWidth * 2;
+    std::vector<LerpTap> &rows = scratch<LerpTap, 0>(0);
+    std::vector<LerpTap> &lumaTaps = scratch<LerpTap, 1>(0);
+    std::vector<LerpTap> &chromaTaps = scratch<LerpTap, 2>(0);
+    lerpTaps(srcHeight, dstHeight, rows);
+    lerpTaps(srcWidth, dstWidth, lumaTaps);
+    lerpTaps(srcWidth / 2, dstWidth / 2, chromaTaps);
+    std::vector<uint8_t> &row = scratch<uint8_t, 0>(srcPitch);
+
+    // The taps only grow, so the macropixels whose taps the SIMD versions can
+    // load without reading past the row come first.
+    int safe = dstWidth / 2;
+    while (safe > 0 && (lumaTaps[safe * 2 - 1].idx * 2 + 4 > srcPitch ||
+                        chromaTaps[safe - 1].idx * 4 + 8 > srcPitch))
+        --safe;
+
+    for (int y = 0; y < dstHeight; ++y) {
+        const uint8_t *r0 = src + rows[y].idx * srcPitch;
+        const uint8_t *in = r0;
+        if (rows[y].w != 0) {
+            Rows::blend(r0, r0 + srcPitch, row.data(), srcPitch, rows[y].w);
+            in = row.data();
+        }
+
+        uint8_t *out = dst + y * dstPitch;
+        Rows::lerp(in, lumaTaps.data(), chromaTaps.data(), out, safe);
+        ScalarScaleRows::lerp(in, lumaTaps.data() + safe * 2,
+                              chromaTaps.data() + safe, out + safe * 4,
+                              dstWidth / 2 - safe);
+    }
+}
+
+// Bilinear scaling for arbitrary sizes. Luma is interpolated over the full
+// width and chroma over the macropixel grid.
+void scaleYuyvBilinear(const uint8_t *src, int srcWidth, int srcHeight,
+                       uint8_t *dst, int dstWidth, int dstHeight,
+                       SimdLevel level = simdLevel()) {
+    checkYuyvDimensions(srcWidth, srcHeight, dstWidth, dstHeight);
+
+    switch (level) {
+#ifdef __x86_64__
+    case SimdLevel::AVX2:
+        return bilinearRows<Avx2ScaleRows>(src, srcWidth, srcHeight, dst,
+                                           dstWidth, dstHeight);
+    case SimdLevel::SSE2:
+        return bilinearRows<Sse2ScaleRows>(src, srcWidth, srcHeight, dst,
+                                           dstWidth, dstHeight);
+#endif
+    default:
+        return bilinearRows<ScalarScaleRows>(src, srcWidth, srcHeight, dst,
+                                             dstWidth, dstHeight);
+    }
+}
+
+// Scales a YUYV image, using the cheaper box filter when the scaling factors
+// are integers and bilinear interpolation otherwise.
+void scaleYuyv(const uint8_t *src, int srcWidth, int srcHeight, uint8_t *dst,
+               int dstWidth, int dstHeight, SimdLevel level = simdLevel()) {
+    checkYuyvDimensions(srcWidth, srcHeight, dstWidth, dstHeight);
+    if (srcWidth % dstWidth == 0 && srcHeight % dstHeight == 0 &&
+        (srcWidth / dstWidth) * (srcHeight / dstHeight) <= 256) {
+        scaleYuyvBox(src, srcWidth, srcHeight, dst, dstWidth, dstHeight,
+                     level);
+    } else {
+        scaleYuyvBilinear(src, srcWidth, srcHeight, dst, dstWidth, dstHeight,
+                          level);
+    }
+}
+
+// Copies a row of bytes. The stores are aligned to 16 bytes after copying the
+// first few bytes separately, since the destination is usually a contiguous
+// buffer while the source row starts anywhere in the frame.
+void copyRow(const uint8_t *src, uint8_t *dst, size_t size) {
+    size_t i = 0;
+#ifdef __SSE2__
+    size_t head = (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15;
+    if (head > size)
+        head = size;
+    std::memcpy(dst, src, head);
+    i = head;
+    for (; i + 64 <= size; i += 64) {
+        const __m128i *s = reinterpret_cast<const __m128i *>(src + i);
+        __m128i *d = reinterpret_cast<__m128i *>(dst + i);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        __m128i c = _mm_loadu_si128(s + 2);
+        __m128i e = _mm_loadu_si128(s + 3);
+        _mm_store_si128(d, a);
+        _mm_store_si128(d + 1, b);
+        _mm_store_si128(d + 2, c);
+        _mm_store_si128(d + 3, e);
+    }
+    for (; i + 16 <= size; i += 16) {
+        _mm_store_si128(
+            reinterpret_cast<__m128i *>(dst + i),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+    }
+#endif
+    std::memcpy(dst + i, src + i, size - i);
+}
+
+// Copies the width x height region at (x, y) of a YUYV image, keeping its
+// resolution. x and width have to be even, as two pixels share chroma.
+void cropYuyv(const uint8_t *src, int srcWidth, int srcHeight, int x, int y,
+              int width, int height, uint8_t *dst) {
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        x + width > srcWidth || y + height > srcHeight)
+        throw std::invalid_argument("Crop region is outside of the image");
+    if (x % 2 || width % 2)
+        throw std::invalid_argument("Crop region is not aligned to the YUYV "
+                                    "macropixels");
+
+    const size_t srcPitch = static_cast<size_t>(srcWidth) * 2;
+    const size_t dstPitch = static_cast<size_t>(width) * 2;
+    const uint8_t *in = src + static_cast<size_t>(y) * srcPitch + x * 2;
+    for (int row = 0; row < height; ++row)
+        copyRow(in + row * srcPitch, dst + row * dstPitch, dstPitch);
+}
+
+// Rotates rows [rowBegin, rowEnd) of a packed 4:2:2 image 180 degrees into
+// dst, i.e. to rows height - rowEnd up to height - rowBegin. The two luma
+// samples of a macropixel swap places while the shared chroma samples stay.
+// LumaOffset is the position of the first luma sample in a macropixel, 0 for
+// YUYV and 1 for UYVY.
+template <int LumaOffset>
+void flipPacked422(const uint8_t *src, uint8_t *dst, int width, int height,
+                   int rowBegin, int rowEnd) {
+    constexpr int Y0 = LumaOffset;
+    constexpr int C0 = 1 - LumaOffset;
+    const size_t pitch = static_cast<size_t>(width) * 2;
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        const uint8_t *in = src + pitch * y;
+        uint8_t *out = dst + pitch * (height - 1 - y);
+        for (int x = 0; x < width; x += 2) {
+            const uint8_t *s = in + x * 2;
+            uint8_t *d = out + (width - 2 - x) * 2;
+            d[Y0] = s[Y0 + 2];
+            d[C0] = s[C0];
+            d[Y0 + 2] = s[Y0];
+            d[C0 + 2] = s[C0 + 2];
+        }
+    }
+}
+
+void flipYuyv(const uint8_t *src, uint8_t *dst, int width, int height,
+              int rowBegin, int rowEnd) {
+    flipPacked422<0>(src, dst, width, height, rowBegin, rowEnd);
+}
+
+void flipUyvy(const uint8_t *src, uint8_t *dst, int width, int height,
+              int rowBegin, int rowEnd) {
+    flipPacked422<1>(src, dst, width, height, rowBegin, rowEnd);
+}
@@ -1,15 +1,26 @@
 #pragma once
 
+#include "convert.hpp"
+#include "frame-mailbox.hpp"
+#include "perf-counters.hpp"
+#include "realtime.hpp"
+#include "scaler.hpp"
+#include "thread-pool.hpp"
 #include "utils.hpp"
 #include "video-stream.hpp"
 
 #include "v4l-stream.hpp" // FOR V4L2_PIX_FMT.
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
+#include <thread>
 
 void sdlError(std::string msg) {
     std::string sdlErrorMsg(SDL_GetError());
@@ -29,6 +40,86 @@ void initSDL() {
     }
 }
 
+// SDL texture format that frames of a pixel format are uploaded to.
+template <typename Traits> constexpr uint32_t sdlTextureFormat() {
+    constexpr int format = Traits::format;
+    if constexpr (format == V4L2_PIX_FMT_YUYV)
+        return SDL_PIXELFORMAT_YUY2;
+    else if constexpr (format == V4L2_PIX_FMT_UYVY)
+        return SDL_PIXELFORMAT_UYVY;
+    else if constexpr (format == V4L2_PIX_FMT_NV12)
+        return SDL_PIXELFORMAT_NV12;
+    else if constexpr (format == V4L2_PIX_FMT_YUV420 ||
+                       format == V4L2_PIX_FMT_GREY)
+        return SDL_PIXELFORMAT_IYUV;
+    else // RGB24, and MJPEG which is decoded to RGB24.
+        return SDL_PIXELFORMAT_RGB24;
+}
+
+uint32_t toSdlFormat(int format) {
+    return visitFormat(format, [](auto traits) {
+        return sdlTextureFormat<decltype(traits)>();
+    });
+}
+
+bool supportsTextureFormat(SDL_Renderer *ren, uint32_t format) {
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(ren, &info))
+        sdlError("SDL_GetRendererInfo");
+    for (uint32_t i = 0; i < info.num_texture_formats; ++i) {
+        if (info.texture_formats[i] == format)
+            return true;
+    }
+    return false;
+}
+
+// Picks the format to upload frames in. YUV frames are converted to another YUV
+// format if the renderer does not support theirs natively but does support the
+// other one, since SDL would otherwise convert them in software on every
+// upload.
+int chooseUploadFormat(SDL_Renderer *ren, int format) {
+    if (format == V4L2_PIX_FMT_GREY || format == V4L2_PIX_FMT_RGB24 ||
+        format == V4L2_PIX_FMT_MJPEG ||
+        supportsTextureFormat(ren, toSdlFormat(format)))
+        return format;
+
+    for (int candidate : {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY,
+                          V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420}) {
+        if (convertKernel(format, candidate) != nullptr &&
+            supportsTextureFormat(ren, toSdlFormat(candidate)))
+            return candidate;
+    }
+    return format;
+}
+
+// Uploads an uncompressed frame in the format described by Traits to rect of
+// texture. GREY frames are shown with a neutral chroma plane, greyChroma, of a
+// quarter of the frame's size.
+template <typename Traits>
+void uploadTexture(SDL_Texture *texture, const SDL_Rect &rect,
+                   const uint8_t *data, const uint8_t *greyChroma) {
+    static_assert(!Traits::compressed, "Compressed frames are decoded first");
+    const int w = rect.w;
+    const int h = rect.h;
+    int ret = 0;
+    if constexpr (Traits::format == V4L2_PIX_FMT_YUV420) {
+        const uint8_t *u = data + w * h;
+        const uint8_t *v = u + (w / 2) * (h / 2);
+        ret = SDL_UpdateYUVTexture(texture, &rect, data, w, u, w / 2, v, w / 2);
+    } else if constexpr (Traits::format == V4L2_PIX_FMT_GREY) {
+        ret = SDL_UpdateYUVTexture(texture, &rect, data, w, greyChroma, w / 2,
+                                   greyChroma, w / 2);
+    } else {
+        // Packed formats, and NV12 whose UV plane follows the Y plane with the
+        // same pitch.
+        ret = SDL_UpdateTexture(texture, &rect, data,
+                                static_cast<int>(Traits::pitch(w)));
+    }
+    if (ret) {
+        sdlError("SDL_UpdateTexture");
+    }
+}
+
 // Window that renders a video stream.
 // NOTE: This class should only be constructed in the main thread because of
 //       how SDL works.
@@ -42,32 +133,63 @@ class SDLWindow {
     SDL_Rect rect_ = {};
     bool quit_ = false;
     std::unique_ptr<VideoStream> videoStream_;
-    int rowPitch_ = 0;
     bool flip_;
+    Buffer flippedBuffer_ = makeBuffer();
+    // Flips rows of a frame, picked for the format of the stream.
+    void (*flipRows_)(const uint8_t *, uint8_t *, int, int, int,
+                      int) = nullptr;
+    // Present the latest frame at every vsync instead of every frame.
+    bool latest_;
+    // Format of the incoming frames, and of what is uploaded to the texture
+    // after converting them.
+    int format_ = 0;
+    int uploadFormat_ = 0;
+    Buffer convertedBuffer_ = makeBuffer();
+    // Uploads a frame in the upload format, upload<Traits>() specialized for
+    // it.
+    void (SDLWindow::*upload_)(const uint8_t *, size_t) = nullptr;
+    // Neutral chroma plane used to show GREY frames with an IYUV texture.
+    Buffer greyChroma_ = makeBuffer();
+    // The window has the size of the stream when it was opened, and the
+    // frames are drawn in view_, keeping their aspect ratio when they are a
+    // cropped region or have been reconfigured to another size.
+    int windowWidth_ = 0;
+    int windowHeight_ = 0;
+    SDL_Rect view_ = {};
+    // Size of the full frames of the stream.
+    int streamWidth_ = 0;
+    int streamHeight_ = 0;
+    // Region of the stream being shown, selected with the mouse.
+    Region crop_ = {};
+    // Configuration asked of the stream with the keyboard, until its first
+    // frame arrives.
+    struct Config {
+        int width;
+        int height;
+        int format;
+        int quality;
+    };
+    std::optional<Config> reconfiguring_;
+    // The last configuration asked for, and the uncompressed format that
+    // 0 goes back to.
+    Config config_ = {};
+    int rawFormat_ = V4L2_PIX_FMT_YUYV;
+    bool selecting_ = false;
+    SDL_Rect selection_ = {};
 
-    void flipBuffer(uint8_t *srcBuffer, uint8_t *dstBuffer) {
+    void flipBuffer(const uint8_t *srcBuffer, uint8_t *dstBuffer) {
         TIMER("Flipping image");
-        for (int y = 0; y < rect_.h; ++y) {
-            for (int x = 0; x < rect_.w; x += 2) {
-                uint8_t *srcY1 = srcBuffer + x * 2 + rowPitch_ * y;
-                uint8_t *srcY2 = srcBuffer + (x + 1) * 2 + rowPitch_ * y;
-                uint8_t *dstY1 = dstBuffer + (rect_.w - 1 - x) * 2 +
-                                 rowPitch_ * (rect_.h - 1 - y);
-                uint8_t *dstY2 = dstBuffer + (rect_.w - 1 - (x + 1)) * 2 +
-                                 rowPitch_ * (rect_.h - 1 - y);
-
-                *dstY1 = *srcY1;
-                *dstY2 = *srcY2;
-                *(dstY1 + 1) = *(srcY2 + 1);
-                *(dstY2 + 1) = *(srcY1 + 1);
-            }
-        }
+        StageScope stage(Stage::FLIP);
+        ThreadPool::shared().parallelRows(rect_.h, [&](int begin, int end) {
+            flipRows_(srcBuffer, dstBuffer, rect_.w, rect_.h, begin, end);
+        });
     }
 
   public:
     SDLWindow(const std::string &name, std::unique_ptr<VideoStream> &stream,
-              bool flip = false)
-        : name_(name), videoStream_(std::move(stream)), flip_(flip) {
+              bool flip = false, bool latest = false)
+        : name_(name), videoStream_(std::move(stream)), flip_(flip),
+          latest_(latest) {
         initSDL();
 
         auto [width, height, format] = videoStream_->getMetaData();
@@ -84,40 +206,179 @@ class SDLWindow {
             sdlError("SDL_CreateRenderer");
         }
 
-        int pixelFormat = 0;
-        if (format == V4L2_PIX_FMT_MJPEG) {
-            pixelFormat = SDL_PIXELFORMAT_RGB24;
-        } else if (format == V4L2_PIX_FMT_YUYV) {
-            pixelFormat = SDL_PIXELFORMAT_YUY2;
-        } else {
-            throw std::invalid_argument("Unknown format of video stream");
+        setFormat(format);
+        config_ = {width, height, format, videoStream_->quality()};
+        if (!isCompressed(format))
+            rawFormat_ = format;
+
+        windowWidth_ = width;
+        windowHeight_ = height;
+        streamWidth_ = width;
+        streamHeight_ = height;
+        crop_ = {0, 0, width, height};
+        resizeTexture(width, height);
+    }
+
+    ~SDLWindow() {
+        if (texture_ != nullptr)
+            SDL_DestroyTexture(texture_);
+    }
+
+    // Sets up how frames of format are uploaded, after which the texture has
+    // to be recreated.
+    void setFormat(int format) {
+        format_ = format;
+        uploadFormat_ = chooseUploadFormat(ren_, format);
+        if (uploadFormat_ != format_) {
+            std::cout << "Converting " << formatToString(format_)
+                      << " frames to " << formatToString(uploadFormat_)
+                      << " (" << simdLevelToString(simdLevel()) << ")\n";
+        }
+        visitFormat(uploadFormat_, [this](auto traits) {
+            upload_ = &SDLWindow::upload<decltype(traits)>;
+        });
+        flipRows_ = nullptr;
+        if (flip_) {
+            if (format_ == V4L2_PIX_FMT_YUYV)
+                flipRows_ = flipYuyv;
+            else if (format_ == V4L2_PIX_FMT_UYVY)
+                flipRows_ = flipUyvy;
+            else
+                std::cerr << "WARNING: Flipping is only supported for yuyv "
+                             "and uyvy\n";
         }
-        texture_ = SDL_CreateTexture(
-            ren_, pixelFormat, SDL_TEXTUREACCESS_STREAMING, width, height);
+    }
+
+    // (Re)creates the texture for frames of the given size.
+    void resizeTexture(int width, int height) {
+        if (texture_ != nullptr)
+            SDL_DestroyTexture(texture_);
+        texture_ = SDL_CreateTexture(ren_, toSdlFormat(uploadFormat_),
+                                     SDL_TEXTUREACCESS_STREAMING, width,
+                                     height);
         if (texture_ == nullptr) {
             sdlError("SDL_CreateTexture");
         }
 
         rect_.w = width;
         rect_.h = height;
-        rowPitch_ = rect_.w * 2;
+        if (uploadFormat_ != format_)
+            convertedBuffer_.resize(frameSize(uploadFormat_, width, height));
+        if (format_ == V4L2_PIX_FMT_GREY)
+            greyChroma_.assign(static_cast<size_t>(width / 2) * (height / 2),
+                               128);
+
+        // Fit the frame in the window.
+        const double scale =
+            std::min(static_cast<double>(windowWidth_) / width,
+                     static_cast<double>(windowHeight_) / height);
+        view_.w = static_cast<int>(width * scale + 0.5);
+        view_.h = static_cast<int>(height * scale + 0.5);
+        view_.x = (windowWidth_ - view_.w) / 2;
+        view_.y = (windowHeight_ - view_.h) / 2;
     }
 
-    void updateTexture(void *buffer) {
+    // Uploads a frame in the format described by Traits to the texture.
+    template <typename Traits> void upload(const uint8_t *data, size_t size) {
         TIMER("Updating texture");
-        if (SDL_UpdateTexture(texture_, &rect_, buffer, rowPitch_)) {
-            sdlError("SDL_UpdateTexture");
+        if constexpr (Traits::compressed) {
+            updateJpegTexture(data, size);
+        } else {
+            StageScope stage(Stage::TEXTURE);
+            uploadTexture<Traits>(texture_, rect_, data, greyChroma_.data());
         }
     }
 
-    void render() {
+    void draw() {
         if (SDL_RenderClear(ren_))
             sdlError("SDL_RenderClear");
-        if (SDL_RenderCopy(ren_, texture_, NULL, &rect_))
+        if (SDL_RenderCopy(ren_, texture_, NULL, &view_))
             sdlError("SDL_RenderCopy");
+        if (selecting_) {
+            SDL_SetRenderDrawColor(ren_, 255, 255, 0, 255);
+            SDL_RenderDrawRect(ren_, &selection_);
+            SDL_SetRenderDrawColor(ren_, 0, 0, 0, 255);
+        }
+    }
+
+    void render() {
+        draw();
         SDL_RenderPresent(ren_);
     }
 
+    // Asks the stream for the region of the current view that has been
+    // selected in the window, or for the full stream if region is null.
+    void selectRegion(const SDL_Rect *region) {
+        Region wanted = {0, 0, streamWidth_, streamHeight_};
+        if (region != nullptr) {
+            const int x0 = std::clamp(region->x, view_.x, view_.x + view_.w);
+            const int x1 = std::clamp(region->x + region->w, view_.x,
+                                      view_.x + view_.w);
+            const int y0 = std::clamp(region->y, view_.y, view_.y + view_.h);
+            const int y1 = std::clamp(region->y + region->h, view_.y,
+                                      view_.y + view_.h);
+            wanted.x = crop_.x + (x0 - view_.x) * crop_.width / view_.w;
+            wanted.y = crop_.y + (y0 - view_.y) * crop_.height / view_.h;
+            wanted.width = (x1 - x0) * crop_.width / view_.w;
+            wanted.height = (y1 - y0) * crop_.height / view_.h;
+            if (wanted.width < 2 || wanted.height < 2)
+                return;
+        }
+
+        if (videoStream_->crop(region != nullptr ? wanted : Region{}))
+            crop_ = wanted;
+        else
+            std::cerr << "WARNING: The video stream can not be cropped\n";
+    }
+
+    // Asks the stream to switch to config, which is done when its first
+    // frame arrives.
+    void reconfigure(const Config &config) {
+        if (config.width < 16 || config.height < 16) {
+            std::cerr << "WARNING: Too small resolution\n";
+            return;
+        }
+        if (!videoStream_->reconfigure(config.width, config.height,
+                                       config.format, config.quality)) {
+            std::cerr << "WARNING: The video stream can not be "
+                         "reconfigured\n";
+            return;
+        }
+        config_ = config;
+        reconfiguring_ = config;
+        std::cout << "Switching to " << formatToString(config.format)
+                  << " of " << config.width << "x" << config.height;
+        if (config.quality > 0)
+            std::cout << " with quality " << config.quality;
+        std::cout << std::endl;
+    }
+
+    // Keys 1 to 9 switch to MJPEG encoded with a quality of 10 to 90, 0 to
+    // uncompressed frames, and + and - double and halve the resolution.
+    void handleKey(SDL_Keycode key) {
+        Config config = config_;
+        if (key >= SDLK_1 && key <= SDLK_9) {
+            config.format = V4L2_PIX_FMT_MJPEG;
+            config.quality = static_cast<int>(key - SDLK_0) * 10;
+        } else if (key == SDLK_0) {
+            config.format = rawFormat_;
+            config.quality = 0;
+        } else if (key == SDLK_PLUS || key == SDLK_EQUALS ||
+                   key == SDLK_KP_PLUS) {
+            config.width *= 2;
+            config.height *= 2;
+        } else if (key == SDLK_MINUS || key == SDLK_KP_MINUS) {
+            // Even, for the chroma of YUV formats.
+            config.width = config.width / 4 * 2;
+            config.height = config.height / 4 * 2;
+        } else {
+            return;
+        }
+        reconfigure(config);
+    }
+
+    // Dragging with the left mouse button zooms in on a region, and the right
+    // button zooms out again.
     void pollEvents() {
         SDL_Event event;
 
@@ -126,6 +387,33 @@ class SDLWindow {
             case SDL_KEYDOWN:
                 if (event.key.keysym.sym == SDLK_ESCAPE) {
                     quit_ = true;
+                } else {
+                    handleKey(event.key.keysym.sym);
+                }
+                break;
+            case SDL_MOUSEBUTTONDOWN:
+                if (event.button.button == SDL_BUTTON_LEFT) {
+                    selecting_ = true;
+                    selection_ = {event.button.x, event.button.y, 0, 0};
+                } else if (event.button.button == SDL_BUTTON_RIGHT) {
+                    selectRegion(nullptr);
+                }
+                break;
+            case SDL_MOUSEMOTION:
+                if (selecting_) {
+                    selection_.w = event.motion.x - selection_.x;
+                    selection_.h = event.motion.y - selection_.y;
+                }
+                break;
+            case SDL_MOUSEBUTTONUP:
+                if (selecting_ && event.button.button == SDL_BUTTON_LEFT) {
+                    selecting_ = false;
+                    SDL_Rect region = {
+                        std::min(selection_.x, event.button.x),
+                        std::min(selection_.y, event.button.y),
+                        std::abs(event.button.x - selection_.x),
+                        std::abs(event.button.y - selection_.y)};
+                    selectRegion(&region);
                 }
                 break;
             case SDL_QUIT:
@@ -135,51 +423,198 @@ class SDLWindow {
         }
     }
 
-    void jpegTemp(void *data, int size) {
+  private:
+    void updateJpegTexture(const uint8_t *data, size_t size) {
         // Create a stream based on our buffer.
-        SDL_RWops *buffer_stream = SDL_RWFromMem(data, size);
+        SDL_RWops *buffer_stream =
+            SDL_RWFromConstMem(data, static_cast<int>(size));
         if (!buffer_stream) {
-            sdlError("SDL_RWFromMem");
+            sdlError("SDL_RWFromConstMem");
         }
 
         // Create a surface using the data coming out of the above stream.
-        SDL_Surface *frame = IMG_Load_RW(buffer_stream, 0);
+        SDL_Surface *frame;
+        {
+            StageScope stage(Stage::DECODE);
+            frame = IMG_Load_RW(buffer_stream, 1);
+        }
         if (!frame) {
             sdlError("IMG_LOAD_RW");
         }
-        if (SDL_UpdateTexture(texture_, NULL, frame->pixels, frame->pitch)) {
+        int ret;
+        {
+            StageScope stage(Stage::TEXTURE);
+            ret = SDL_UpdateTexture(texture_, NULL, frame->pixels,
+                                    frame->pitch);
+        }
+        SDL_FreeSurface(frame);
+        if (ret) {
             sdlError("UpdateTexture");
         }
-        if (SDL_RenderClear(ren_))
-            sdlError("SDL_RenderClear");
-        if (SDL_RenderCopy(ren_, texture_, NULL, NULL))
-            sdlError("SDL_RenderCopy");
-        SDL_RenderPresent(ren_);
     }
 
-    void run() {
-        std::vector<uint8_t> flippedBuffer;
-        videoStream_->update();
-        videoStream_->update();
-        auto [x, y, format] = videoStream_->getMetaData(); // TODO: Fix unused.
+    // Uploads a frame to the texture, flipping and converting it first if
+    // needed. A frame of a new configuration starts showing the full frames
+    // of it.
+    void updateFrame(const uint8_t *buffer, size_t bufferSize, int width,
+                     int height, int format) {
+        if (reconfiguring_ && reconfiguring_->width == width &&
+            reconfiguring_->height == height &&
+            reconfiguring_->format == format) {
+            streamWidth_ = width;
+            streamHeight_ = height;
+            crop_ = {0, 0, width, height};
+            reconfiguring_.reset();
+        }
+        if (format != format_) {
+            setFormat(format);
+            resizeTexture(width, height);
+        } else if (width != rect_.w || height != rect_.h) {
+            resizeTexture(width, height);
+        }
+        if (flipRows_ != nullptr) {
+            flippedBuffer_.resize(bufferSize);
+            flipBuffer(buffer, flippedBuffer_.data());
+            buffer = flippedBuffer_.data();
+        }
+        if (uploadFormat_ != format_) {
+            convertFrame(format_, uploadFormat_, buffer,
+                         convertedBuffer_.data(), rect_.w, rect_.h);
+            buffer = convertedBuffer_.data();
+            bufferSize = convertedBuffer_.size();
+        }
+        (this->*upload_)(buffer, bufferSize);
+    }
+
+    std::chrono::steady_clock::duration refreshPeriod() const {
+        int rate = 60;
+        SDL_DisplayMode mode = {};
+        if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(win_.get()),
+                                      &mode) == 0 &&
+            mode.refresh_rate > 0)
+            rate = mode.refresh_rate;
+        return std::chrono::steady_clock::duration(std::chrono::seconds(1)) /
+               rate;
+    }
+
+    // Shows every frame of the stream, which makes reading the stream wait for
+    // vsync.
+    void runEveryFrame() {
         while (!quit_) {
             TIMER("One frame");
 
             pollEvents();
             videoStream_->update();
-            uint8_t *buffer = static_cast<uint8_t *>(videoStream_->getBuffer());
-            int bufferSize = static_cast<int>(videoStream_->getBufferSize());
-            if (flip_) {
-                flippedBuffer.resize(bufferSize);
-                flipBuffer(buffer, flippedBuffer.data());
-                buffer = flippedBuffer.data();
+            auto [width, height, format] = videoStream_->getMetaData();
+            updateFrame(static_cast<uint8_t *>(videoStream_->getBuffer()),
+                        videoStream_->getBufferSize(), width, height, format);
+            render();
+        }
+    }
+
+    // Reads the stream in another thread into a mailbox, and presents the
+    // latest frame in it at every vsync. Frames arriving faster than the
+    // display are skipped, and the last frame is repeated when no new one has
+    // arrived, so the display lags the stream as little as possible.
+    void runLatest() {
+        using Clock = std::chrono::steady_clock;
+        // Slack for waking up before the frame has to be ready.
+        constexpr auto VSYNC_MARGIN = std::chrono::milliseconds(2);
+
+        FrameMailbox mailbox;
+        std::atomic<bool> stop = false;
+        std::thread reader([&] {
+            ThreadPlacer::shared().place(ThreadRole::NETWORK);
+            try {
+                while (!stop) {
+                    videoStream_->update();
+                    auto [width, height, format] = videoStream_->getMetaData();
+                    mailbox.put(videoStream_->getBuffer(),
+                                videoStream_->getBufferSize(), width, height,
+                                format);
+                }
+                mailbox.close();
+            } catch (...) {
+                mailbox.close(stop ? nullptr : std::current_exception());
             }
-            if (format == V4L2_PIX_FMT_MJPEG) {
-                jpegTemp(buffer, bufferSize);
-            } else {
-                updateTexture(static_cast<void *>(buffer));
-                render();
+        });
+        auto stopReader = [&] {
+            stop = true;
+            videoStream_->interrupt();
+            reader.join();
+        };
+
+        const Clock::duration period = refreshPeriod();
+        // Moving average of the time from taking a frame until it has been
+        // rendered, so that the frame can be taken as late as possible.
+        Clock::duration prepareTime = Clock::duration::zero();
+        Clock::time_point nextVsync = Clock::now() + period;
+        Clock::duration totalAge = Clock::duration::zero();
+        uint64_t presented = 0;
+        uint64_t skipped = 0;
+        uint64_t repeated = 0;
+        FrameMailbox::Frame frame;
+        try {
+            while (!quit_ && !mailbox.closed()) {
+                pollEvents();
+                const Clock::time_point wakeup =
+                    nextVsync - prepareTime - VSYNC_MARGIN;
+                std::this_thread::sleep_until(wakeup);
+
+                const Clock::time_point start = Clock::now();
+                if (start > wakeup)
+                    ThreadPlacer::shared()
+                        .wakeups(ThreadRole::RENDER)
+                        .record(start - wakeup);
+                const int64_t replaced = mailbox.take(frame);
+                if (replaced >= 0) {
+                    TIMER("Updating frame");
+                    skipped += static_cast<uint64_t>(replaced);
+                    updateFrame(frame.data.data(), frame.data.size(),
+                                frame.width, frame.height, frame.format);
+                } else if (frame.sequence == 0) {
+                    // Nothing to show yet.
+                    nextVsync += period;
+                    continue;
+                } else {
+                    ++repeated;
+                }
+                draw();
+                prepareTime = (prepareTime * 7 + (Clock::now() - start)) / 8;
+
+                // Blocks until vsync. The next one is expected a period
+                // later, which also paces the loop if the renderer does not
+                // wait for vsync.
+                SDL_RenderPresent(ren_);
+                const Clock::time_point now = Clock::now();
+                nextVsync = now + period;
+                if (replaced >= 0) {
+                    ++presented;
+                    totalAge += now - frame.arrival;
+                }
             }
+        } catch (...) {
+            stopReader();
+            throw;
         }
+        stopReader();
+
+        const double averageAge =
+            presented == 0
+                ? 0.0
+                : std::chrono::duration<double, std::milli>(totalAge).count() /
+                      static_cast<double>(presented);
+        std::cout << "Presented " << presented << " frames, skipped "
+                  << skipped << ", repeated " << repeated
+                  << ", average frame age at present " << averageAge
+                  << " ms\n";
+    }
+
+  public:
+    void run() {
+        if (latest_)
+            runLatest();
+        else
+            runEveryFrame();
     }
 };
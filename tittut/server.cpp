@@ -1,11 +1,120 @@
 #include "argparser.hpp"
+#include "tcp-stream.hpp"
+#include "test-pattern-stream.hpp"
 #include "video-server.hpp"
 
 int main(int argc, const char *argv[]) {
     ArgParser parser("Tittut server");
     parser.description("Streaming application using Video4Linux and SDL2.");
+    parser.addArg("port").optional("-p").defaultValue(4097).description(
+        "Port to listen on.");
+    parser.addArg("threshold").optional("-s").defaultValue(12).description(
+        "Motion sensitivity, as the mean luma difference of a changed block.");
+    parser.addArg("blocks").optional("-b").defaultValue(2).description(
+        "Number of changed 16x16 blocks needed for motion.");
+    parser.addArg("mask").optional("-k").defaultValue("").description(
+        "Regions ignored by motion detection, \"x,y,w,h;x,y,w,h\".");
+    parser.addArg("preroll").optional("-r").defaultValue(1000).description(
+        "Milliseconds of frames sent from before motion started.");
+    parser.addArg("postroll").optional("-o").defaultValue(2000).description(
+        "Milliseconds of frames sent after motion stopped.");
+    parser.addArg("idle").optional("-i").defaultValue(10000).description(
+        "Milliseconds the camera is kept open after the last client left.");
+    parser.addArg("pattern").optional("-t").defaultValue(false).description(
+        "Serve a test pattern instead of the camera.");
+    parser.addArg("upstream").optional("-u").defaultValue("").description(
+        "Relay the stream of another server, given as ip:port, instead of "
+        "capturing.");
+    parser.addArg("stats").optional("-a").defaultValue(0).description(
+        "Seconds between printing frame rates, drops and latency, 0 for "
+        "never.");
+    parser.addArg("latency").optional("-l").defaultValue(false).description(
+        "Send only the newest frame once a client has taken the previous "
+        "one, instead of queueing frames in its socket.");
+    parser.addArg("hugepages").optional("-g").defaultValue(false).description(
+        "Back frame buffers with transparent huge pages.");
+    parser.addArg("memory").optional("-m").defaultValue("auto").description(
+        "What the camera captures into: auto, mmap or userptr (straight into "
+        "the frame buffers).");
+    parser.addArg("threads").optional("-A").defaultValue("").description(
+        "Cores and SCHED_FIFO priorities of the threads, e.g. "
+        "\"capture=2:50;network=3\".");
+    parser.addArg("lock").optional("-L").defaultValue(false).description(
+        "Lock all memory, including frame buffers, in RAM.");
+    parser.addArg("perf").optional("-P").defaultValue(false).description(
+        "Count cycles, instructions, cache misses and context switches per "
+        "pipeline stage, printed with -a and on SIGUSR1.");
+    parser.addArg("timeshift").optional("-w").defaultValue(0).description(
+        "Seconds of frames kept for clients to rewind to, 0 for none.");
+    parser.addArg("timeshiftmb").optional("-M").defaultValue(512).description(
+        "Megabytes that the frames kept for rewinding may take.");
+    parser.addArg("timeshiftwidth").optional("-W").defaultValue(1280)
+        .description("Width of the frames kept for rewinding.");
+    parser.addArg("timeshiftheight").optional("-H").defaultValue(720)
+        .description("Height of the frames kept for rewinding.");
+    parser.addArg("timeshiftquality").optional("-j").defaultValue(0)
+        .description("Keep the frames for rewinding as MJPEG of this quality, "
+                     "0 to keep them as captured.");
+    parser.addArg("budget").optional("-B").defaultValue(0).description(
+        "Mbit/s that all clients may get together, 0 for no limit.");
+    parser.addArg("weights").optional("-e").defaultValue("").description(
+        "Shares of the bandwidth per client ip, \"ip=weight,ip=weight\", "
+        "others have weight 1.");
+    parser.addArg("budgetfps").optional("-f").defaultValue(30).description(
+        "Frame rate that a client's stream is expected to take bandwidth "
+        "for.");
     parser.parse(argc, argv);
 
-    VideoServer server(4097);
+    BufferPool::shared().useHugePages(parser.get<bool>("hugepages"));
+    ThreadPlacer::shared().configure(parser.get<std::string>("threads"));
+    if (parser.get<bool>("lock"))
+        lockMemory();
+    PerfCounters::shared().enable(parser.get<bool>("perf"));
+    PerfCounters::shared().printOnSignal(SIGUSR1);
+
+    CaptureConfig cfg;
+    cfg.motion.threshold = parser.get<int>("threshold");
+    cfg.motion.minBlocks = parser.get<int>("blocks");
+    cfg.motion.masks = parseRegions(parser.get<std::string>("mask"));
+    cfg.motion.preRollMs = parser.get<int>("preroll");
+    cfg.motion.postRollMs = parser.get<int>("postroll");
+    cfg.idleTimeoutMs = parser.get<int>("idle");
+    cfg.statsIntervalS = parser.get<int>("stats");
+    cfg.captureMemory =
+        captureMemoryFromString(parser.get<std::string>("memory"));
+    const std::string upstream = parser.get<std::string>("upstream");
+    if (!upstream.empty()) {
+        auto endpoints = parseEndpoints(upstream);
+        if (endpoints.size() != 1)
+            throw std::invalid_argument("Give one upstream server");
+        const std::string ip = endpoints.front().first;
+        const int port = endpoints.front().second;
+        // Frames are passed on as they are, and the upstream server's motion
+        // detection is used.
+        cfg.openStream = [ip, port](int width, int height, int format) {
+            return std::make_unique<TcpStream>(ip, port, width, height,
+                                               format);
+        };
+    } else if (parser.get<bool>("pattern")) {
+        cfg.openStream = [](int width, int height, int format) {
+            return std::make_unique<TestPatternStream>(width, height, format);
+        };
+    }
+
+    TimeShiftConfig timeShift;
+    timeShift.seconds = parser.get<int>("timeshift");
+    timeShift.maxMB = parser.get<int>("timeshiftmb");
+    timeShift.width = parser.get<int>("timeshiftwidth");
+    timeShift.height = parser.get<int>("timeshiftheight");
+    timeShift.quality = parser.get<int>("timeshiftquality");
+
+    EgressConfig egress;
+    egress.budgetMbps = parser.get<int>("budget");
+    egress.weights = parseWeights(parser.get<std::string>("weights"));
+    egress.fps = parser.get<int>("budgetfps");
+    egress.statsIntervalS = cfg.statsIntervalS;
+
+    VideoServer server(parser.get<int>("port"), cfg,
+                       parser.get<bool>("latency"), timeShift, egress);
     server.run();
 }
@@ -1,31 +1,46 @@
 #pragma once
 
-#include "sdl.hpp"
+#include "buffer-pool.hpp"
+#include "event-loop.hpp"
 #include "utils.hpp"
 #include "video-stream.hpp"
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <array>
 #include <assert.h>
+#include <chrono>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <poll.h>
 #include <string>
 #include <string_view>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <tuple>
 #include <unistd.h>
 #include <vector>
 
-// TODO: Endieness has to be the same on each machine.
+// Every package sent over tcp is a header followed by the package data. The
+// header has a fixed size and is in network byte order:
+//   uint32_t magic "TTUT"
+//   uint8_t  protocol version
+//   uint8_t  package type
+//   uint16_t flags
+//   uint32_t stream id
+//   uint32_t sequence number
+//   uint64_t data size
+//
+// Version 1 peers, which have no magic, use a header of two host endian
+// uint64_t, the data size and the type. A server speaks the version that the
+// client started with, while a version 2 client refuses version 1 servers.
 class TcpInterface {
   protected:
-    // The package that is sent over tcp is
-    // uint64_t data size, i.e. data.size() HEADER
-    // uint64_t type                        HEADER
-    // uint8_t data                         BODY
-    // uint8_t ...                          BODY
-    // uint8_t data                         BODY
-    static constexpr size_t HEADER_SIZE = 16;
+    static constexpr size_t HEADER_SIZE = 24;
+    static constexpr size_t V1_HEADER_SIZE = 16;
+    static constexpr uint32_t MAGIC = 0x54545554;
+    static constexpr uint8_t PROTOCOL_VERSION = 2;
 
     enum class PKG_TYPE {
         INVALID = -1,
@@ -33,9 +48,28 @@ class TcpInterface {
         STREAM_CONFIG = 1,
         FRAME = 2,
         TEXT = 3,
-        NUM_TYPES = 4
+        HELLO = 4,
+        CROP = 5,
+        SEEK = 6,
+        NUM_TYPES = 7
     };
 
+    // Flags of a package header.
+    static constexpr uint16_t PKG_FLAG_MOTION = 1; // Frame has motion.
+
+    struct PackageHeader {
+        PKG_TYPE type;
+        uint16_t flags;
+        uint32_t streamId;
+        uint32_t sequence;
+        uint64_t size;
+    };
+
+    // Protocol version spoken with the peer, 0 until the first package.
+    int version_ = 0;
+    // Header of the latest recieved package.
+    PackageHeader header_ = {};
+
     std::string typeToString(const PKG_TYPE &type) const {
         switch (type) {
         case PKG_TYPE::INVALID:
@@ -48,6 +82,12 @@ class TcpInterface {
             return "FRAME";
         case PKG_TYPE::TEXT:
             return "TEXT";
+        case PKG_TYPE::HELLO:
+            return "HELLO";
+        case PKG_TYPE::CROP:
+            return "CROP";
+        case PKG_TYPE::SEEK:
+            return "SEEK";
         case PKG_TYPE::NUM_TYPES:
             return "NUM_TYPES";
         default:
@@ -55,129 +95,329 @@ class TcpInterface {
         }
     }
 
+    // Flags of a stream configuration.
+    static constexpr uint64_t STREAM_MOTION_ONLY = 1; // Frames with motion.
+
+    // Capabilities, advertised by the client in its HELLO and answered with
+    // those the server agrees on in the STREAM_CONFIG.
+    static constexpr uint64_t CAP_MOTION_EVENTS = 1; // TEXT on motion changes.
+    static constexpr uint64_t CAP_CROP = 2;          // CROP packages.
+    static constexpr uint64_t CAP_SEEK = 4;          // SEEK packages.
+    // STREAM_CONFIG from the client while streaming.
+    static constexpr uint64_t CAP_RECONFIGURE = 8;
+
+    // A version 2 client sends its wanted configuration and capabilities in a
+    // HELLO, and the server replies with a STREAM_CONFIG of what it will
+    // stream. Version 1 clients send only width, height, format and flags.
+    // A quality asks the server to encode MJPEG itself, from 1 to 100, and is
+    // 0 in the reply if the server doesn't, or from peers that predate it.
+    // With CAP_RECONFIGURE, the client can send a STREAM_CONFIG while
+    // streaming to switch to another size, format or quality, which the
+    // server answers like the HELLO before the first frame of it.
     struct StreamConfig {
         uint64_t width;
         uint64_t height;
         uint64_t format;
+        uint64_t flags;
+        uint64_t capabilities;
+        uint64_t quality = 0;
     };
 
     struct Package {
         PKG_TYPE type;
-        std::vector<uint8_t> data;
+        Buffer data = makeBuffer();
     };
 
-    void sendPackage(int socket, PKG_TYPE type,
-                     const std::vector<uint8_t> &data) const {
-        std::vector<uint8_t> header;
-        addNumToVec(data.size(), header);
-        addNumToVec(static_cast<size_t>(type), header);
+    // Encodes a header into header and returns its size, which is smaller for
+    // version 1 peers.
+    size_t encodeHeader(PKG_TYPE type, uint64_t size, uint16_t flags,
+                        uint32_t sequence,
+                        std::array<uint8_t, HEADER_SIZE> &header) const {
+        if (version_ == 1) {
+            uint64_t pkgType = static_cast<uint64_t>(type);
+            std::memcpy(header.data(), &size, sizeof(uint64_t));
+            std::memcpy(header.data() + sizeof(uint64_t), &pkgType,
+                        sizeof(uint64_t));
+            return V1_HEADER_SIZE;
+        }
 
-        assert(header.size() == HEADER_SIZE);
+        writeBigEndian(MAGIC, 4, header.data());
+        header[4] = PROTOCOL_VERSION;
+        header[5] = static_cast<uint8_t>(type);
+        writeBigEndian(flags, 2, header.data() + 6);
+        writeBigEndian(0, 4, header.data() + 8); // There is only one stream.
+        writeBigEndian(sequence, 4, header.data() + 12);
+        writeBigEndian(size, 8, header.data() + 16);
+        return HEADER_SIZE;
+    }
 
-        int bytes = send(socket, static_cast<const void *>(header.data()),
-                         HEADER_SIZE, 0);
-        if (bytes < 0) {
-            throw std::runtime_error("Could not send header of package");
+    // Sends the header and the data with a single system call, and nothing is
+    // allocated on the way. Waits for room if the socket is non-blocking, for
+    // packages sent from outside of its event loop.
+    void sendPackage(int socket, PKG_TYPE type, const void *data, size_t size,
+                     uint16_t flags = 0, uint32_t sequence = 0) const {
+        std::array<uint8_t, HEADER_SIZE> header;
+        const size_t headerSize =
+            encodeHeader(type, size, flags, sequence, header);
+
+        iovec iov[2] = {{header.data(), headerSize},
+                        {const_cast<void *>(data), size}};
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        while (msg.msg_iovlen > 0) {
+            ssize_t bytes = sendmsg(socket, &msg, MSG_NOSIGNAL);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                waitFor(socket, POLLOUT);
+                continue;
+            }
+            if (bytes < 0) {
+                throw std::runtime_error(
+                    std::string("Could not send package: ") +
+                    strerror(errno));
+            }
+
+            // Skip what was sent, in case the socket took only a part.
+            skipSent(msg, static_cast<size_t>(bytes));
         }
 
-        bytes = send(socket, static_cast<const void *>(data.data()),
-                     data.size(), 0);
-        if (bytes < 0) {
-            throw std::runtime_error("Could not send data of package");
-        }
+        LOG(std::string("Sent ") + typeToString(type) +
+            " package with data size " + std::to_string(size));
+    }
 
-        LOG(std::string("Sent ") + std::to_string(bytes) +
-            " data with data size " + std::to_string(data.size()));
+    void sendMsg(int socket, std::string_view msg) const {
+        LOG(std::string("Sending msg \"") + std::string(msg) +
+            "\", data.size=" + std::to_string(msg.size()));
+        sendPackage(socket, PKG_TYPE::TEXT, msg.data(), msg.size());
     }
 
-    void sendBuffer(int socket, const void *buffer, size_t bufferSize) const {
-        std::vector<uint8_t> header;
-        addNumToVec(bufferSize, header);
-        addNumToVec(static_cast<size_t>(PKG_TYPE::FRAME), header);
+    // The same from a coroutine of the socket's event loop, which is
+    // suspended while the socket is full.
+    Task<> sendPackage(AsyncSocket &socket, PKG_TYPE type, const void *data,
+                       size_t size, uint16_t flags = 0,
+                       uint32_t sequence = 0) const {
+        std::array<uint8_t, HEADER_SIZE> header;
+        const size_t headerSize =
+            encodeHeader(type, size, flags, sequence, header);
+
+        iovec iov[2] = {{header.data(), headerSize},
+                        {const_cast<void *>(data), size}};
+        co_await socket.write(iov, 2);
+
+        LOG(std::string("Sent ") + typeToString(type) +
+            " package with data size " + std::to_string(size));
+    }
 
-        assert(header.size() == HEADER_SIZE);
+    Task<> sendFrame(AsyncSocket &socket, const void *buffer,
+                     size_t bufferSize, uint16_t flags = 0,
+                     uint32_t sequence = 0) const {
+        return sendPackage(socket, PKG_TYPE::FRAME, buffer, bufferSize, flags,
+                           sequence);
+    }
 
-        int bytes = send(socket, static_cast<const void *>(header.data()),
-                         HEADER_SIZE, MSG_WAITALL | MSG_NOSIGNAL);
-        if (bytes < 0) {
-            throw std::runtime_error("Could not send header of package");
-        }
+    Task<> sendMsg(AsyncSocket &socket, std::string_view msg) const {
+        LOG(std::string("Sending msg \"") + std::string(msg) +
+            "\", data.size=" + std::to_string(msg.size()));
+        return sendPackage(socket, PKG_TYPE::TEXT, msg.data(), msg.size());
+    }
 
-        bytes = send(socket, buffer, bufferSize, MSG_NOSIGNAL);
-        if (bytes < 0) {
-            throw std::runtime_error("Could not send data of package");
-        }
+    // Numbers in package data are in network byte order, except with version
+    // 1 peers.
+    void putNum(uint64_t num, uint8_t *dst) const {
+        if (version_ == 1)
+            std::memcpy(dst, &num, sizeof(uint64_t));
+        else
+            writeBigEndian(num, sizeof(uint64_t), dst);
+    }
 
-        LOG(std::string("Sent ") + std::to_string(bytes) +
-            " data with data size " + std::to_string(bufferSize));
+    // Returns number idx of the data, or 0 if the data is too short for it.
+    uint64_t getNum(size_t idx, const Buffer &data, uint64_t size) const {
+        if ((idx + 1) * sizeof(uint64_t) > size)
+            return 0;
+
+        const uint8_t *src = data.data() + idx * sizeof(uint64_t);
+        uint64_t num = 0;
+        if (version_ == 1)
+            std::memcpy(&num, src, sizeof(uint64_t));
+        else
+            num = readBigEndian(src, sizeof(uint64_t));
+        return num;
     }
 
-    void sendMsg(int socket, std::string_view msg) const {
-        std::vector<uint8_t> data(msg.length());
-        std::copy(msg.begin(), msg.end(), data.begin());
+    // Returns the size of the encoded configuration, since version 1 peers
+    // know nothing about capabilities.
+    size_t encodeStreamConfig(const StreamConfig &cfg,
+                              std::array<uint8_t, 6 * sizeof(uint64_t)> &data)
+        const {
+        putNum(cfg.width, data.data());
+        putNum(cfg.height, data.data() + 8);
+        putNum(cfg.format, data.data() + 16);
+        putNum(cfg.flags, data.data() + 24);
+        putNum(cfg.capabilities, data.data() + 32);
+        putNum(cfg.quality, data.data() + 40);
+        return version_ == 1 ? 4 * sizeof(uint64_t) : data.size();
+    }
 
-        LOG(std::string("Sending msg \"") + std::string(msg) +
-            "\", data.size=" + std::to_string(data.size()));
-        sendPackage(socket, PKG_TYPE::TEXT, data);
+    Task<> sendStreamConfig(AsyncSocket &socket, const StreamConfig &cfg,
+                            PKG_TYPE type = PKG_TYPE::STREAM_CONFIG) const {
+        std::array<uint8_t, 6 * sizeof(uint64_t)> data;
+        const size_t size = encodeStreamConfig(cfg, data);
+        co_await sendPackage(socket, type, data.data(), size);
     }
 
+    // The same without the socket's event loop, like sendCrop().
     void sendStreamConfig(int socket, const StreamConfig &cfg) const {
-        std::vector<uint8_t> data;
+        std::array<uint8_t, 6 * sizeof(uint64_t)> data;
+        const size_t size = encodeStreamConfig(cfg, data);
+        sendPackage(socket, PKG_TYPE::STREAM_CONFIG, data.data(), size);
+    }
+
+    Task<StreamConfig> readStreamConfig(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = header_.type};
+        co_await readPackageData(socket, pkg, size);
+        co_return StreamConfig{.width = getNum(0, pkg.data, size),
+                               .height = getNum(1, pkg.data, size),
+                               .format = getNum(2, pkg.data, size),
+                               .flags = getNum(3, pkg.data, size),
+                               .capabilities = getNum(4, pkg.data, size),
+                               .quality = getNum(5, pkg.data, size)};
+    }
 
-        addNumToVec(static_cast<size_t>(cfg.width), data);
-        addNumToVec(static_cast<size_t>(cfg.height), data);
-        addNumToVec(static_cast<size_t>(cfg.format), data);
+    // Asks for only a region of the frames, in the coordinates of the
+    // configured stream. The server answers with a STREAM_CONFIG of the new
+    // frame size before the first cropped frame. An empty region turns
+    // cropping off.
+    void sendCrop(int socket, const Region &region) const {
+        std::array<uint8_t, 4 * sizeof(uint64_t)> data;
 
-        sendPackage(socket, PKG_TYPE::STREAM_CONFIG, data);
+        putNum(static_cast<uint64_t>(region.x), data.data());
+        putNum(static_cast<uint64_t>(region.y), data.data() + 8);
+        putNum(static_cast<uint64_t>(region.width), data.data() + 16);
+        putNum(static_cast<uint64_t>(region.height), data.data() + 24);
+
+        sendPackage(socket, PKG_TYPE::CROP, data.data(), data.size());
     }
 
-    // Read out the next package's type and data size. It can return an emtpy
-    // optional if flags is set to MSG_DONTWAIT.
-    std::optional<std::tuple<PKG_TYPE, uint64_t>>
-    readPackageHeader(int socket, int flags = MSG_WAITALL) const {
-        std::vector<uint8_t> header(HEADER_SIZE);
-        int bytes = recv(socket, static_cast<void *>(header.data()),
-                         HEADER_SIZE, flags);
-        if (bytes == 0) {
-            std::cout << "Connection closed\n";
-            return std::tuple{PKG_TYPE::CLOSED, 0};
-        } else if (bytes < 0 && errno == EAGAIN && (flags & MSG_DONTWAIT)) {
-            return {};
-        } else if (bytes < 0) {
+    // Asks for the frames from ago before now, played at speedPercent of real
+    // time, after which the server goes back to live frames by itself once
+    // it catches up. No time ago asks for the live frames right away.
+    void sendSeek(int socket, std::chrono::milliseconds ago,
+                  int speedPercent) const {
+        std::array<uint8_t, 2 * sizeof(uint64_t)> data;
+
+        putNum(static_cast<uint64_t>(std::max<int64_t>(0, ago.count())),
+               data.data());
+        putNum(static_cast<uint64_t>(speedPercent), data.data() + 8);
+
+        sendPackage(socket, PKG_TYPE::SEEK, data.data(), data.size());
+    }
+
+    Task<std::tuple<std::chrono::milliseconds, int>>
+    readSeek(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::SEEK};
+        co_await readPackageData(socket, pkg, size);
+        co_return std::tuple{
+            std::chrono::milliseconds(getNum(0, pkg.data, size)),
+            static_cast<int>(std::min<uint64_t>(getNum(1, pkg.data, size),
+                                                INT32_MAX))};
+    }
+
+    Task<Region> readCrop(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::CROP};
+        co_await readPackageData(socket, pkg, size);
+        // Clamped, so that a region can't wrap around to negative values.
+        auto num = [&](size_t idx) {
+            return static_cast<int>(
+                std::min<uint64_t>(getNum(idx, pkg.data, size), INT32_MAX));
+        };
+        co_return Region{num(0), num(1), num(2), num(3)};
+    }
+
+    // Finds out the protocol version from the first V1_HEADER_SIZE bytes of a
+    // header, if it is not known yet, and returns how many bytes of the header
+    // are left to read.
+    size_t headerRest(const std::array<uint8_t, HEADER_SIZE> &header) {
+        const bool hasMagic = readBigEndian(header.data(), 4) == MAGIC;
+        if (version_ == 0)
+            version_ = hasMagic ? PROTOCOL_VERSION : 1;
+        if (version_ == 1)
+            return 0;
+
+        if (!hasMagic)
+            throw std::runtime_error("Peer does not speak protocol "
+                                     "version 2, version 1 is too old");
+        if (header[4] < 2)
             throw std::runtime_error(
-                std::string("Failed reading out package header from socket: ") +
-                strerror(errno) + " (" + std::to_string(errno) + ")");
-        }
+                "Got invalid protocol version " +
+                std::to_string(static_cast<int>(header[4])));
+        return HEADER_SIZE - V1_HEADER_SIZE;
+    }
 
-        uint64_t dataSize = 0;
-        std::memcpy(&dataSize, header.data(), sizeof(uint64_t));
+    // Decodes a whole header into header_.
+    void decodeHeader(const std::array<uint8_t, HEADER_SIZE> &header) {
         uint64_t pkgType = 0;
-        std::memcpy(&pkgType, header.data() + sizeof(uint64_t),
-                    sizeof(uint64_t));
+        if (version_ == 1) {
+            header_.flags = 0;
+            header_.streamId = 0;
+            header_.sequence = 0;
+            std::memcpy(&header_.size, header.data(), sizeof(uint64_t));
+            std::memcpy(&pkgType, header.data() + sizeof(uint64_t),
+                        sizeof(uint64_t));
+        } else {
+            // Newer versions keep the header, so types and flags that are
+            // unknown here are handled as invalid or ignored.
+            pkgType = header[5];
+            header_.flags = static_cast<uint16_t>(
+                readBigEndian(header.data() + 6, 2));
+            header_.streamId = static_cast<uint32_t>(
+                readBigEndian(header.data() + 8, 4));
+            header_.sequence = static_cast<uint32_t>(
+                readBigEndian(header.data() + 12, 4));
+            header_.size = readBigEndian(header.data() + 16, 8);
+        }
 
         const static uint64_t MAX_TYPES =
             static_cast<uint64_t>(PKG_TYPE::NUM_TYPES);
-        PKG_TYPE type = (pkgType >= MAX_TYPES) ? PKG_TYPE::INVALID
-                                               : static_cast<PKG_TYPE>(pkgType);
+        header_.type = (pkgType >= MAX_TYPES) ? PKG_TYPE::INVALID
+                                              : static_cast<PKG_TYPE>(pkgType);
+
+        LOG(std::string("Recieved ") + typeToString(header_.type) +
+            " type message of " + std::to_string(header_.size) + " bytes");
+    }
 
-        LOG(std::string("Recieved ") + typeToString(type) +
-            " type message of " + std::to_string(dataSize) + " bytes");
+    // Read out the next package's type and data size, and keep its header in
+    // header_. Until the protocol version is known it is found out from the
+    // header.
+    Task<std::tuple<PKG_TYPE, uint64_t>>
+    readPackageHeader(AsyncSocket &socket) {
+        std::array<uint8_t, HEADER_SIZE> header;
+        size_t bytes = co_await socket.read(header.data(), V1_HEADER_SIZE);
+        if (bytes < V1_HEADER_SIZE) {
+            std::cout << "Connection closed\n";
+            co_return std::tuple{PKG_TYPE::CLOSED, uint64_t{0}};
+        }
+
+        const size_t rest = headerRest(header);
+        if (rest > 0) {
+            bytes = co_await socket.read(header.data() + V1_HEADER_SIZE, rest);
+            if (bytes < rest)
+                throw std::runtime_error("Could not read package header");
+        }
+        decodeHeader(header);
 
-        return std::tuple{type, dataSize};
+        co_return std::tuple{header_.type, header_.size};
     }
 
-    void readPackageData(int socket, Package &pkg, uint64_t size) const {
+    Task<> readPackageData(AsyncSocket &socket, Package &pkg,
+                           uint64_t size) const {
         if (size > pkg.data.size())
             pkg.data.resize(size);
 
-        int bytes = recv(socket, static_cast<void *>(pkg.data.data()), size,
-                         MSG_WAITALL);
-        if (bytes < 0) {
-            throw std::runtime_error(
-                std::string(
-                    "Failed reading reading out package data from socket: ") +
-                strerror(errno));
-        }
+        const size_t bytes = co_await socket.read(pkg.data.data(), size);
+        if (bytes < size)
+            throw std::runtime_error("Connection closed in a package");
 
         LOG(std::string("Read ") + std::to_string(bytes) + " bytes of " +
             typeToString(pkg.type) + " message");
@@ -194,24 +434,42 @@ class TcpInterface {
     }
 
   protected:
-    virtual void errorHandler(int sck, uint64_t size) {
-        Package pkg = {.type = PKG_TYPE::TEXT, .data = {}};
-        readPackageData(sck, pkg, size);
+    virtual Task<> errorHandler(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::TEXT};
+        co_await readPackageData(socket, pkg, size);
         throw std::runtime_error("Got invalid package type");
     }
 
-    virtual void closedHandler(int sck, uint64_t size) {
-        Package pkg = {.type = PKG_TYPE::TEXT, .data = {}};
-        readPackageData(sck, pkg, size);
+    virtual Task<> closedHandler(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::TEXT};
+        co_await readPackageData(socket, pkg, size);
         throw std::runtime_error("Recieved connection closed message");
     }
 
-    virtual void streamConfigHandler(int sck, uint64_t size) = 0;
-    virtual void frameHandler(int sck, uint64_t size) = 0;
+    virtual Task<> streamConfigHandler(AsyncSocket &socket, uint64_t size) = 0;
+    virtual Task<> frameHandler(AsyncSocket &socket, uint64_t size) = 0;
+
+    virtual Task<> helloHandler(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::HELLO};
+        co_await readPackageData(socket, pkg, size);
+        throw std::runtime_error("Got unexpected HELLO package");
+    }
 
-    virtual void textHandler(int sck, uint64_t size) {
-        Package pkg = {.type = PKG_TYPE::TEXT, .data = {}};
-        readPackageData(sck, pkg, size);
+    virtual Task<> cropHandler(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::CROP};
+        co_await readPackageData(socket, pkg, size);
+        throw std::runtime_error("Got unexpected CROP package");
+    }
+
+    virtual Task<> seekHandler(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::SEEK};
+        co_await readPackageData(socket, pkg, size);
+        throw std::runtime_error("Got unexpected SEEK package");
+    }
+
+    virtual Task<> textHandler(AsyncSocket &socket, uint64_t size) {
+        Package pkg = {.type = PKG_TYPE::TEXT};
+        co_await readPackageData(socket, pkg, size);
         printTextPackage(pkg);
     }
 
@@ -219,33 +477,38 @@ class TcpInterface {
     TcpInterface(){};
     virtual ~TcpInterface(){};
 
-    std::optional<PKG_TYPE> handlePackage(int sck, int flags = MSG_WAITALL) {
-        auto package = readPackageHeader(sck, flags);
-        if (!package.has_value())
-            return {};
-        auto [type, dataSize] = package.value();
+    // Reads the next package and hands it to its handler. The calling
+    // coroutine is suspended while waiting for the package.
+    Task<PKG_TYPE> handlePackage(AsyncSocket &socket) {
+        auto [type, dataSize] = co_await readPackageHeader(socket);
         switch (type) {
-        case PKG_TYPE::INVALID: {
-            errorHandler(sck, dataSize);
-            return type;
-        }
-        case PKG_TYPE::CLOSED: {
-            closedHandler(sck, dataSize);
-            return type;
-        }
-        case PKG_TYPE::STREAM_CONFIG: {
-            streamConfigHandler(sck, dataSize);
-            return type;
-        }
-        case PKG_TYPE::FRAME: {
-            frameHandler(sck, dataSize);
-            return type;
-        }
-        case PKG_TYPE::TEXT: {
-            textHandler(sck, dataSize);
-            return type;
-        }
-        default: { throw std::runtime_error("ERROR: Unknown type"); }
+        case PKG_TYPE::INVALID:
+            co_await errorHandler(socket, dataSize);
+            break;
+        case PKG_TYPE::CLOSED:
+            co_await closedHandler(socket, dataSize);
+            break;
+        case PKG_TYPE::STREAM_CONFIG:
+            co_await streamConfigHandler(socket, dataSize);
+            break;
+        case PKG_TYPE::FRAME:
+            co_await frameHandler(socket, dataSize);
+            break;
+        case PKG_TYPE::TEXT:
+            co_await textHandler(socket, dataSize);
+            break;
+        case PKG_TYPE::HELLO:
+            co_await helloHandler(socket, dataSize);
+            break;
+        case PKG_TYPE::CROP:
+            co_await cropHandler(socket, dataSize);
+            break;
+        case PKG_TYPE::SEEK:
+            co_await seekHandler(socket, dataSize);
+            break;
+        default:
+            throw std::runtime_error("ERROR: Unknown type");
         }
+        co_return type;
     }
 };
@@ -1,67 +1,262 @@
 #pragma once
 
+#include "frame-sink.hpp"
+#include "perf-counters.hpp"
+#include "pixel-format.hpp"
 #include "tcp-interface.hpp"
 #include "video-stream.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <string>
 
+// A stream from a server, read by coroutines on a loop of its own that runs
+// in the thread calling update().
 class TcpStream : public VideoStream, public TcpInterface {
-    int socket_ = -1;
     Package frame_ = {};
+    // Bytes of the current frame. Compressed frames only fill the start of
+    // frame_, which keeps the size of the largest one.
+    size_t frameBytes_ = 0;
+    // Atomic like capabilities_.
+    std::atomic<bool> motionOnly_ = false;
+    // JPEG quality asked of the server for MJPEG, 0 for the camera's own.
+    std::atomic<int> quality_ = 0;
+    std::chrono::steady_clock::time_point connectTime_;
+    EventLoop loop_;
+    AsyncSocket socket_;
+    bool gotFrame_ = false;
+    // Changed by the loop when the server reconfigures the stream, while
+    // crop(), seek() and reconfigure() read it from other threads.
+    std::atomic<uint64_t> capabilities_ = 0;
+    bool configured_ = false;
+    // Frames are spliced into the sink if there is one.
+    FrameSink *sink_ = nullptr;
+    // Sequence number and motion flag of the current frame.
+    uint32_t sequence_ = 0;
+    bool motion_ = false;
+    uint64_t dropped_ = 0;
 
-    void setupStream() const {
+    // Capabilities that the client asks for.
+    static constexpr uint64_t CAPABILITIES =
+        CAP_MOTION_EVENTS | CAP_CROP | CAP_SEEK | CAP_RECONFIGURE;
+
+    // Sends a HELLO and waits for the server's STREAM_CONFIG, a single round
+    // trip.
+    Task<> setupStream() {
         std::cout << "Setting up stream\n";
         StreamConfig cfg = {.width = static_cast<uint64_t>(width_),
                             .height = static_cast<uint64_t>(height_),
-                            .format = static_cast<uint64_t>(format_)};
+                            .format = static_cast<uint64_t>(format_),
+                            .flags = motionOnly_ ? STREAM_MOTION_ONLY : 0,
+                            .capabilities = CAPABILITIES,
+                            .quality = static_cast<uint64_t>(quality_)};
+
+        version_ = PROTOCOL_VERSION;
+        co_await sendStreamConfig(socket_, cfg, PKG_TYPE::HELLO);
 
-        sendStreamConfig(socket_, cfg);
+        while (true) {
+            auto type = co_await handlePackage(socket_);
+            if (type == PKG_TYPE::STREAM_CONFIG)
+                break;
+        }
     }
 
-    void streamConfigHandler(int sck, uint64_t size) override {
-        Package pkg = {.type = PKG_TYPE::TEXT, .data = {}};
-        readPackageData(sck, pkg, size);
-        std::cerr << "WARNING: Throwing away stream config.\n";
+    // Handles packages until a FRAME has been read.
+    Task<> receiveFrame() {
+        while (true) {
+            auto type = co_await handlePackage(socket_);
+            if (type == PKG_TYPE::FRAME)
+                break;
+        }
     }
 
-    void frameHandler(int sck, uint64_t size) override {
-        if (size != frame_.data.size()) {
+    // The server's answer to the HELLO, with what it agreed to. Later ones
+    // come before the first frame of a new size, when cropping, or of a new
+    // configuration.
+    Task<> streamConfigHandler(AsyncSocket &socket, uint64_t size) override {
+        StreamConfig cfg = co_await readStreamConfig(socket, size);
+        if (configured_) {
+            const int format = static_cast<int>(cfg.format);
+            if (!isKnownFormat(format))
+                throw std::runtime_error("Server picked unknown format " +
+                                         formatToString(format));
+            width_ = static_cast<int>(cfg.width);
+            height_ = static_cast<int>(cfg.height);
+            format_ = format;
+            quality_ = static_cast<int>(cfg.quality);
+            motionOnly_ = cfg.flags & STREAM_MOTION_ONLY;
+            capabilities_ = cfg.capabilities;
+            if (!isCompressed(format_))
+                frame_.data.resize(frameSize(format_, width_, height_));
+            co_return;
+        }
+        // The server lowers the resolution if the stream does not fit in its
+        // bandwidth budget.
+        if (cfg.width != static_cast<uint64_t>(width_) ||
+            cfg.height != static_cast<uint64_t>(height_)) {
+            if (cfg.width == 0 || cfg.height == 0 ||
+                cfg.width > static_cast<uint64_t>(width_) ||
+                cfg.height > static_cast<uint64_t>(height_))
+                throw std::runtime_error(
+                    "Server changed the stream configuration");
+            std::cerr << "WARNING: Server streams in " << cfg.width << "x"
+                      << cfg.height << " instead of " << width_ << "x"
+                      << height_ << std::endl;
+            width_ = static_cast<int>(cfg.width);
+            height_ = static_cast<int>(cfg.height);
+            frame_.data.resize(frameSize(format_, width_, height_));
+        }
+        // The server picks another format if it can't produce the one asked
+        // for. Any format it picks can be shown.
+        if (cfg.format != static_cast<uint64_t>(format_)) {
+            const int format = static_cast<int>(cfg.format);
+            if (!isKnownFormat(format))
+                throw std::runtime_error("Server picked unknown format " +
+                                         formatToString(format));
+            std::cerr << "WARNING: Server streams in "
+                      << formatToString(format) << " instead of "
+                      << formatToString(format_) << std::endl;
+            format_ = format;
+            frame_.data.resize(frameSize(format_, width_, height_));
+        }
+        if (format_ == V4L2_PIX_FMT_MJPEG && quality_ > 0 &&
+            cfg.quality == 0) {
+            std::cerr << "WARNING: Server does not encode MJPEG, streaming "
+                         "the camera's own\n";
+        }
+        quality_ = static_cast<int>(cfg.quality);
+        if (motionOnly_ && !(cfg.flags & STREAM_MOTION_ONLY)) {
+            std::cerr << "WARNING: Server does not support motion only "
+                         "streaming for this stream\n";
+            motionOnly_ = false;
+        }
+        capabilities_ = cfg.capabilities;
+        configured_ = true;
+        std::cout << "Stream configured with capabilities "
+                  << capabilities_.load() << std::endl;
+    }
+
+    Task<> frameHandler(AsyncSocket &socket, uint64_t size) override {
+        // Motion only streams skip frames on purpose.
+        if (version_ >= 2 && sequence_ != 0 && !motionOnly_ &&
+            header_.sequence > sequence_ + 1)
+            dropped_ += header_.sequence - sequence_ - 1;
+        sequence_ = header_.sequence;
+        motion_ = header_.flags & PKG_FLAG_MOTION;
+
+        if (sink_ != nullptr) {
+            sink_->splice(socket.fd(), size);
+            co_return;
+        }
+        if (!isCompressed(format_) && size != frame_.data.size()) {
             std::cerr << "WARNING: Frame changed size\n";
         }
 
-        readPackageData(sck, frame_, size);
+        co_await readPackageData(socket, frame_, size);
+        frameBytes_ = size;
     }
 
   public:
     TcpStream(const std::string &ip, int port, int width, int height,
-              int format)
-        : VideoStream(width, height, format) {
-        socket_ = connectTo(ip, port);
-
-        setupStream();
+              int format, bool motionOnly = false, int quality = 0)
+        : VideoStream(width, height, format), motionOnly_(motionOnly),
+          quality_(quality), connectTime_(std::chrono::steady_clock::now()),
+          socket_(loop_, connectTo(ip, port)) {
+        // What the client sends is small and should not wait for more, like
+        // a crop while the frames are coming in.
+        const int noDelay = 1;
+        setsockopt(socket_.fd(), IPPROTO_TCP, TCP_NODELAY, &noDelay,
+                   sizeof(noDelay));
 
         frame_.type = PKG_TYPE::FRAME;
-        frame_.data.resize(width * height * 2); // YUYV format.
+        frame_.data.resize(frameSize(format, width, height));
+
+        loop_.run(setupStream());
     }
 
     ~TcpStream() {
-        sendMsg(socket_, "Client is closing down");
-        close(socket_);
+        try {
+            sendMsg(socket_.fd(), "Client is closing down");
+        } catch (std::exception const &e) {
+            std::cerr << "WARNING: " << e.what() << std::endl;
+        }
+    }
+
+    void interrupt() override { socket_.shutdown(SHUT_RD); }
+
+    // Can be called from another thread than update(), since the package is
+    // sent without the loop.
+    bool crop(const Region &region) override {
+        if (!(capabilities_ & CAP_CROP))
+            return false;
+        sendCrop(socket_.fd(), region);
+        return true;
+    }
+
+    // Can be called from another thread than update(), like crop().
+    bool seek(std::chrono::milliseconds ago, int speedPercent) override {
+        if (!(capabilities_ & CAP_SEEK))
+            return false;
+        sendSeek(socket_.fd(), ago, speedPercent);
+        return true;
+    }
+
+    // Can be called from another thread than update(), like crop(). The
+    // configuration changes once the server's answer has been read.
+    bool reconfigure(int width, int height, int format,
+                     int quality) override {
+        if (!(capabilities_ & CAP_RECONFIGURE))
+            return false;
+        const bool encode = format == V4L2_PIX_FMT_MJPEG && quality > 0;
+        sendStreamConfig(
+            socket_.fd(),
+            {.width = static_cast<uint64_t>(width),
+             .height = static_cast<uint64_t>(height),
+             .format = static_cast<uint64_t>(format),
+             .flags = motionOnly_ ? STREAM_MOTION_ONLY : 0,
+             .capabilities = CAPABILITIES,
+             .quality = static_cast<uint64_t>(encode ? quality : 0)});
+        return true;
+    }
+
+    int quality() const override { return quality_; }
+
+    bool forwardTo(FrameSink *sink) override {
+        sink_ = sink;
+        return true;
+    }
+
+    uint64_t droppedFrames() const override { return dropped_; }
+
+    std::optional<bool> motion() const override {
+        if (version_ < 2)
+            return std::nullopt;
+        return motion_;
     }
 
     inline void *getBuffer() override {
         return static_cast<void *>(frame_.data.data());
     }
 
-    inline size_t getBufferSize() const override { return frame_.data.size(); }
+    inline size_t getBufferSize() const override {
+        return isCompressed(format_) ? frameBytes_ : frame_.data.size();
+    }
 
     void update() override {
-        // Handle recieved packages until we get a FRAME.
-        while (true) {
-            auto type = handlePackage(socket_);
-            if (type.value() == PKG_TYPE::FRAME)
-                break;
+        {
+            StageScope stage(Stage::RECEIVE);
+            loop_.run(receiveFrame());
+        }
+
+        if (!gotFrame_) {
+            gotFrame_ = true;
+            auto elapsed = std::chrono::steady_clock::now() - connectTime_;
+            std::cout << "Time to first frame: "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(
+                             elapsed)
+                             .count()
+                      << " ms\n";
         }
     }
 };
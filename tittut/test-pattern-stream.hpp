@@ -0,0 +1,88 @@
+// Synthetic video stream showing colour bars with a moving white bar. Used for
+// running the server without a camera, and by the benchmarks.
+#pragma once
+
+#include "perf-counters.hpp"
+#include "pixel-format.hpp"
+#include "video-stream.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+class TestPatternStream : public VideoStream {
+    std::vector<uint8_t> background_;
+    std::vector<uint8_t> frame_;
+    std::chrono::steady_clock::duration period_;
+    std::chrono::steady_clock::time_point next_;
+    std::chrono::steady_clock::time_point frameTime_;
+    uint64_t count_ = 0;
+
+    void drawBackground() {
+        // Y, U, V of white, yellow, cyan, green, magenta, red, blue and black.
+        static constexpr uint8_t bars[8][3] = {
+            {235, 128, 128}, {210, 16, 146}, {170, 166, 16}, {145, 54, 34},
+            {106, 202, 222}, {81, 90, 240},  {41, 240, 110}, {16, 128, 128}};
+
+        background_.resize(frameSize(format_, width_, height_));
+        for (int y = 0; y < height_; ++y) {
+            uint8_t *row = background_.data() + y * width_ * 2;
+            for (int x = 0; x < width_; x += 2) {
+                const uint8_t *bar = bars[x * 8 / width_];
+                row[x * 2] = bar[0];
+                row[x * 2 + 1] = bar[1];
+                row[x * 2 + 2] = bar[0];
+                row[x * 2 + 3] = bar[2];
+            }
+        }
+    }
+
+  public:
+    TestPatternStream(int width, int height, int format, int fps = 30)
+        : VideoStream(width, height, format),
+          period_(std::chrono::steady_clock::duration(std::chrono::seconds(1)) /
+                  fps),
+          next_(std::chrono::steady_clock::now()) {
+        if (format != V4L2_PIX_FMT_YUYV)
+            throw std::invalid_argument("The test pattern is only in yuyv");
+        if (width <= 0 || height <= 0 || width % 2)
+            throw std::invalid_argument("Invalid test pattern dimensions");
+
+        drawBackground();
+        frame_ = background_;
+        buffer_ = frame_.data();
+    }
+
+    inline void *getBuffer() override { return buffer_; }
+
+    inline size_t getBufferSize() const override { return frame_.size(); }
+
+    std::optional<std::chrono::steady_clock::time_point>
+    frameTime() const override {
+        return frameTime_;
+    }
+
+    void update() override {
+        std::this_thread::sleep_until(next_);
+        frameTime_ = next_;
+        next_ += period_;
+        StageScope stage(Stage::CAPTURE);
+
+        std::memcpy(frame_.data(), background_.data(), frame_.size());
+        const int barWidth = std::max(2, width_ / 32) & ~1;
+        const int range = std::max(1, width_ - barWidth);
+        const int x0 = static_cast<int>((count_++ * 4) % range) & ~1;
+        for (int y = 0; y < height_; ++y) {
+            uint8_t *p = frame_.data() + (y * width_ + x0) * 2;
+            for (int x = 0; x < barWidth; x += 2) {
+                p[x * 2] = 235;
+                p[x * 2 + 1] = 128;
+                p[x * 2 + 2] = 235;
+                p[x * 2 + 3] = 128;
+            }
+        }
+    }
+};
@@ -0,0 +1,227 @@
+// Work stealing thread pool for splitting the processing of a frame into row
+// or tile tasks.
+//
+// Every worker has its own queue of tasks. A worker takes the newest task from
+// its own queue and, when that is empty, steals the oldest task from another
+// queue. A thread waiting for its tasks to finish works on the tasks meanwhile,
+// so tasks can be split up further from within tasks.
+//
+// Tasks are chunks of a parallelFor(), kept as plain records in queues of a
+// fixed size, so that splitting up a frame never allocates.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+    // The chunk [begin, end) of a parallelFor(), which run() does with the
+    // context that it passes.
+    struct Task {
+        void (*run)(void *context, size_t begin, size_t end) = nullptr;
+        void *context = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    // Chunks that don't fit in the queue are done right away instead.
+    static constexpr size_t QUEUE_CAPACITY = 256;
+
+    // A ring of tasks, from the oldest at head.
+    struct Queue {
+        std::mutex mutex;
+        std::array<Task, QUEUE_CAPACITY> tasks;
+        size_t head = 0;
+        size_t size = 0;
+    };
+
+    // Tasks submitted by one call of parallelFor(), waited for as a whole.
+    struct Group {
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex sleepMutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> pending_ = 0;
+    std::atomic<size_t> nextQueue_ = 0;
+    bool stop_ = false;
+
+    // The pool and queue of the current thread, if it is a worker.
+    static inline thread_local ThreadPool *currentPool_ = nullptr;
+    static inline thread_local size_t currentQueue_ = 0;
+
+    bool isWorker() const { return currentPool_ == this; }
+
+    // Queues a task, or returns false if the queue is full.
+    bool push(const Task &task) {
+        const size_t index = isWorker()
+                                 ? currentQueue_
+                                 : nextQueue_++ % queues_.size();
+        // Counted before it can be taken, so that the count never drops below
+        // the number of queued tasks.
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            ++pending_;
+        }
+        {
+            Queue &queue = *queues_[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.size == QUEUE_CAPACITY) {
+                --pending_;
+                return false;
+            }
+            queue.tasks[(queue.head + queue.size++) % QUEUE_CAPACITY] = task;
+        }
+        wake_.notify_one();
+        return true;
+    }
+
+    // Runs one task, from the own queue if the thread is a worker or else
+    // stolen from another one. Returns false if there were no tasks.
+    bool runOne() {
+        Task task;
+        const size_t start = isWorker() ? currentQueue_ : nextQueue_.load();
+        for (size_t i = 0; i < queues_.size() && !task.run; ++i) {
+            Queue &queue = *queues_[(start + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.size == 0)
+                continue;
+            if (i == 0 && isWorker()) {
+                task = queue.tasks[(queue.head + queue.size - 1) %
+                                   QUEUE_CAPACITY];
+            } else {
+                task = queue.tasks[queue.head];
+                queue.head = (queue.head + 1) % QUEUE_CAPACITY;
+            }
+            --queue.size;
+        }
+        if (!task.run)
+            return false;
+
+        --pending_;
+        task.run(task.context, task.begin, task.end);
+        return true;
+    }
+
+    void work(size_t index) {
+        currentPool_ = this;
+        currentQueue_ = index;
+        while (true) {
+            if (runOne())
+                continue;
+
+            std::unique_lock<std::mutex> lock(sleepMutex_);
+            wake_.wait(lock, [this] { return stop_ || pending_ > 0; });
+            if (stop_ && pending_ == 0)
+                return;
+        }
+    }
+
+  public:
+    // Uses the calling thread plus threads - 1 workers. With a single thread
+    // everything runs on the calling thread.
+    explicit ThreadPool(size_t threads) {
+        const size_t workers = std::max<size_t>(threads, 1) - 1;
+        for (size_t i = 0; i < workers; ++i)
+            queues_.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < workers; ++i)
+            threads_.emplace_back(&ThreadPool::work, this, i);
+    }
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool &operator=(ThreadPool const &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &thread : threads_)
+            thread.join();
+    }
+
+    // The pool shared by the whole program, using every core.
+    static ThreadPool &shared() {
+        static ThreadPool pool(
+            std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    size_t threads() const { return threads_.size() + 1; }
+
+    // Calls fn(chunkBegin, chunkEnd) for chunks of at most grain items of
+    // [begin, end) in parallel, and returns when all chunks are done. The
+    // first exception thrown by fn is rethrown.
+    template <typename Fn>
+    void parallelFor(size_t begin, size_t end, size_t grain, Fn &&fn) {
+        grain = std::max<size_t>(grain, 1);
+        if (threads_.empty() || end - begin <= grain) {
+            if (begin < end)
+                fn(begin, end);
+            return;
+        }
+
+        Group group;
+        group.remaining = (end - begin + grain - 1) / grain;
+        auto runChunk = [&group, &fn](size_t chunkBegin, size_t chunkEnd) {
+            std::exception_ptr error;
+            try {
+                fn(chunkBegin, chunkEnd);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(group.mutex);
+            if (error && !group.error)
+                group.error = error;
+            if (--group.remaining == 0)
+                group.done.notify_all();
+        };
+
+        using RunChunk = decltype(runChunk);
+        auto run = [](void *context, size_t chunkBegin, size_t chunkEnd) {
+            (*static_cast<RunChunk *>(context))(chunkBegin, chunkEnd);
+        };
+        for (size_t i = begin + grain; i < end; i += grain) {
+            const size_t chunkEnd = std::min(i + grain, end);
+            if (!push({run, &runChunk, i, chunkEnd}))
+                runChunk(i, chunkEnd);
+        }
+        runChunk(begin, begin + grain);
+
+        // Help with the remaining tasks until all chunks are done. Once there
+        // is nothing left to take, the chunks are all running elsewhere.
+        while (group.remaining > 0) {
+            if (runOne())
+                continue;
+            std::unique_lock<std::mutex> lock(group.mutex);
+            group.done.wait(lock, [&group] { return group.remaining == 0; });
+        }
+
+        // The last chunk may still hold the lock after counting down.
+        std::lock_guard<std::mutex> lock(group.mutex);
+        if (group.error)
+            std::rethrow_exception(group.error);
+    }
+
+    // Splits the rows of a frame into a few tasks per thread.
+    template <typename Fn> void parallelRows(int height, Fn &&fn) {
+        const size_t rows = static_cast<size_t>(std::max(height, 0));
+        const size_t grain = std::max<size_t>(8, rows / (threads() * 4));
+        parallelFor(0, rows, grain, [&fn](size_t begin, size_t end) {
+            fn(static_cast<int>(begin), static_cast<int>(end));
+        });
+    }
+};
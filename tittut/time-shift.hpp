@@ -0,0 +1,159 @@
+// Keeps the last seconds of frames in memory, so that a client connecting
+// after something has happened can rewind to it, and play the frames back at
+// any speed until it has caught up with the live frames.
+//
+// The ring records from a subscription of its own, which keeps the device
+// capturing also while no clients are connected. Frames are kept as captured,
+// shared with the live clients, or only as MJPEG encoded by the server, which
+// fits many more of them in the same memory but can then only be played back
+// to MJPEG clients of the recorded resolution.
+#pragma once
+
+#include "capture-session.hpp"
+#include "event-loop.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct TimeShiftConfig {
+    // Seconds of frames kept, 0 to keep none.
+    int seconds = 0;
+    // Megabytes that the kept frames may take, not counting the scaled and
+    // converted versions of them that clients have made.
+    int maxMB = 512;
+    // Resolution the frames are recorded in.
+    int width = 1280;
+    int height = 720;
+    // JPEG quality that frames are kept with, 0 to keep them as captured.
+    int quality = 0;
+};
+
+class TimeShiftRing {
+    TimeShiftConfig config_;
+    mutable std::mutex mutex_;
+    // Oldest first, so they are sorted by their timestamps.
+    std::deque<std::shared_ptr<SharedFrame>> frames_;
+    size_t bytes_ = 0;
+
+    static bool olderThan(const std::shared_ptr<SharedFrame> &frame,
+                          std::chrono::steady_clock::time_point time) {
+        return frame->timestamp() < time;
+    }
+
+    static bool newerThan(std::chrono::steady_clock::time_point time,
+                          const std::shared_ptr<SharedFrame> &frame) {
+        return time < frame->timestamp();
+    }
+
+    void push(std::shared_ptr<SharedFrame> frame) {
+        if (config_.quality > 0) {
+            // Only the MJPEG is kept, without the frame it was encoded from.
+            const Buffer &jpeg =
+                frame->get(config_.width, config_.height, V4L2_PIX_FMT_MJPEG,
+                           config_.quality);
+            Buffer data = makeBuffer();
+            data.assign(jpeg.begin(), jpeg.end());
+            auto compressed = std::allocate_shared<SharedFrame>(
+                std::pmr::polymorphic_allocator<SharedFrame>(
+                    &BufferPool::shared()),
+                std::move(data), config_.width, config_.height,
+                V4L2_PIX_FMT_MJPEG, frame->sequence(), frame->timestamp());
+            compressed->setMotion(frame->motion());
+            frame = std::move(compressed);
+        }
+
+        const auto length = std::chrono::seconds(config_.seconds);
+        const size_t maxBytes = static_cast<size_t>(config_.maxMB) << 20;
+        std::lock_guard<std::mutex> lock(mutex_);
+        bytes_ += frame->data().size();
+        frames_.push_back(std::move(frame));
+        while (frames_.size() > 1 &&
+               (frames_.back()->timestamp() - frames_.front()->timestamp() >
+                    length ||
+                bytes_ > maxBytes)) {
+            bytes_ -= frames_.front()->data().size();
+            frames_.pop_front();
+        }
+    }
+
+  public:
+    explicit TimeShiftRing(const TimeShiftConfig &cfg) : config_(cfg) {
+        if (config_.seconds < 0 || config_.maxMB <= 0)
+            throw std::invalid_argument("Invalid time shift length");
+        if (config_.quality < 0 || config_.quality > 100)
+            throw std::invalid_argument("The quality is from 1 to 100");
+    }
+
+    TimeShiftRing(TimeShiftRing const &) = delete;
+    TimeShiftRing &operator=(TimeShiftRing const &) = delete;
+
+    bool enabled() const { return config_.seconds > 0; }
+
+    // Whether the frames can be played back to a client of the given
+    // resolution and format, which compressed frames can't be scaled or
+    // converted to.
+    bool canPlay(int width, int height, int format) const {
+        return config_.quality == 0 ||
+               (format == V4L2_PIX_FMT_MJPEG && width == config_.width &&
+                height == config_.height);
+    }
+
+    // The first frame at or after time, the oldest one if all are newer, or
+    // null if there are none.
+    std::shared_ptr<SharedFrame>
+    seek(std::chrono::steady_clock::time_point time) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::lower_bound(frames_.begin(), frames_.end(), time,
+                                   olderThan);
+        if (it == frames_.end())
+            return frames_.empty() ? nullptr : frames_.back();
+        return *it;
+    }
+
+    // The first frame after time, or null if there is none yet.
+    std::shared_ptr<SharedFrame>
+    after(std::chrono::steady_clock::time_point time) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::upper_bound(frames_.begin(), frames_.end(), time,
+                                   newerThan);
+        return it == frames_.end() ? nullptr : *it;
+    }
+
+    // Records the frames of session on loop until stopped is set. Failures,
+    // e.g. of the device, are retried every second.
+    Task<> record(CaptureSession &session, EventLoop &loop,
+                  const std::atomic<bool> &stopped) {
+        AsyncTimer timer(loop);
+        const int format =
+            config_.quality > 0 ? V4L2_PIX_FMT_MJPEG : V4L2_PIX_FMT_YUYV;
+        std::string lastError;
+        while (!stopped) {
+            std::string error;
+            try {
+                auto subscription = session.subscribe(
+                    config_.width, config_.height, format, config_.quality);
+                while (true) {
+                    auto frame = co_await subscription->nextAsync(loop);
+                    push(std::move(frame));
+                    lastError.clear();
+                }
+            } catch (std::exception const &e) {
+                error = e.what();
+            }
+            if (stopped)
+                break;
+            if (error != lastError)
+                std::cerr << "WARNING: Time shift stopped recording: " << error
+                          << std::endl;
+            lastError = error;
+            co_await timer.sleepUntil(std::chrono::steady_clock::now() +
+                                      std::chrono::seconds(1));
+        }
+    }
+};
@@ -3,11 +3,19 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <chrono>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 #ifndef NDEBUG
 #define LOG(x) log(x)
@@ -75,6 +83,10 @@ int createListenSocket(int port) {
                                  std::string(strerror(errno)));
     }
 
+    // Allow restarting the server while old connections are in TIME_WAIT.
+    int reuse = 1;
+    setsockopt(localSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     struct sockaddr_in localAddress = {};
     localAddress.sin_family = AF_INET;
     localAddress.sin_addr.s_addr = INADDR_ANY;
@@ -89,6 +101,50 @@ int createListenSocket(int port) {
     return localSocket;
 }
 
+// The "ip:port" of the other end of a connected socket, or "unknown".
+std::string peerAddress(int socket) {
+    sockaddr_in addr = {};
+    socklen_t addrLen = sizeof(addr);
+    char ip[INET_ADDRSTRLEN] = {};
+    if (getpeername(socket, (sockaddr *)&addr, &addrLen) != 0 ||
+        addr.sin_family != AF_INET ||
+        !inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)))
+        return "unknown";
+    return std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+// Makes a socket keep as little queued as possible, for sending frames of
+// frameSize bytes with the lowest latency: small packages go out at once, the
+// send buffer holds about a frame, and the socket only polls as writable once
+// all but a quarter of a frame has been sent.
+void setLowLatency(int socket, size_t frameSize) {
+    const int noDelay = 1;
+    // The kernel doubles the size for its own bookkeeping.
+    const int sendBuffer = static_cast<int>(frameSize);
+    const int lowWater = static_cast<int>(frameSize / 4);
+    if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+                   sizeof(noDelay)) ||
+        setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &sendBuffer,
+                   sizeof(sendBuffer)) ||
+        setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowWater,
+                   sizeof(lowWater))) {
+        throw std::runtime_error(
+            std::string("Could not set up low latency socket: ") +
+            strerror(errno));
+    }
+}
+
+// Blocks until a non-blocking fd is ready for events, for the few blocking
+// calls made on sockets that are otherwise driven by an event loop.
+void waitFor(int fd, short events) {
+    pollfd pfd = {fd, events, 0};
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            throw std::runtime_error(std::string("poll failed: ") +
+                                     strerror(errno));
+    }
+}
+
 int connectTo(const std::string &ip, int port) {
     int connSocket = socket(PF_INET, SOCK_STREAM, 0);
     if (connSocket < 0) {
@@ -132,3 +188,69 @@ size_t getNumFromVec(size_t idx, const std::vector<uint8_t> &vec) {
 
     return static_cast<uint64_t>(num);
 }
+
+// Writes the lowest bytes of num in network byte order, i.e. big endian.
+void writeBigEndian(uint64_t num, size_t bytes, uint8_t *dst) {
+    for (size_t i = 0; i < bytes; ++i)
+        dst[i] = static_cast<uint8_t>(num >> (8 * (bytes - 1 - i)));
+}
+
+uint64_t readBigEndian(const uint8_t *src, size_t bytes) {
+    uint64_t num = 0;
+    for (size_t i = 0; i < bytes; ++i)
+        num = (num << 8) | src[i];
+    return num;
+}
+
+// A rectangular part of a frame, in pixels.
+struct Region {
+    int x;
+    int y;
+    int width;
+    int height;
+
+    bool contains(int px, int py) const {
+        return px >= x && px < x + width && py >= y && py < y + height;
+    }
+};
+
+// Parses regions written as "x,y,width,height", separated by ';'.
+std::vector<Region> parseRegions(std::string_view str) {
+    std::vector<Region> regions;
+    while (!str.empty()) {
+        size_t end = str.find(';');
+        std::string part(str.substr(0, end));
+        str = end == std::string_view::npos ? "" : str.substr(end + 1);
+        if (part.empty())
+            continue;
+
+        Region r = {};
+        if (sscanf(part.c_str(), "%d,%d,%d,%d", &r.x, &r.y, &r.width,
+                   &r.height) != 4 ||
+            r.width <= 0 || r.height <= 0)
+            throw std::invalid_argument("Invalid region: " + part);
+        regions.push_back(r);
+    }
+    return regions;
+}
+
+// Parses addresses written as "ip:port", separated by ','.
+std::vector<std::pair<std::string, int>> parseEndpoints(std::string_view str) {
+    std::vector<std::pair<std::string, int>> endpoints;
+    while (!str.empty()) {
+        size_t end = str.find(',');
+        std::string part(str.substr(0, end));
+        str = end == std::string_view::npos ? "" : str.substr(end + 1);
+        if (part.empty())
+            continue;
+
+        size_t colon = part.rfind(':');
+        int port = 0;
+        if (colon == std::string::npos || colon == 0 ||
+            sscanf(part.c_str() + colon + 1, "%d", &port) != 1 || port <= 0 ||
+            port > 65535)
+            throw std::invalid_argument("Invalid address: " + part);
+        endpoints.emplace_back(part.substr(0, colon), port);
+    }
+    return endpoints;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "buffer-pool.hpp"
+#include "perf-counters.hpp"
+#include "pixel-format.hpp"
 #include "utils.hpp"
 #include "video-stream.hpp"
 
@@ -18,9 +21,27 @@
 #include <unistd.h>
 #include <vector>
 
+// Where the camera captures into. With USERPTR it captures straight into
+// buffers of the buffer pool, which are handed over to the rest of the
+// program without being copied. MMAP buffers belong to the driver, and frames
+// are copied out of them. AUTO picks USERPTR if the driver supports it.
+enum class CaptureMemory { AUTO, MMAP, USERPTR };
+
+CaptureMemory captureMemoryFromString(const std::string &str) {
+    if (str == "auto")
+        return CaptureMemory::AUTO;
+    if (str == "mmap")
+        return CaptureMemory::MMAP;
+    if (str == "userptr")
+        return CaptureMemory::USERPTR;
+    throw std::invalid_argument("Unknown capture memory: " + str);
+}
+
 struct Frame {
     void *data;
     v4l2_buffer buffer;
+    // The memory of a USERPTR buffer.
+    Buffer owned = makeBuffer();
 };
 
 class V4LStream : public VideoStream {
@@ -29,7 +50,14 @@ class V4LStream : public VideoStream {
     int fd_ = -1;
     std::vector<Frame> buffers_;
     size_t currFrame_ = 0;
+    bool compressed_;
+    uint32_t memory_ = V4L2_MEMORY_MMAP;
+    // Size of a frame buffer, as told by the driver.
+    size_t sizeImage_ = 0;
     static constexpr size_t NUM_BUFFERS = 2;
+    // Frames thrown away after starting to stream, before the camera has
+    // settled.
+    static constexpr int WARMUP_FRAMES = 2;
 
     void call_ioctl(std::string_view msg, unsigned long int req,
                     const void *arg) const {
@@ -65,28 +93,32 @@ class V4LStream : public VideoStream {
     void requestBuffers(int count) const {
         v4l2_requestbuffers bufReq = {};
         bufReq.type = STREAM_TYPE_;
-        bufReq.memory = V4L2_MEMORY_MMAP;
+        bufReq.memory = memory_;
         bufReq.count = count;
 
         call_ioctl("Request buffers", VIDIOC_REQBUFS, &bufReq);
+    }
 
-        // This does not seem to be supported in my version...
-        // uint32_t caps = static_cast<uint32_t>(bufReq.capabilities);
-        // bool capMmap = V4L2_BUF_CAP_SUPPORTS_MMAP & caps;
-        // bool capDma = V4L2_BUF_CAP_SUPPORTS_DMABUF & caps;
-        // bool capUser = V4L2_BUF_CAP_SUPPORTS_USERPTR & caps;
-        // bool capReq = V4L2_BUF_CAP_SUPPORTS_REQUESTS & caps;
-        // bool capOrph =V4L2_BUF_CAP_SUPPORTS_ORPHANED_BUFS  & caps;
+    // Asks the driver which kinds of buffer memory it supports, without
+    // allocating any buffers. Drivers older than Linux 4.20 don't say, and
+    // only support MMAP for sure.
+    uint32_t bufferCapabilities() const {
+        v4l2_requestbuffers bufReq = {};
+        bufReq.type = STREAM_TYPE_;
+        bufReq.memory = V4L2_MEMORY_MMAP;
+        bufReq.count = 0;
 
-        // std::cout << "Buffer capabilities:\n";
-        // std::cout << "V4L2_BUF_CAP_SUPPORTS_MMAP: " << capMmap;
-        // std::cout << "V4L2_BUF_CAP_SUPPORTS_DMABUF: " << capDma;
-        // std::cout << "V4L2_BUF_CAP_SUPPORTS_USERPTR: " << capUser;
-        // std::cout << "V4L2_BUF_CAP_SUPPORTS_REQUESTS: " << capReq;
-        // std::cout << "V4L2_BUF_CAP_SUPPORTS_ORPHANED: " << capOrph;
+        call_ioctl("Request buffers", VIDIOC_REQBUFS, &bufReq);
+        const uint32_t caps = bufReq.capabilities;
+        std::cout << "Buffer capabilities:"
+                  << (caps & V4L2_BUF_CAP_SUPPORTS_MMAP ? " mmap" : "")
+                  << (caps & V4L2_BUF_CAP_SUPPORTS_USERPTR ? " userptr" : "")
+                  << (caps & V4L2_BUF_CAP_SUPPORTS_DMABUF ? " dmabuf" : "")
+                  << (caps == 0 ? " unknown" : "") << "\n";
+        return caps == 0 ? V4L2_BUF_CAP_SUPPORTS_MMAP : caps;
     }
 
-    void setFormat() const {
+    void setFormat() {
         if (width_ <= 0 || height_ <= 0)
             throw std::invalid_argument(
                 std::string("Invalid format dimensions: ") +
@@ -105,6 +137,7 @@ class V4LStream : public VideoStream {
             throw std::invalid_argument(
                 std::string("Invalid format dimensions: ") +
                 "Use \"v4l2-ctl --list-formats-ext\" to see available formats");
+        sizeImage_ = format.fmt.pix.sizeimage;
     }
 
     void printParams() const {
@@ -125,7 +158,7 @@ class V4LStream : public VideoStream {
         for (size_t i = 0; i < buffers_.size(); ++i) {
             buffers_[i].buffer = {};
             buffers_[i].buffer.type = STREAM_TYPE_;
-            buffers_[i].buffer.memory = V4L2_MEMORY_MMAP;
+            buffers_[i].buffer.memory = memory_;
             buffers_[i].buffer.index = i;
 
             call_ioctl("Query buffers", VIDIOC_QUERYBUF, &buffers_[i].buffer);
@@ -137,36 +170,98 @@ class V4LStream : public VideoStream {
             b.data = mmap(NULL, b.buffer.length, PROT_READ | PROT_WRITE,
                           MAP_SHARED, fd_, b.buffer.m.offset);
             if (b.data == MAP_FAILED) {
+                b.data = nullptr;
                 throw std::runtime_error(
                     std::string("mmap of buffer failed: ") + strerror(errno));
             }
         }
     }
 
+    // Gives a USERPTR buffer memory of its own from the pool. Huge pages
+    // back it if the pool uses them and the frame is large enough.
+    void allocateBuffer(Frame &b) {
+        if (b.owned.size() < sizeImage_)
+            b.owned.resize(sizeImage_);
+        b.data = b.owned.data();
+        b.buffer.m.userptr = reinterpret_cast<unsigned long>(b.owned.data());
+        b.buffer.length = static_cast<uint32_t>(b.owned.size());
+    }
+
+    // Sets up the buffers with the given memory and queues them.
+    void setupBuffers(uint32_t memory) {
+        memory_ = memory;
+        buffers_.resize(NUM_BUFFERS);
+        requestBuffers(static_cast<int>(buffers_.size()));
+        queryBuffer();
+        if (memory_ == V4L2_MEMORY_USERPTR) {
+            for (auto &b : buffers_)
+                allocateBuffer(b);
+        } else {
+            mapBuffer();
+        }
+        for (auto &b : buffers_) {
+            call_ioctl("Put buffer in queue", VIDIOC_QBUF, &b.buffer);
+        }
+    }
+
+    // Frees the buffers, which must not be queued.
+    void releaseBuffers() {
+        for (auto &b : buffers_) {
+            if (memory_ == V4L2_MEMORY_MMAP && b.data != nullptr &&
+                munmap(b.data, b.buffer.length)) {
+                std::cerr << "ERROR: munmap failed!\n";
+            }
+        }
+        buffers_.clear();
+        requestBuffers(0);
+    }
+
   public:
-    V4LStream(int width, int height, int format)
-        : VideoStream(width, height, format), fd_(-1) {
+    V4LStream(int width, int height, int format,
+              CaptureMemory memory = CaptureMemory::AUTO)
+        : VideoStream(width, height, format), fd_(-1),
+          compressed_(isCompressed(format)) {
         fd_ = open("/dev/video0", O_RDWR | O_NONBLOCK);
         if (fd_ < 0) {
             throw std::runtime_error(
                 std::string("Couldn't open /dev/video0: ") + strerror(errno));
         }
 
-        buffers_.resize(NUM_BUFFERS);
-
         try {
             getCapabilities();
             setFormat();
-            requestBuffers(static_cast<int>(buffers_.size()));
-            queryBuffer();
-            mapBuffer();
-            for (auto &b : buffers_) {
-                call_ioctl("Put buffer in queue", VIDIOC_QBUF, &b.buffer);
+            const uint32_t caps = bufferCapabilities();
+            if (memory == CaptureMemory::MMAP) {
+                setupBuffers(V4L2_MEMORY_MMAP);
+            } else if (memory == CaptureMemory::USERPTR) {
+                setupBuffers(V4L2_MEMORY_USERPTR);
+            } else if (caps & V4L2_BUF_CAP_SUPPORTS_USERPTR) {
+                try {
+                    setupBuffers(V4L2_MEMORY_USERPTR);
+                } catch (std::exception const &e) {
+                    std::cerr << "WARNING: Capturing into mmap buffers, "
+                              << "userptr failed: " << e.what() << "\n";
+                    releaseBuffers();
+                    setupBuffers(V4L2_MEMORY_MMAP);
+                }
+            } else {
+                setupBuffers(V4L2_MEMORY_MMAP);
             }
             call_ioctl("Activate streaming", VIDIOC_STREAMON, &STREAM_TYPE_);
             printParams();
 
+            for (int i = 0; i < WARMUP_FRAMES; ++i)
+                update();
         } catch (std::exception const &e) {
+            // Closing the device does not unmap its buffers. They can only be
+            // freed once streaming is off, which is a no-op if it never
+            // started.
+            ioctl(fd_, VIDIOC_STREAMOFF, &STREAM_TYPE_);
+            try {
+                releaseBuffers();
+            } catch (std::exception const &) {
+                // The mappings are gone, and closing frees the rest.
+            }
             close(fd_);
             throw std::runtime_error(
                 std::string("ERROR: Could not set up video streaming: ") +
@@ -177,19 +272,9 @@ class V4LStream : public VideoStream {
     V4LStream(V4LStream const &) = delete;
     V4LStream &operator=(V4LStream const &) = delete;
     ~V4LStream() {
-        for (auto &b : buffers_) {
-            if (b.buffer.flags & V4L2_BUF_FLAG_QUEUED) {
-                call_ioctl("Wait for buffer in queue", VIDIOC_DQBUF, &b.buffer);
-            }
-            if (munmap(b.data, b.buffer.length)) {
-                std::cerr << "ERROR: munmap failed!\n";
-            }
-
-            b.data = nullptr;
-        }
-
+        // Turning off streaming takes back all queued buffers.
         call_ioctl("Deactivate streaming", VIDIOC_STREAMOFF, &STREAM_TYPE_);
-        requestBuffers(0);
+        releaseBuffers();
 
         if (close(fd_)) {
             std::cerr << "[ERROR]: Failed to close video fd\n";
@@ -197,6 +282,7 @@ class V4LStream : public VideoStream {
     }
 
     void update() override {
+        StageScope stage(Stage::CAPTURE);
         if (!(buffers_[currFrame_].buffer.flags & V4L2_BUF_FLAG_QUEUED)) {
             TIMER("Put buffer in queue");
             call_ioctl("Put buffer in queue", VIDIOC_QBUF,
@@ -212,13 +298,39 @@ class V4LStream : public VideoStream {
         buffer_ = buffers_[currFrame_].data;
     }
 
+    // Hands over the memory that the camera captured into when it is the
+    // application's own, and captures the next frames into out's memory.
+    bool takeBuffer(Buffer &out) override {
+        if (memory_ != V4L2_MEMORY_USERPTR)
+            return false;
+        Frame &frame = buffers_[currFrame_];
+        const size_t size = getBufferSize();
+        std::swap(out, frame.owned);
+        out.resize(size);
+        allocateBuffer(frame);
+        buffer_ = frame.data;
+        return true;
+    }
+
     inline void *getBuffer() override { return buffer_; }
 
     inline size_t getBufferSize() const override {
-        // Hack: It seems like v4l reports the same size for YUYV as for MJPEG,
-        // so divide MJPEG buffer size by 5 because it is too big.
-        return format_ == V4L2_PIX_FMT_MJPEG
-                   ? buffers_[currFrame_].buffer.length / 5
-                   : buffers_[currFrame_].buffer.length;
+        // The buffers are allocated for the largest frame, compressed frames
+        // only fill bytesused of them.
+        const v4l2_buffer &buffer = buffers_[currFrame_].buffer;
+        return compressed_ ? buffer.bytesused : buffer.length;
+    }
+
+    // Drivers stamp buffers with CLOCK_MONOTONIC, which steady_clock uses as
+    // well, when they have been filled.
+    std::optional<std::chrono::steady_clock::time_point>
+    frameTime() const override {
+        const v4l2_buffer &buffer = buffers_[currFrame_].buffer;
+        if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+            V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+            return std::nullopt;
+        return std::chrono::steady_clock::time_point(
+            std::chrono::seconds(buffer.timestamp.tv_sec) +
+            std::chrono::microseconds(buffer.timestamp.tv_usec));
     }
 };
@@ -1,90 +1,651 @@
 #pragma once
 
+#include "capture-session.hpp"
+#include "egress-scheduler.hpp"
 #include "tcp-interface.hpp"
-#include "v4l-stream.hpp"
+#include "time-shift.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string.h>
+#include <thread>
+#include <vector>
 
-class VideoServer : TcpInterface {
-    int localSocket_ = -1;
-    int port_ = -1;
+// Serves one connected client from the shared capture session, with one
+// coroutine sending the frames and another handling what the client sends.
+// Clients that rewind are sent frames from the time shift ring, until they
+// catch up with the live frames. Every frame waits for the client's turn in
+// the egress scheduler.
+class ClientConnection
+    : TcpInterface,
+      public std::enable_shared_from_this<ClientConnection> {
+    // Capabilities that the server agrees to.
+    static constexpr uint64_t CAPABILITIES =
+        CAP_MOTION_EVENTS | CAP_CROP | CAP_SEEK | CAP_RECONFIGURE;
+    // Longest wait between two played back frames, so that gaps in the
+    // recording, e.g. while the device was reopened, are skipped.
+    static constexpr std::chrono::seconds MAX_PLAYBACK_GAP{1};
+
+    // A rewind asked for by the client.
+    struct Seek {
+        std::chrono::milliseconds ago;
+        int speedPercent;
+    };
+
+    AsyncSocket socket_;
+    CaptureSession &session_;
+    TimeShiftRing &ring_;
+    EgressScheduler::Client egress_;
+    // Whether frames are only sent once the previous one has mostly left the
+    // socket, instead of queueing them in the socket's buffer.
+    bool lowLatency_ = false;
     int width_ = 0;
     int height_ = 0;
     int format_ = 0;
+    uint64_t flags_ = 0;
+    uint64_t capabilities_ = 0;
+    // JPEG quality that MJPEG is encoded with, 0 for the camera's MJPEG.
+    int quality_ = 0;
+    // Set when the client has left or sent something invalid.
+    bool closed_ = false;
+    // Region of the stream that the client wants, if not all of it.
+    std::optional<Region> crop_;
+    // Size of the frames that the client was last told about.
+    int sentWidth_ = 0;
+    int sentHeight_ = 0;
+    // Capabilities that the client asked for and the server agrees to, of
+    // which capabilities_ has those that the current configuration allows.
+    uint64_t wantedCapabilities_ = 0;
+    // Whether the stream has been configured and frames are being sent.
+    bool streaming_ = false;
+    // A configuration to switch to before the next frame.
+    std::optional<StreamConfig> reconfigure_;
+    // The configuration before the last switch, until the first frame of the
+    // new one, to go back to if the device can't capture it.
+    std::optional<StreamConfig> fallback_;
+    // A rewind to start before the next frame.
+    std::optional<Seek> seek_;
+    // Whether frames are played back from the ring, and where: the last
+    // frame sent, and which frame was sent when, to pace the rest by.
+    bool playing_ = false;
+    std::chrono::steady_clock::time_point playPosition_;
+    std::chrono::steady_clock::time_point playFrom_;
+    std::chrono::steady_clock::time_point playStart_;
+    int speedPercent_ = 100;
+    std::unique_ptr<AsyncTimer> timer_;
 
-    void streamConfigHandler(int sck, uint64_t size) override {
-        Package pkg = {.type = PKG_TYPE::STREAM_CONFIG, .data = {}};
-        readPackageData(sck, pkg, size);
-        width_ = static_cast<int>(getNumFromVec(0, pkg.data));
-        height_ = static_cast<int>(getNumFromVec(1, pkg.data));
-        format_ = static_cast<int>(getNumFromVec(2, pkg.data));
+    void setStreamConfig(const StreamConfig &cfg) {
+        width_ = static_cast<int>(cfg.width);
+        height_ = static_cast<int>(cfg.height);
+        format_ = static_cast<int>(cfg.format);
+        flags_ = cfg.flags;
+        quality_ = 0;
+        if (format_ == V4L2_PIX_FMT_MJPEG && cfg.quality > 0)
+            quality_ = static_cast<int>(std::min<uint64_t>(cfg.quality, 100));
 
-        std::cout << "Recieved stream configuration:\n";
+        std::cout << "Recieved stream configuration (protocol version "
+                  << version_ << "):\n";
         std::cout << "Got width = " << width_ << std::endl;
         std::cout << "Got height = " << height_ << std::endl;
-        std::cout << "Got format = " << format_ << std::endl;
+        std::cout << "Got format = " << formatToString(format_) << std::endl;
+        std::cout << "Got flags = " << flags_ << std::endl;
+        if (quality_ > 0)
+            std::cout << "Got quality = " << quality_ << std::endl;
+    }
+
+    StreamConfig streamConfig() const {
+        return {.width = static_cast<uint64_t>(width_),
+                .height = static_cast<uint64_t>(height_),
+                .format = static_cast<uint64_t>(format_),
+                .flags = flags_,
+                .capabilities = capabilities_,
+                .quality = static_cast<uint64_t>(quality_)};
+    }
+
+    // Version 1 clients configure the stream with a STREAM_CONFIG. They know
+    // nothing about capabilities but have always gotten the motion events.
+    // Version 2 clients send one while streaming to reconfigure it, which is
+    // done before the next frame.
+    Task<> streamConfigHandler(AsyncSocket &socket, uint64_t size) override {
+        StreamConfig cfg = co_await readStreamConfig(socket, size);
+        if (!streaming_) {
+            setStreamConfig(cfg);
+            wantedCapabilities_ = CAP_MOTION_EVENTS;
+        } else if (!(wantedCapabilities_ & CAP_RECONFIGURE)) {
+            co_await sendMsg(socket, "Reconfiguring is not supported by this "
+                                     "client");
+        } else if (cfg.width == 0 || cfg.height == 0 || cfg.width > 16384 ||
+                   cfg.height > 16384) {
+            co_await sendMsg(socket, "Invalid stream configuration");
+        } else {
+            reconfigure_ = cfg;
+        }
+    }
+
+    Task<> helloHandler(AsyncSocket &socket, uint64_t size) override {
+        StreamConfig cfg = co_await readStreamConfig(socket, size);
+        setStreamConfig(cfg);
+        wantedCapabilities_ = cfg.capabilities & CAPABILITIES;
     }
 
-    void frameHandler(int sck, uint64_t size) override {
-        Package pkg = {.type = PKG_TYPE::FRAME, .data = {}};
-        readPackageData(sck, pkg, size);
+    // The frame size that the socket is set up for, guessed for compressed
+    // frames.
+    size_t sendSize(int width, int height) const {
+        if (isCompressed(format_))
+            return frameSize(V4L2_PIX_FMT_YUYV, width, height) / 8;
+        return frameSize(format_, width, height);
+    }
+
+    Task<> cropHandler(AsyncSocket &socket, uint64_t size) override {
+        Region region = co_await readCrop(socket, size);
+        if (!(capabilities_ & CAP_CROP)) {
+            co_await sendMsg(socket,
+                             "Cropping is not supported for this stream");
+            co_return;
+        }
+
+        if (region.width <= 0 || region.height <= 0 ||
+            (region.x <= 0 && region.y <= 0 &&
+             int64_t(region.x) + region.width >= width_ &&
+             int64_t(region.y) + region.height >= height_))
+            crop_.reset();
+        else
+            crop_ = region;
+    }
+
+    Task<> seekHandler(AsyncSocket &socket, uint64_t size) override {
+        auto [ago, speedPercent] = co_await readSeek(socket, size);
+        if (!(capabilities_ & CAP_SEEK) || !ring_.enabled()) {
+            co_await sendMsg(socket, "Rewinding is not supported by this "
+                                     "server");
+        } else if (!ring_.canPlay(width_, height_, format_)) {
+            co_await sendMsg(socket, "Rewinding is only supported for MJPEG "
+                                     "in the recorded resolution");
+        } else if (speedPercent < 1 || speedPercent > 10000) {
+            co_await sendMsg(socket, "Invalid playback speed");
+        } else {
+            seek_ = Seek{ago, speedPercent};
+        }
+    }
+
+    // Starts playing back from the ring as asked for, or goes back to the
+    // live frames.
+    void startPlayback(const Seek &seek) {
+        const auto now = std::chrono::steady_clock::now();
+        std::shared_ptr<SharedFrame> first;
+        if (seek.ago.count() > 0)
+            first = ring_.seek(now - seek.ago);
+        playing_ = first != nullptr;
+        if (!playing_)
+            return;
+        // The first frame is due right away.
+        playPosition_ = first->timestamp() - std::chrono::nanoseconds(1);
+        playFrom_ = first->timestamp();
+        playStart_ = now;
+        speedPercent_ = seek.speedPercent;
+        if (!timer_)
+            timer_ = std::make_unique<AsyncTimer>(socket_.loop());
+    }
+
+    // Returns the next frame of the playback when it is due, or null once
+    // the playback has caught up with the live frames.
+    Task<std::shared_ptr<SharedFrame>> nextPlayback() {
+        auto frame = ring_.after(playPosition_);
+        if (!frame) {
+            playing_ = false;
+            co_return nullptr;
+        }
+
+        auto due = playStart_ + (frame->timestamp() - playFrom_) * 100 /
+                                    speedPercent_;
+        const auto latest = std::chrono::steady_clock::now() +
+                            MAX_PLAYBACK_GAP;
+        if (due > latest) {
+            playStart_ -= due - latest;
+            due = latest;
+        }
+        co_await timer_->sleepUntil(due);
+        playPosition_ = frame->timestamp();
+        co_return frame;
+    }
+
+    Task<> frameHandler(AsyncSocket &socket, uint64_t size) override {
+        Package pkg = {.type = PKG_TYPE::FRAME};
+        co_await readPackageData(socket, pkg, size);
         std::cerr << "WARNING: Server recieved a frame. Throwing it away.\n";
     }
 
-    void connectionWork(int socket) {
+    // Maps the requested region to the frame, which can be captured in a
+    // higher resolution than the client's stream. The region is aligned to
+    // even pixels so that it can be cropped and converted.
+    Region frameRegion(const SharedFrame &frame) const {
+        auto map = [](int64_t v, int size, int frameSize) {
+            int64_t scaled = std::clamp<int64_t>(v, 0, size) * frameSize / size;
+            return static_cast<int>(scaled) & ~1;
+        };
+        int x0 = map(crop_->x, width_, frame.width());
+        int x1 = map(int64_t(crop_->x) + crop_->width, width_, frame.width());
+        int y0 = map(crop_->y, height_, frame.height());
+        int y1 =
+            map(int64_t(crop_->y) + crop_->height, height_, frame.height());
+        if (x1 <= x0) {
+            x0 = std::min(x0, frame.width() - 2);
+            x1 = x0 + 2;
+        }
+        if (y1 <= y0) {
+            y0 = std::min(y0, (frame.height() & ~1) - 2);
+            y1 = y0 + 2;
+        }
+        return {x0, y0, x1 - x0, y1 - y0};
+    }
+
+    Task<> sendFrame(SharedFrame &frame) {
+        int width = width_;
+        int height = height_;
+        const Buffer *buffer = nullptr;
+        // Only the played back frames can be compressed here, and only
+        // uncompressed ones can be cropped.
+        if (crop_ && frame.format() == V4L2_PIX_FMT_YUYV) {
+            Region region = frameRegion(frame);
+            width = region.width;
+            height = region.height;
+            buffer = &frame.crop(region, format_, quality_);
+        } else {
+            buffer = &frame.get(width_, height_, format_, quality_);
+        }
+
+        // Frames change size with the crop, so tell the client first.
+        if (width != sentWidth_ || height != sentHeight_) {
+            if (lowLatency_)
+                setLowLatency(socket_.fd(), sendSize(width, height));
+            sentWidth_ = width;
+            sentHeight_ = height;
+            co_await sendStreamConfig(
+                socket_, {.width = static_cast<uint64_t>(width),
+                          .height = static_cast<uint64_t>(height),
+                          .format = static_cast<uint64_t>(format_),
+                          .flags = flags_,
+                          .capabilities = capabilities_,
+                          .quality = static_cast<uint64_t>(quality_)});
+        }
+
+        co_await egress_.turn(buffer->size(), socket_.loop());
+        co_await TcpInterface::sendFrame(
+            socket_, buffer->data(), buffer->size(),
+            frame.motion() ? PKG_FLAG_MOTION : 0,
+            static_cast<uint32_t>(frame.sequence()));
+    }
+
+    // Handles what the client sends until it leaves, and then shuts down the
+    // connection so that sending frames ends too. self keeps the connection
+    // alive while this runs.
+    Task<> receive([[maybe_unused]] std::shared_ptr<ClientConnection> self) {
         try {
-            sendMsg(socket, "Connection established");
-            sendMsg(socket, "Please send stream configuration");
-
-            // Handle recieved packages until we get a STREAM_CONFIG.
-            while (true) {
-                auto type = handlePackage(socket);
-                if (type.value() == PKG_TYPE::STREAM_CONFIG)
-                    break;
+            while (true)
+                co_await handlePackage(socket_);
+        } catch (std::exception const &e) {
+            std::cerr << "Closing connection: " << e.what() << std::endl;
+        }
+        closed_ = true;
+        socket_.shutdown(SHUT_RDWR);
+    }
+
+    Task<> run() {
+        std::string error;
+        try {
+            co_await stream();
+        } catch (std::exception const &e) {
+            error = e.what();
+        }
+        if (closed_)
+            co_return;
+
+        std::cerr << "Closing connection: " << error << std::endl;
+        // Tell the client why, it may still be listening.
+        try {
+            if (version_ != 0)
+                co_await sendMsg(socket_, "ERROR: " + error);
+        } catch (std::exception const &) {
+        }
+        socket_.shutdown(SHUT_RDWR);
+    }
+
+    // Settles what can be streamed of what the client asked for, subscribes
+    // to the session for it and tells the client.
+    Task<std::unique_ptr<CaptureSession::Subscription>> configure() {
+        capabilities_ = wantedCapabilities_;
+        // Version 2 clients are told the format in the reply, so a format
+        // that can't be produced falls back to YUYV instead of failing.
+        if (version_ >= 2 && !isCompressed(format_) &&
+            !canConvert(V4L2_PIX_FMT_YUYV, format_)) {
+            std::cout << "Can not stream in " << formatToString(format_)
+                      << ", using yuyv\n";
+            format_ = V4L2_PIX_FMT_YUYV;
+        }
+
+        // Only frames captured compressed can't be looked at.
+        const bool captureCompressed = isCompressed(format_) && quality_ == 0;
+        if ((flags_ & STREAM_MOTION_ONLY) && captureCompressed) {
+            if (version_ == 1)
+                co_await sendMsg(socket_, "Motion detection needs an "
+                                          "uncompressed format, sending all "
+                                          "frames");
+            flags_ &= ~STREAM_MOTION_ONLY;
+        }
+        if (captureCompressed)
+            capabilities_ &= ~CAP_CROP;
+        // The ring is recorded in YUYV, which camera's MJPEG can't be shared
+        // with.
+        if (captureCompressed || !ring_.enabled())
+            capabilities_ &= ~CAP_SEEK;
+
+        // Version 1 clients can't be told that they get another resolution
+        // than they asked for.
+        auto admitted = egress_.admit(
+            width_, height_, version_ >= 2 && !captureCompressed,
+            [this](int width, int height) { return sendSize(width, height); });
+        if (!admitted)
+            throw std::invalid_argument("The server's bandwidth budget is "
+                                        "used up");
+        if (admitted->first != width_) {
+            std::cout << "Lowering resolution to " << admitted->first << "x"
+                      << admitted->second << " to fit the bandwidth budget\n";
+            width_ = admitted->first;
+            height_ = admitted->second;
+        }
+
+        auto subscription =
+            session_.subscribe(width_, height_, format_, quality_);
+
+        if (version_ == 1)
+            co_await sendMsg(socket_,
+                             "Server configured the video stream successfully");
+        else
+            co_await sendStreamConfig(socket_, streamConfig());
+        sentWidth_ = width_;
+        sentHeight_ = height_;
+        if (lowLatency_)
+            setLowLatency(socket_.fd(), sendSize(width_, height_));
+        co_return subscription;
+    }
+
+    // Goes back to the configuration before the last switch, since the
+    // session can't serve the new one.
+    Task<std::unique_ptr<CaptureSession::Subscription>>
+    restore(const StreamConfig &previous, const std::string &error) {
+        co_await sendMsg(socket_, "Can not reconfigure the stream: " + error);
+        setStreamConfig(previous);
+        fallback_.reset();
+        co_return co_await configure();
+    }
+
+    // Switches to the configuration that the client has asked for while
+    // streaming, or back to the current one if the session can't serve it,
+    // e.g. while other clients have the camera in another format.
+    Task<std::unique_ptr<CaptureSession::Subscription>>
+    reconfigure(std::unique_ptr<CaptureSession::Subscription> subscription) {
+        const StreamConfig current = streamConfig();
+        setStreamConfig(*reconfigure_);
+        reconfigure_.reset();
+        // Regions are given in the coordinates of the old frames.
+        crop_.reset();
+
+        // The capture format can only change when no other client uses it,
+        // so the old subscription goes first.
+        subscription.reset();
+        std::string error;
+        try {
+            subscription = co_await configure();
+            fallback_ = current;
+        } catch (std::invalid_argument const &e) {
+            error = e.what();
+        }
+        if (!subscription)
+            subscription = co_await restore(current, error);
+        if (playing_ && !ring_.canPlay(width_, height_, format_)) {
+            playing_ = false;
+            co_await sendMsg(socket_, "Playing live");
+        }
+        co_return subscription;
+    }
+
+    // Sends frames until the client is gone.
+    Task<> stream() {
+        // Clients start with a HELLO in version 2, or with a STREAM_CONFIG in
+        // version 1, and the header tells which.
+        while (true) {
+            auto type = co_await handlePackage(socket_);
+            if (type == PKG_TYPE::STREAM_CONFIG || type == PKG_TYPE::HELLO)
+                break;
+        }
+        if (version_ == 1)
+            co_await sendMsg(socket_, "Connection established");
+
+        auto subscription = co_await configure();
+        streaming_ = true;
+
+        // What the client sends from now on is handled alongside.
+        socket_.loop().spawn(receive(shared_from_this()));
+
+        const auto preRoll =
+            std::chrono::milliseconds(session_.motionConfig().preRollMs);
+        // Recent frames without motion, sent when motion starts.
+        std::deque<std::shared_ptr<SharedFrame>> preRollFrames;
+        bool motion = false;
+        uint64_t lastSequence = 0;
+        bool lastLive = true;
+
+        while (true) {
+            // Frames captured while the socket is full replace each other in
+            // the session, so that the newest one is sent next.
+            if (lowLatency_)
+                co_await socket_.waitWritable();
+            if (reconfigure_) {
+                subscription = co_await reconfigure(std::move(subscription));
+                preRollFrames.clear();
+            }
+            const bool motionOnly = flags_ & STREAM_MOTION_ONLY;
+            if (seek_) {
+                startPlayback(*seek_);
+                seek_.reset();
+                preRollFrames.clear();
+                co_await sendMsg(socket_, playing_ ? "Playing back"
+                                                   : "Playing live");
             }
-            V4LStream v4l(width_, height_, format_);
 
-            sendMsg(socket, "Server configured the video stream successfully");
+            std::shared_ptr<SharedFrame> frame;
+            if (playing_) {
+                frame = co_await nextPlayback();
+                if (!frame)
+                    co_await sendMsg(socket_, "Playing live");
+            }
+            const bool live = frame == nullptr;
+            if (live) {
+                std::string error;
+                try {
+                    frame = co_await subscription->nextAsync(socket_.loop());
+                } catch (std::exception const &e) {
+                    if (!fallback_)
+                        throw;
+                    error = e.what();
+                }
+                if (!frame) {
+                    subscription.reset();
+                    subscription = co_await restore(*fallback_, error);
+                    continue;
+                }
+                fallback_.reset();
+                // Played back already, before catching up.
+                if (frame->sequence() <= lastSequence)
+                    continue;
+            }
 
-            while (true) {
-                v4l.update();
-                sendBuffer(socket, v4l.getBuffer(), v4l.getBufferSize());
-                handlePackage(socket, MSG_DONTWAIT);
+            // Frames that came and went while the last one was sent.
+            uint64_t skipped = 0;
+            if (live && lastLive && lastSequence != 0 && !motionOnly)
+                skipped = frame->sequence() - lastSequence - 1;
+            lastSequence = frame->sequence();
+            lastLive = live;
+            if (frame->motion() != motion) {
+                motion = frame->motion();
+                if (capabilities_ & CAP_MOTION_EVENTS)
+                    co_await sendMsg(socket_, motion ? "Motion started"
+                                                     : "Motion stopped");
+            }
+
+            // Played back frames are all sent, since the client asked for
+            // them.
+            if (live && motionOnly && !motion) {
+                preRollFrames.push_back(frame);
+                while (frame->timestamp() -
+                           preRollFrames.front()->timestamp() >
+                       preRoll)
+                    preRollFrames.pop_front();
+            } else {
+                for (auto &f : preRollFrames) {
+                    co_await sendFrame(*f);
+                    session_.frameSent(*f, 0, false);
+                }
+                preRollFrames.clear();
+                co_await sendFrame(*frame);
+                session_.frameSent(*frame, skipped, live);
             }
-        } catch (std::exception const &e) {
-            std::cerr << "Closing connection: " << e.what() << std::endl;
         }
+    }
 
-        close(socket);
+  public:
+    ClientConnection(int socket, EventLoop &loop, CaptureSession &session,
+                     TimeShiftRing &ring, EgressScheduler &egress,
+                     bool lowLatency = false)
+        : socket_(loop, socket), session_(session), ring_(ring),
+          egress_(egress, peerAddress(socket)), lowLatency_(lowLatency) {}
+
+    // Serves a client on loop until it leaves.
+    static Task<> serve(int socket, EventLoop &loop, CaptureSession &session,
+                        TimeShiftRing &ring, EgressScheduler &egress,
+                        bool lowLatency) {
+        auto conn = std::make_shared<ClientConnection>(
+            socket, loop, session, ring, egress, lowLatency);
+        co_await conn->run();
+    }
+};
+
+// Serves clients from one event loop per core, so that connections cost no
+// threads of their own.
+class VideoServer {
+    int port_ = -1;
+    std::atomic<bool> stopped_ = false;
+    bool lowLatency_ = false;
+    CaptureSession session_;
+    TimeShiftRing ring_;
+    EgressScheduler egress_;
+    std::vector<std::unique_ptr<EventLoop>> loops_;
+    // On the first loop, which also accepts the clients.
+    std::unique_ptr<AsyncSocket> listener_;
+
+    // Hands out new clients to the loops in turn.
+    Task<> acceptConnections() {
+        size_t next = 0;
+        while (true) {
+            int socket = -1;
+            try {
+                socket = co_await listener_->accept();
+            } catch (std::exception const &) {
+                if (stopped_)
+                    co_return;
+                throw;
+            }
+            if (stopped_) {
+                close(socket);
+                co_return;
+            }
+            std::cout << "Connection accepted" << std::endl; // DEBUG
+
+            EventLoop &loop = *loops_[next++ % loops_.size()];
+            loop.spawn(ClientConnection::serve(socket, loop, session_, ring_,
+                                               egress_, lowLatency_));
+        }
     }
 
   public:
-    VideoServer(int port) : port_(port) {
-        localSocket_ = createListenSocket(port_);
+    // With lowLatency, clients never get frames queued up in their sockets,
+    // the frames are instead replaced by newer ones until the client has
+    // taken the previous one.
+    VideoServer(int port, const CaptureConfig &captureConfig = {},
+                bool lowLatency = false,
+                const TimeShiftConfig &timeShiftConfig = {},
+                const EgressConfig &egressConfig = {})
+        : port_(port), lowLatency_(lowLatency), session_(captureConfig),
+          ring_(timeShiftConfig), egress_(egressConfig) {
+        const unsigned loops =
+            std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < loops; ++i)
+            loops_.push_back(std::make_unique<EventLoop>());
+
+        int localSocket = createListenSocket(port_);
+        if (listen(localSocket, SOMAXCONN) < 0) {
+            close(localSocket);
+            throw std::runtime_error(std::string("Could not listen: ") +
+                                     strerror(errno));
+        }
+
+        // Find out which port we got if any port was asked for.
+        sockaddr_in addr = {};
+        socklen_t addrLen = sizeof(addr);
+        if (getsockname(localSocket, (sockaddr *)&addr, &addrLen) == 0)
+            port_ = ntohs(addr.sin_port);
+        listener_ = std::make_unique<AsyncSocket>(*loops_[0], localSocket);
     }
 
-    ~VideoServer() { close(localSocket_); }
+    ~VideoServer() { stop(); }
 
-    void run() {
-        listen(localSocket_, 3);
+    int port() const { return port_; }
 
+    // Makes run() return. Can be called from any thread.
+    void stop() {
+        stopped_ = true;
+        loops_[0]->stop();
+    }
+
+    void run() {
         std::cout << "Waiting for connections...\n"
                   << "Server Port:" << port_ << std::endl;
 
-        // accept connection from an incoming client
-        int remoteSocket = -1;
-        constexpr int addrLen = sizeof(struct sockaddr_in);
-        struct sockaddr_in remoteAddr = {};
-        while (true) {
-            remoteSocket = accept(localSocket_, (struct sockaddr *)&remoteAddr,
-                                  (socklen_t *)&addrLen);
-            if (remoteSocket < 0) {
-                throw std::runtime_error("Could not accept connection");
-            }
-            std::cout << "Connection accepted" << std::endl; // DEBUG
+        ThreadPlacer &placer = ThreadPlacer::shared();
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < loops_.size(); ++i) {
+            threads.emplace_back([&placer, loop = loops_[i].get()] {
+                placer.place(ThreadRole::NETWORK);
+                loop->run();
+            });
+        }
+        placer.place(ThreadRole::NETWORK);
+        if (ring_.enabled())
+            loops_[0]->spawn(ring_.record(session_, *loops_[0], stopped_));
+        if (egress_.limited())
+            loops_[0]->spawn(egress_.run(*loops_[0]));
 
-            connectionWork(remoteSocket);
+        std::exception_ptr error;
+        try {
+            loops_[0]->run(acceptConnections());
+        } catch (...) {
+            error = std::current_exception();
         }
+
+        // Disconnect everyone and wait for them.
+        stopped_ = true;
+        session_.stop();
+        egress_.stop();
+        for (auto &loop : loops_)
+            loop->stop();
+        loops_[0]->run();
+        for (auto &thread : threads)
+            thread.join();
+        if (error)
+            std::rethrow_exception(error);
     }
 };
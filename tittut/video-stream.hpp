@@ -1,8 +1,16 @@
 // Abstract class for a videostream.
 #pragma once
 
+#include "buffer-pool.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
 #include <tuple>
 
+class FrameSink;
+
 class VideoStream {
   protected:
     void *buffer_;
@@ -18,6 +26,46 @@ class VideoStream {
     virtual void *getBuffer() = 0;
     virtual size_t getBufferSize() const = 0;
     virtual void update() = 0;
+    // Moves the current frame into out, swapping in out's memory to capture
+    // into, if the frame is in memory that the stream can give away. The
+    // frame is then gone from getBuffer(). Returns false if it can not.
+    virtual bool takeBuffer(Buffer &) { return false; }
+    // Makes an update() that is blocked in another thread return, by throwing
+    // if needed. Streams whose updates never block for long do nothing.
+    virtual void interrupt() {}
+    // Asks for only a region of the frames, given in the coordinates of the
+    // full frames, after which the frames get the size of the region. An
+    // empty region asks for the full frames again. Returns false if the
+    // stream can not crop.
+    virtual bool crop(const Region &) { return false; }
+    // Makes update() move the frames straight into sink instead of the
+    // buffer, or stop doing so if sink is null. Returns false if the stream
+    // can not.
+    virtual bool forwardTo(FrameSink *) { return false; }
+    // Asks for the frames from ago back in time, played back at speedPercent
+    // of real time until they have caught up, or the live frames again if ago
+    // is 0. Returns false if the stream can not rewind.
+    virtual bool seek(std::chrono::milliseconds, int) { return false; }
+    // Asks for frames of another size, format or JPEG quality (see
+    // quality()), which update() switches to at a frame boundary once the
+    // source has them, without reopening the stream. getMetaData() tells
+    // when. Returns false if the stream can not.
+    virtual bool reconfigure(int, int, int, int) { return false; }
+    // JPEG quality that the source encodes MJPEG with, 0 if the frames are
+    // as captured.
+    virtual int quality() const { return 0; }
+    // Frames that the source is known to have skipped, e.g. from gaps in the
+    // sequence numbers of a network stream.
+    virtual uint64_t droppedFrames() const { return 0; }
+    // Whether the source has found motion in the current frame, if it
+    // detects motion by itself.
+    virtual std::optional<bool> motion() const { return std::nullopt; }
+    // When the current frame was ready to be picked up, e.g. when the camera
+    // finished it, if the stream knows.
+    virtual std::optional<std::chrono::steady_clock::time_point>
+    frameTime() const {
+        return std::nullopt;
+    }
 
     std::tuple<int, int, int> getMetaData() const {
         return {width_, height_, format_};